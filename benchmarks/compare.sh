@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+# Runs every benchmark with and without register instructions and prints the wall time of both.
+# Build clox with -DDEBUG_LOG_DISPATCH:BOOL=ON to get the number of dispatched instructions as well.
+#
+# usage: benchmarks/compare.sh path/to/clox [runs]
+
+set -e
+
+CLOX=${1:?usage: $0 path/to/clox [runs]}
+RUNS=${2:-3}
+DIR=$(dirname "$0")
+
+# Best time out of RUNS, benchmarks print the elapsed time last (or right before the dispatch count).
+run() {
+    local best=""
+    local count=""
+    for _ in $(seq "$RUNS"); do
+        local output
+        output=$("$CLOX" "$@")
+        local time
+        time=$(echo "$output" | grep -E '^[0-9.e-]+$' | tail -n 1)
+        count=$(echo "$output" | grep -E 'instructions$' | awk '{print $1}')
+        if [ -z "$best" ] || awk "BEGIN {exit !($time < $best)}"; then
+            best=$time
+        fi
+    done
+    printf "%10.4fs %12s" "$best" "${count:--}"
+}
+
+printf "%-20s %24s %24s\n" "benchmark" "registers" "stack only"
+for file in "$DIR"/*.lox; do
+    printf "%-20s %s %s\n" "$(basename "$file")" "$(run "$file")" "$(run --no-registers "$file")"
+done
@@ -5,16 +5,22 @@ void initBuffer(Buffer *buff) {
     initTable(&buff->globalVarIdentifiers);
     initValueArray(&buff->globalVars);
     initTable(&buff->constVarIdentifiers);
+    initTable(&buff->constVarOrder);
+    buff->constCount = 0;
 }
 
 void freeBuffer(Buffer *buff) {
     freeTable(&buff->globalVarIdentifiers);
     freeValueArray(&buff->globalVars);
     freeTable(&buff->constVarIdentifiers);
+    freeTable(&buff->constVarOrder);
 }
 
 void markBufferRoots() {
     for (int i = 0; i < buffer.globalVars.count; i++) {
         markValue(buffer.globalVars.values[i]);
     }
+    // Holds the values of consts the compiler inlines, as well as their names.
+    markTable(&buffer.constVarIdentifiers);
+    markTable(&buffer.constVarOrder);
 }
\ No newline at end of file
@@ -7,6 +7,10 @@ typedef struct {
     Table globalVarIdentifiers;
     ValueArray globalVars;
     Table constVarIdentifiers;
+    // The order global consts were declared in, so a function compiled lazily only folds the ones declared
+    // before it. Consts restored from a snapshot aren't in it, they come before everything.
+    Table constVarOrder;
+    int constCount;
 } Buffer;
 
 extern Buffer buffer;
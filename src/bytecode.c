@@ -0,0 +1,1084 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "vm.h"
+
+// .loxc files and snapshots share one layout: the header, every string in the file, the objects, then the
+// names of the globals in the order of their indices (which the code refers to them by) with their values in
+// a snapshot, the consts the compiler folds, and the script a .loxc file runs. Strings and objects are
+// referred to by their index in those lists, integers are little-endian. Each object is its type, the size
+// of the rest and the rest, so loading can go over them in passes: objects refer to each other in any order,
+// but some have to exist or be complete before others can be created.
+#define BYTECODE_MAGIC "LOXC"
+// The opcodes a file was written with, so bytecode from a build with other ones gets rejected too.
+#define BYTECODE_OPCODES (OP_TAIL_INVOKE_SUPER_LONG + 1)
+
+#define FUNCTION_READS_ENCLOSING_FRAME 1
+#define FUNCTION_CAPTURES_VALUES 2
+
+// Functions, upvalues, natives, classes and arrays get created first, closures and instances once their
+// function or class is complete, bound methods once their closure exists. Everything gets filled in last.
+#define LOAD_PASSES 5
+
+typedef enum {
+    VALUE_NUMBER,
+    VALUE_NIL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_UNDEFINED,
+    VALUE_STRING,
+    VALUE_OBJECT,
+} ValueTag;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} Bytes;
+
+typedef struct {
+    // Strings written so far, keyed on the string with their index as the value.
+    Table strings;
+    ObjString **stringList;
+    int stringCount;
+    int stringCapacity;
+    // Objects written so far, found through an open addressing table of their indices plus one.
+    Obj **objects;
+    int objectCount;
+    int objectCapacity;
+    int *objectIndex;
+    int objectIndexCapacity;
+} Writer;
+
+static void writeBytes(Bytes *bytes, const void *data, size_t count) {
+    if (bytes->capacity < bytes->count + count) {
+        while (bytes->capacity < bytes->count + count) {
+            bytes->capacity = GROW_CAPACITY(bytes->capacity);
+        }
+        bytes->bytes = realloc(bytes->bytes, bytes->capacity);
+    }
+    memcpy(bytes->bytes + bytes->count, data, count);
+    bytes->count += count;
+}
+
+static void writeByte(Bytes *bytes, uint8_t byte) {
+    writeBytes(bytes, &byte, 1);
+}
+
+static void writeInt(Bytes *bytes, uint32_t value) {
+    uint8_t data[4] = {value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff};
+    writeBytes(bytes, data, 4);
+}
+
+static void patchInt(Bytes *bytes, size_t offset, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        bytes->bytes[offset + i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static void writeNumber(Bytes *bytes, double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeInt(bytes, (uint32_t) bits);
+    writeInt(bytes, (uint32_t) (bits >> 32));
+}
+
+static int stringIndex(Writer *writer, ObjString *string) {
+    Value index;
+    if (tableGet(&writer->strings, string, &index)) {
+        return (int) AS_NUMBER(index);
+    }
+    if (writer->stringCapacity < writer->stringCount + 1) {
+        writer->stringCapacity = GROW_CAPACITY(writer->stringCapacity);
+        writer->stringList = realloc(writer->stringList, sizeof(ObjString *) * writer->stringCapacity);
+    }
+    writer->stringList[writer->stringCount] = string;
+    tableSet(&writer->strings, string, NUMBER_VAL(writer->stringCount));
+    return writer->stringCount++;
+}
+
+static int *findObjectSlot(Writer *writer, Obj *object) {
+    uint32_t mask = (uint32_t) writer->objectIndexCapacity - 1;
+    uint32_t slot = (uint32_t) (((uintptr_t) object >> 3) * 2654435761u) & mask;
+    while (writer->objectIndex[slot] != 0 && writer->objects[writer->objectIndex[slot] - 1] != object) {
+        slot = (slot + 1) & mask;
+    }
+    return &writer->objectIndex[slot];
+}
+
+// The index of object in the list of objects written, which it joins at the end unless it is there.
+static int objectIndex(Writer *writer, Obj *object) {
+    if (writer->objectIndexCapacity > 0 && *findObjectSlot(writer, object) != 0) {
+        return *findObjectSlot(writer, object) - 1;
+    }
+
+    if (writer->objectCapacity < writer->objectCount + 1) {
+        writer->objectCapacity = GROW_CAPACITY(writer->objectCapacity);
+        writer->objects = realloc(writer->objects, sizeof(Obj *) * writer->objectCapacity);
+    }
+    writer->objects[writer->objectCount++] = object;
+
+    // Kept at most half full.
+    if (writer->objectCount * 2 > writer->objectIndexCapacity) {
+        free(writer->objectIndex);
+        writer->objectIndexCapacity = GROW_CAPACITY(writer->objectCapacity) * 2;
+        writer->objectIndex = calloc(writer->objectIndexCapacity, sizeof(int));
+        for (int i = 0; i < writer->objectCount; i++) {
+            *findObjectSlot(writer, writer->objects[i]) = i + 1;
+        }
+    } else {
+        *findObjectSlot(writer, object) = writer->objectCount;
+    }
+    return writer->objectCount - 1;
+}
+
+static bool writeValue(Writer *writer, Bytes *bytes, Value value) {
+    if (IS_NUMBER(value)) {
+        writeByte(bytes, VALUE_NUMBER);
+        writeNumber(bytes, AS_NUMBER(value));
+    } else if (IS_NIL(value)) {
+        writeByte(bytes, VALUE_NIL);
+    } else if (IS_BOOL(value)) {
+        writeByte(bytes, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+    } else if (IS_UNDEFINED(value)) {
+        writeByte(bytes, VALUE_UNDEFINED);
+    } else if (IS_STRING(value)) {
+        writeByte(bytes, VALUE_STRING);
+        writeInt(bytes, stringIndex(writer, AS_STRING(value)));
+    } else if (IS_OBJ(value) && !IS_SHAPE(value)) {
+        writeByte(bytes, VALUE_OBJECT);
+        writeInt(bytes, objectIndex(writer, AS_OBJ(value)));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Methods, fields or consts, name then value.
+static bool writeTable(Writer *writer, Bytes *bytes, Table *table) {
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        count += table->entries[i].key != NULL;
+    }
+    writeInt(bytes, count);
+    bool written = true;
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL) {
+            writeInt(bytes, stringIndex(writer, entry->key));
+            written &= writeValue(writer, bytes, entry->value);
+        }
+    }
+    return written;
+}
+
+static bool writeFunction(Writer *writer, Bytes *bytes, ObjFunction *function) {
+    if (function->body != NULL) {
+        fprintf(stderr, "Can't write %.*s(), it was never called to get compiled.\n", function->name->length,
+                function->name->chars);
+        return false;
+    }
+
+    Chunk *chunk = &function->chunk;
+    writeInt(bytes, function->name == NULL ? 0 : stringIndex(writer, function->name) + 1);
+    writeInt(bytes, function->arity);
+    writeInt(bytes, function->upvalueCount);
+    writeByte(bytes, (function->readsEnclosingFrame ? FUNCTION_READS_ENCLOSING_FRAME : 0) |
+                     (function->capturesValues ? FUNCTION_CAPTURES_VALUES : 0));
+
+    writeInt(bytes, chunk->count);
+    writeBytes(bytes, chunk->code, chunk->count);
+
+    bool written = true;
+    writeInt(bytes, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        written &= writeValue(writer, bytes, chunk->constants.values[i]);
+    }
+
+    writeInt(bytes, chunk->lines.count);
+    for (int i = 0; i < chunk->lines.count; i++) {
+        writeInt(bytes, chunk->lines.array[i].line);
+        writeInt(bytes, chunk->lines.array[i].column);
+        writeInt(bytes, chunk->lines.array[i].end);
+    }
+
+    writeInt(bytes, chunk->cacheCount);
+
+    writeInt(bytes, chunk->switchCount);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        SwitchTable *table = &chunk->switches[i];
+        int count = 0;
+        for (int j = 0; j < table->capacity; j++) {
+            count += table->cases[j].target != -1;
+        }
+        writeInt(bytes, table->defaultTarget);
+        writeInt(bytes, count);
+        for (int j = 0; j < table->capacity; j++) {
+            if (table->cases[j].target != -1) {
+                written &= writeValue(writer, bytes, table->cases[j].label);
+                writeInt(bytes, table->cases[j].target);
+            }
+        }
+    }
+
+    writeInt(bytes, chunk->inlinedCount);
+    for (int i = 0; i < chunk->inlinedCount; i++) {
+        InlinedCall *call = &chunk->inlined[i];
+        writeInt(bytes, call->start);
+        writeInt(bytes, call->end);
+        writeInt(bytes, call->line);
+        writeByte(bytes, call->tailCall);
+        writeInt(bytes, objectIndex(writer, call->function));
+    }
+    return written;
+}
+
+// Fields in the order of their slots, adding them in that order when loading gets the same shape back.
+static bool writeShapedFields(Writer *writer, Bytes *bytes, ObjInstance *instance) {
+    ObjShape *shape = instance->shape;
+    ObjString *names[SHAPE_MAX_SLOTS];
+    for (int i = 0; i < shape->slots.capacity; i++) {
+        Entry *entry = &shape->slots.entries[i];
+        if (entry->key != NULL) {
+            names[(int) AS_NUMBER(entry->value)] = entry->key;
+        }
+    }
+    writeInt(bytes, shape->slotCount);
+    bool written = true;
+    for (int i = 0; i < shape->slotCount; i++) {
+        writeInt(bytes, stringIndex(writer, names[i]));
+        written &= writeValue(writer, bytes, instance->slots[i]);
+    }
+    return written;
+}
+
+static bool writeObject(Writer *writer, Bytes *bytes, Obj *object) {
+    writeByte(bytes, object->type);
+    size_t size = bytes->count;
+    writeInt(bytes, 0);
+
+    bool written = true;
+    switch (object->type) {
+        case OBJ_FUNCTION:
+            written = writeFunction(writer, bytes, (ObjFunction *) object);
+            break;
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *) object;
+            writeInt(bytes, objectIndex(writer, (Obj *) closure->function));
+            writeInt(bytes, closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                ObjUpvalue *upvalue = closure->upvalues[i];
+                writeInt(bytes, upvalue == NULL ? 0 : objectIndex(writer, (Obj *) upvalue) + 1);
+                if (closure->values != NULL) {
+                    written &= writeValue(writer, bytes, closure->values[i]);
+                }
+            }
+            break;
+        }
+        case OBJ_UPVALUE: {
+            // An open one points into a frame, which isn't there to write.
+            ObjUpvalue *upvalue = (ObjUpvalue *) object;
+            written = upvalue->location == &upvalue->closed && writeValue(writer, bytes, upvalue->closed);
+            break;
+        }
+        case OBJ_NATIVE:
+            writeInt(bytes, stringIndex(writer, ((ObjNative *) object)->name));
+            break;
+        case OBJ_CLASS: {
+            ObjClass *klass = (ObjClass *) object;
+            writeInt(bytes, stringIndex(writer, klass->name));
+            writeInt(bytes, klass->slotHint);
+            written = writeValue(writer, bytes, klass->initializer);
+            written &= writeTable(writer, bytes, &klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *) object;
+            writeInt(bytes, objectIndex(writer, (Obj *) instance->klass));
+            writeByte(bytes, instance->shape == NULL);
+            written = instance->shape == NULL ? writeTable(writer, bytes, &instance->fields)
+                                              : writeShapedFields(writer, bytes, instance);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *) object;
+            writeInt(bytes, objectIndex(writer, (Obj *) bound->method));
+            written = writeValue(writer, bytes, bound->receiver);
+            break;
+        }
+        case OBJ_ARRAY: {
+            ObjArray *array = (ObjArray *) object;
+            writeInt(bytes, array->count);
+            for (int i = 0; i < array->count; i++) {
+                written &= writeValue(writer, bytes, array->values[i]);
+            }
+            break;
+        }
+        default:
+            written = false;
+            break;
+    }
+
+    patchInt(bytes, size, (uint32_t) (bytes->count - size - 4));
+    return written;
+}
+
+// Writes the names of the globals and everything reachable from script (NULL for none), or with values,
+// from the values of the globals and the consts too.
+static bool writeImage(ObjFunction *script, bool values, const char *path) {
+    if (script != NULL) {
+        push(OBJ_VAL(script));
+    }
+    Writer writer = {0};
+    initTable(&writer.strings);
+
+    // The roots go last in the file, but have to be written first to find the objects.
+    Bytes roots = {0};
+    bool written = true;
+    int globalCount = buffer.globalVars.count / 2;
+    writeByte(&roots, values);
+    writeInt(&roots, globalCount);
+    for (int i = 0; i < globalCount; i++) {
+        writeInt(&roots, stringIndex(&writer, AS_STRING(buffer.globalVars.values[2 * i])));
+        if (values) {
+            written &= writeValue(&writer, &roots, buffer.globalVars.values[2 * i + 1]);
+        }
+    }
+    if (values) {
+        written &= writeTable(&writer, &roots, &buffer.constVarIdentifiers);
+    }
+    writeInt(&roots, script == NULL ? 0 : objectIndex(&writer, (Obj *) script) + 1);
+
+    // Objects get written in the order they are found, the list grows while it is walked.
+    Bytes objects = {0};
+    for (int i = 0; i < writer.objectCount; i++) {
+        written &= writeObject(&writer, &objects, writer.objects[i]);
+    }
+
+    Bytes file = {0};
+    writeBytes(&file, BYTECODE_MAGIC, 4);
+    writeInt(&file, BYTECODE_VERSION);
+    writeInt(&file, BYTECODE_OPCODES);
+    writeInt(&file, writer.stringCount);
+    for (int i = 0; i < writer.stringCount; i++) {
+        writeInt(&file, writer.stringList[i]->length);
+        writeBytes(&file, writer.stringList[i]->chars, writer.stringList[i]->length);
+    }
+    writeInt(&file, writer.objectCount);
+    writeBytes(&file, objects.bytes, objects.count);
+    writeBytes(&file, roots.bytes, roots.count);
+
+    if (!written) {
+        fprintf(stderr, "Can't write \"%s\", it would hold a value of a type it can't or an open upvalue.\n",
+                path);
+    } else {
+        FILE *output = fopen(path, "wb");
+        if (output == NULL || fwrite(file.bytes, 1, file.count, output) < file.count) {
+            fprintf(stderr, "Could not write file \"%s\".\n", path);
+            written = false;
+        }
+        if (output != NULL) {
+            fclose(output);
+        }
+    }
+
+    free(file.bytes);
+    free(objects.bytes);
+    free(roots.bytes);
+    free(writer.stringList);
+    free(writer.objects);
+    free(writer.objectIndex);
+    freeTable(&writer.strings);
+    if (script != NULL) {
+        pop(1);
+    }
+    return written;
+}
+
+bool writeBytecode(ObjFunction *script, const char *path) {
+    return writeImage(script, false, path);
+}
+
+bool writeSnapshot(const char *path) {
+    return writeImage(NULL, true, path);
+}
+
+typedef struct {
+    const uint8_t *current;
+    const uint8_t *end;
+    bool failed;
+} Reader;
+
+typedef struct {
+    uint8_t type;
+    uint32_t size;
+    const uint8_t *start;
+} ObjectRecord;
+
+// What a file created so far, kept from the GC until the globals or the script hold it.
+static struct {
+    ObjString **strings;
+    int stringCount;
+    Obj **objects;
+    int objectCount;
+} loading;
+
+static const uint8_t *readBytes(Reader *reader, size_t count) {
+    if (reader->failed || (size_t) (reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint8_t readByte(Reader *reader) {
+    const uint8_t *byte = readBytes(reader, 1);
+    return byte == NULL ? 0 : *byte;
+}
+
+static uint32_t readInt(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, 4);
+    if (bytes == NULL) {
+        return 0;
+    }
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+// Reads a count of things taking at least size bytes each, failing when the rest of the file can't hold them.
+static uint32_t readCount(Reader *reader, size_t size) {
+    uint32_t count = readInt(reader);
+    if ((size_t) (reader->end - reader->current) / size < count) {
+        reader->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+static ObjString *readString(Reader *reader) {
+    uint32_t index = readInt(reader);
+    if (reader->failed || index >= (uint32_t) loading.stringCount) {
+        reader->failed = true;
+        return NULL;
+    }
+    return loading.strings[index];
+}
+
+// The object at index when it is of type and created by now, NULL otherwise.
+static Obj *objectAt(uint32_t index, ObjType type) {
+    if (index >= (uint32_t) loading.objectCount || loading.objects[index] == NULL ||
+        loading.objects[index]->type != type) {
+        return NULL;
+    }
+    return loading.objects[index];
+}
+
+static Obj *readObject(Reader *reader, ObjType type) {
+    uint32_t index = readInt(reader);
+    Obj *object = reader->failed ? NULL : objectAt(index, type);
+    reader->failed |= object == NULL;
+    return object;
+}
+
+static Value readValue(Reader *reader) {
+    switch (readByte(reader)) {
+        case VALUE_NUMBER: {
+            uint64_t bits = readInt(reader);
+            bits |= (uint64_t) readInt(reader) << 32;
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case VALUE_NIL:
+            return NIL_VAL;
+        case VALUE_FALSE:
+            return BOOL_VAL(false);
+        case VALUE_TRUE:
+            return BOOL_VAL(true);
+        case VALUE_UNDEFINED:
+            return UNDEFINED_VAL;
+        case VALUE_STRING: {
+            ObjString *string = readString(reader);
+            return reader->failed ? NIL_VAL : OBJ_VAL(string);
+        }
+        case VALUE_OBJECT: {
+            uint32_t index = readInt(reader);
+            if (reader->failed || index >= (uint32_t) loading.objectCount || loading.objects[index] == NULL) {
+                reader->failed = true;
+                return NIL_VAL;
+            }
+            return OBJ_VAL(loading.objects[index]);
+        }
+        default:
+            reader->failed = true;
+            return NIL_VAL;
+    }
+}
+
+static void readTable(Reader *reader, Table *table) {
+    uint32_t count = readCount(reader, 5);
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        ObjString *name = readString(reader);
+        Value value = readValue(reader);
+        if (!reader->failed) {
+            tableSet(table, name, value);
+        }
+    }
+}
+
+static void readFunction(Reader *reader, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    uint32_t name = readInt(reader);
+    if (name > (uint32_t) loading.stringCount) {
+        reader->failed = true;
+    } else if (name != 0) {
+        function->name = loading.strings[name - 1];
+    }
+    // The compiler's limits, closures give an upvalue's index in a byte.
+    uint32_t arity = readInt(reader);
+    uint32_t upvalueCount = readInt(reader);
+    reader->failed |= arity > UINT16_MAX || upvalueCount > UINT8_MAX + 1;
+    function->arity = reader->failed ? 0 : (int) arity;
+    function->upvalueCount = reader->failed ? 0 : (int) upvalueCount;
+    uint8_t flags = readByte(reader);
+    function->readsEnclosingFrame = (flags & FUNCTION_READS_ENCLOSING_FRAME) != 0;
+    function->capturesValues = (flags & FUNCTION_CAPTURES_VALUES) != 0;
+
+    uint32_t codeCount = readCount(reader, 1);
+    const uint8_t *code = readBytes(reader, codeCount);
+    if (code != NULL && codeCount > 0) {
+        chunk->code = ALLOCATE(uint8_t, codeCount);
+        memcpy(chunk->code, code, codeCount);
+        chunk->count = chunk->capacity = (int) codeCount;
+    }
+
+    uint32_t constantCount = readCount(reader, 1);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+        writeValueArray(&chunk->constants, readValue(reader));
+    }
+
+    // Runs have to cover the code, the lookup binary searches their ends.
+    uint32_t lineCount = readCount(reader, 12);
+    if (lineCount > 0) {
+        chunk->lines.array = ALLOCATE(Line, lineCount);
+        chunk->lines.capacity = (int) lineCount;
+        uint32_t end = 0;
+        for (uint32_t i = 0; i < lineCount; i++) {
+            chunk->lines.array[i].line = readInt(reader);
+            chunk->lines.array[i].column = readInt(reader);
+            uint32_t next = readInt(reader);
+            reader->failed |= next <= end;
+            chunk->lines.array[i].end = (int) next;
+            end = next;
+        }
+        chunk->lines.count = (int) lineCount;
+        reader->failed |= end != codeCount;
+    } else {
+        reader->failed |= codeCount > 0;
+    }
+
+    // Every cache belongs to an instruction.
+    uint32_t cacheCount = readInt(reader);
+    reader->failed |= cacheCount > codeCount;
+    for (uint32_t i = 0; i < cacheCount && !reader->failed; i++) {
+        addInlineCache(chunk);
+    }
+
+    uint32_t switchCount = readCount(reader, 8);
+    for (uint32_t i = 0; i < switchCount && !reader->failed; i++) {
+        int defaultTarget = (int) readInt(reader);
+        uint32_t count = readCount(reader, 5);
+        Value *labels = malloc(sizeof(Value) * (count + 1));
+        int *targets = malloc(sizeof(int) * (count + 1));
+        for (uint32_t j = 0; j < count; j++) {
+            labels[j] = readValue(reader);
+            targets[j] = (int) readInt(reader);
+        }
+        if (!reader->failed) {
+            addSwitchTable(chunk, labels, targets, (int) count, defaultTarget);
+        }
+        free(labels);
+        free(targets);
+    }
+
+    uint32_t inlinedCount = readCount(reader, 17);
+    if (inlinedCount > 0) {
+        chunk->inlined = ALLOCATE(InlinedCall, inlinedCount);
+        for (uint32_t i = 0; i < inlinedCount; i++) {
+            InlinedCall *call = &chunk->inlined[i];
+            call->start = (int) readInt(reader);
+            call->end = (int) readInt(reader);
+            call->line = readInt(reader);
+            call->tailCall = readByte(reader) != 0;
+            call->function = readObject(reader, OBJ_FUNCTION);
+        }
+        chunk->inlinedCount = (int) inlinedCount;
+    }
+}
+
+// Natives aren't written, the file names one of those initVM() defined.
+static Obj *readNative(Reader *reader) {
+    ObjString *name = readString(reader);
+    Value index;
+    if (reader->failed || !tableGet(&buffer.globalVarIdentifiers, name, &index)) {
+        reader->failed = true;
+        return NULL;
+    }
+    Value native = buffer.globalVars.values[(int) AS_NUMBER(index)];
+    if (!IS_NATIVE(native) || AS_NATIVE(native)->name != name) {
+        reader->failed = true;
+        return NULL;
+    }
+    return AS_OBJ(native);
+}
+
+static int creationPass(uint8_t type) {
+    switch (type) {
+        case OBJ_CLOSURE:
+        case OBJ_INSTANCE:
+            return 2;
+        case OBJ_BOUND_METHOD:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Creates the object a record describes, empty but for what it can't be created without.
+static Obj *createObject(Reader *reader, uint8_t type) {
+    switch (type) {
+        case OBJ_FUNCTION:
+            return (Obj *) newFunction();
+        case OBJ_UPVALUE: {
+            ObjUpvalue *upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (Obj *) upvalue;
+        }
+        case OBJ_NATIVE:
+            return readNative(reader);
+        case OBJ_CLASS: {
+            ObjString *name = readString(reader);
+            return reader->failed ? NULL : (Obj *) newClass(name);
+        }
+        case OBJ_ARRAY:
+            return (Obj *) newArray(NULL, 0);
+        case OBJ_CLOSURE: {
+            ObjFunction *function = (ObjFunction *) readObject(reader, OBJ_FUNCTION);
+            return reader->failed ? NULL : (Obj *) newClosure(function);
+        }
+        case OBJ_INSTANCE: {
+            ObjClass *klass = (ObjClass *) readObject(reader, OBJ_CLASS);
+            return reader->failed ? NULL : (Obj *) newInstance(klass);
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjClosure *method = (ObjClosure *) readObject(reader, OBJ_CLOSURE);
+            return reader->failed ? NULL : (Obj *) newBoundMethod(NIL_VAL, method);
+        }
+        default:
+            reader->failed = true;
+            return NULL;
+    }
+}
+
+static void readClosure(Reader *reader, ObjClosure *closure) {
+    readObject(reader, OBJ_FUNCTION);
+    if (readInt(reader) != (uint32_t) closure->upvalueCount) {
+        reader->failed = true;
+        return;
+    }
+    for (int i = 0; i < closure->upvalueCount && !reader->failed; i++) {
+        uint32_t upvalue = readInt(reader);
+        if (upvalue != 0) {
+            closure->upvalues[i] = (ObjUpvalue *) objectAt(upvalue - 1, OBJ_UPVALUE);
+            reader->failed |= closure->upvalues[i] == NULL;
+        }
+        if (closure->values != NULL) {
+            closure->values[i] = readValue(reader);
+        }
+    }
+}
+
+static void readInstance(Reader *reader, ObjInstance *instance) {
+    readObject(reader, OBJ_CLASS);
+    if (readByte(reader)) {
+        instance->shape = NULL;
+        readTable(reader, &instance->fields);
+        return;
+    }
+    uint32_t count = readCount(reader, 5);
+    reader->failed |= count > SHAPE_MAX_SLOTS;
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        ObjString *name = readString(reader);
+        Value value = readValue(reader);
+        if (!reader->failed) {
+            setInstanceField(instance, name, value);
+        }
+    }
+}
+
+static void readArray(Reader *reader, ObjArray *array) {
+    uint32_t count = readCount(reader, 1);
+    if (count == 0 || reader->failed) {
+        return;
+    }
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, count);
+    array->capacity = (int) count;
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        array->values[array->count++] = readValue(reader);
+    }
+}
+
+// Fills in an object created in an earlier pass, once every object exists.
+static void fillObject(Reader *reader, Obj *object) {
+    switch (object->type) {
+        case OBJ_UPVALUE:
+            ((ObjUpvalue *) object)->closed = readValue(reader);
+            break;
+        case OBJ_CLASS: {
+            ObjClass *klass = (ObjClass *) object;
+            readString(reader);
+            klass->slotHint = (int) readInt(reader);
+            klass->initializer = readValue(reader);
+            readTable(reader, &klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+            readClosure(reader, (ObjClosure *) object);
+            break;
+        case OBJ_INSTANCE:
+            readInstance(reader, (ObjInstance *) object);
+            break;
+        case OBJ_BOUND_METHOD:
+            readObject(reader, OBJ_CLOSURE);
+            ((ObjBoundMethod *) object)->receiver = readValue(reader);
+            break;
+        case OBJ_ARRAY:
+            readArray(reader, (ObjArray *) object);
+            break;
+        default:
+            break;
+    }
+}
+
+static void readObjects(Reader *reader) {
+    uint32_t count = readCount(reader, 5);
+    ObjectRecord *records = malloc(sizeof(ObjectRecord) * (count + 1));
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        records[i].type = readByte(reader);
+        records[i].size = readCount(reader, 1);
+        records[i].start = readBytes(reader, records[i].size);
+    }
+    if (reader->failed) {
+        free(records);
+        return;
+    }
+
+    loading.objects = calloc(count + 1, sizeof(Obj *));
+    loading.objectCount = (int) count;
+    for (int pass = 0; pass < LOAD_PASSES && !reader->failed; pass++) {
+        for (int i = 0; i < loading.objectCount && !reader->failed; i++) {
+            Reader record = {.current = records[i].start, .end = records[i].start + records[i].size};
+            if (pass == creationPass(records[i].type)) {
+                loading.objects[i] = createObject(&record, records[i].type);
+            } else if (pass == 1 && records[i].type == OBJ_FUNCTION) {
+                readFunction(&record, (ObjFunction *) loading.objects[i]);
+            } else if (pass == LOAD_PASSES - 1) {
+                fillObject(&record, loading.objects[i]);
+            }
+            reader->failed |= record.failed;
+        }
+    }
+    free(records);
+}
+
+// Gives the globals of the file the indices its code refers to them by. The ones the VM defines itself
+// (the natives) have to be where they were when the file got written, the others get added. A snapshot
+// also has their values and the consts.
+static void readGlobals(Reader *reader, bool *mismatch) {
+    bool values = readByte(reader) != 0;
+    uint32_t count = readCount(reader, 4);
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        ObjString *name = readString(reader);
+        Value value = values ? readValue(reader) : UNDEFINED_VAL;
+        if (reader->failed) {
+            break;
+        }
+        if (2 * i < (uint32_t) buffer.globalVars.count) {
+            if (AS_STRING(buffer.globalVars.values[2 * i]) != name) {
+                *mismatch = reader->failed = true;
+            } else if (values) {
+                buffer.globalVars.values[2 * i + 1] = value;
+            }
+            continue;
+        }
+        writeValueArray(&buffer.globalVars, OBJ_VAL(name));
+        writeValueArray(&buffer.globalVars, value);
+        tableSet(&buffer.globalVarIdentifiers, name, NUMBER_VAL(buffer.globalVars.count - 1));
+    }
+    if (values) {
+        readTable(reader, &buffer.constVarIdentifiers);
+    }
+}
+
+// Checking loaded code. run() trusts its bytecode, so a function only gets loaded when every instruction is
+// one this clox has and fits the chunk, every operand indexes a constant, global, cache, upvalue or switch
+// table that exists (constants of the type the instruction takes), every jump lands on an instruction and the
+// last one doesn't run off the end. Local slots and stack heights are left to the code the compiler wrote.
+
+static uint32_t readOperand(Chunk *chunk, int offset, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint32_t) chunk->code[offset + i] << (8 * i);
+    }
+    return value;
+}
+
+static bool isConstant(Chunk *chunk, uint32_t index) {
+    return index < (uint32_t) chunk->constants.count;
+}
+
+static bool isObjectConstant(Chunk *chunk, uint32_t index, ObjType type) {
+    return isConstant(chunk, index) && IS_OBJ(chunk->constants.values[index]) &&
+           OBJ_TYPE(chunk->constants.values[index]) == type;
+}
+
+// Globals are stored as name, value pairs, instructions refer to the value.
+static bool isGlobal(uint32_t index) {
+    return index % 2 == 1 && index < (uint32_t) buffer.globalVars.count;
+}
+
+static bool isRegister(Chunk *chunk, uint32_t operand) {
+    return !(operand & REGISTER_CONSTANT) || isConstant(chunk, operand & ~REGISTER_CONSTANT);
+}
+
+static bool isTarget(bool *starts, int count, int64_t target) {
+    return target >= 0 && target < count && starts[target];
+}
+
+// Copied values go into closures that have room for them, the ones copied from this closure have to be there.
+static bool verifyClosure(ObjFunction *function, Chunk *chunk, int offset) {
+    ObjFunction *closed = AS_FUNCTION(chunk->constants.values[readOperand(chunk, offset + 1, 3)]);
+    for (int i = 0; i < closed->upvalueCount; i++) {
+        uint8_t kind = chunk->code[offset + 4 + 2 * i];
+        uint8_t index = chunk->code[offset + 5 + 2 * i];
+        bool copies = kind == UPVALUE_COPY_LOCAL || kind == UPVALUE_COPY_VALUE;
+        if (kind > UPVALUE_COPY_VALUE || (copies && !closed->capturesValues) ||
+            (kind == UPVALUE_COPY_VALUE && !function->capturesValues) ||
+            ((kind == 0 || kind == UPVALUE_COPY_VALUE) && index >= function->upvalueCount)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool verifyInstruction(ObjFunction *function, bool *starts, int offset) {
+    Chunk *chunk = &function->chunk;
+    int after = offset + instructionLength(chunk, offset);
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+            return isConstant(chunk, readOperand(chunk, offset + 1, 3));
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+            return isGlobal(readOperand(chunk, offset + 1, 2));
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+            return isGlobal(readOperand(chunk, offset + 1, 3));
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return readOperand(chunk, offset + 1, 2) < (uint32_t) function->upvalueCount;
+        case OP_GET_CAPTURED:
+            return function->capturesValues && readOperand(chunk, offset + 1, 2) < (uint32_t) function->upvalueCount;
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+            return function->readsEnclosingFrame;
+        case OP_GET_SUPER:
+        case OP_INVOKE_SUPER:
+        case OP_TAIL_INVOKE_SUPER:
+        case OP_INVOKE_SUPER_LONG:
+        case OP_TAIL_INVOKE_SUPER_LONG:
+        case OP_CLASS:
+        case OP_METHOD:
+            return isObjectConstant(chunk, readOperand(chunk, offset + 1, 3), OBJ_STRING);
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            // The cache is the last operand.
+            return isObjectConstant(chunk, readOperand(chunk, offset + 1, 3), OBJ_STRING) &&
+                   readOperand(chunk, after - 2, 2) < (uint32_t) chunk->cacheCount;
+        case OP_CLOSURE:
+            return verifyClosure(function, chunk, offset);
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            return isTarget(starts, chunk->count, (int64_t) after + readOperand(chunk, offset + 1, 2));
+        case OP_LOOP:
+            return isTarget(starts, chunk->count, (int64_t) after - readOperand(chunk, offset + 1, 2));
+        case OP_JUMP_LONG:
+            return isTarget(starts, chunk->count, (int64_t) after + readOperand(chunk, offset + 1, 3));
+        case OP_LOOP_LONG:
+            return isTarget(starts, chunk->count, (int64_t) after - readOperand(chunk, offset + 1, 3));
+        case OP_SWITCH:
+            return readOperand(chunk, offset + 1, 2) < (uint32_t) chunk->switchCount;
+        case OP_MOVE:
+            return isRegister(chunk, readOperand(chunk, offset + 3, 2));
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+        case OP_ADD_REGISTERS_UNCHECKED:
+        case OP_SUBTRACT_REGISTERS_UNCHECKED:
+        case OP_MULTIPLY_REGISTERS_UNCHECKED:
+        case OP_DIVIDE_REGISTERS_UNCHECKED:
+            return isRegister(chunk, readOperand(chunk, offset + 3, 2)) &&
+                   isRegister(chunk, readOperand(chunk, offset + 5, 2));
+        default:
+            return true;
+    }
+}
+
+static bool verifyFunction(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0) {
+        return false;
+    }
+
+    // Instructions have to be known and fit before their lengths can be trusted, closures need their
+    // function to know theirs.
+    bool *starts = calloc(chunk->count, sizeof(bool));
+    int last = 0;
+    bool valid = true;
+    for (int offset = 0; offset < chunk->count && valid;) {
+        uint8_t op = chunk->code[offset];
+        valid = op < BYTECODE_OPCODES;
+        if (valid && op == OP_CLOSURE) {
+            valid = offset + 4 <= chunk->count &&
+                    isObjectConstant(chunk, readOperand(chunk, offset + 1, 3), OBJ_FUNCTION);
+        }
+        if (valid) {
+            starts[offset] = true;
+            last = offset;
+            offset += instructionLength(chunk, offset);
+            valid = offset <= chunk->count;
+        }
+    }
+
+    for (int offset = 0; offset < chunk->count && valid; offset += instructionLength(chunk, offset)) {
+        valid = verifyInstruction(function, starts, offset);
+    }
+
+    // Every path has to end in a return or jump back, a switch always jumps.
+    uint8_t op = valid ? chunk->code[last] : OP_RETURN;
+    valid &= op == OP_RETURN || op == OP_JUMP || op == OP_JUMP_LONG || op == OP_LOOP || op == OP_LOOP_LONG ||
+             op == OP_SWITCH;
+
+    for (int i = 0; i < chunk->switchCount && valid; i++) {
+        SwitchTable *table = &chunk->switches[i];
+        valid = isTarget(starts, chunk->count, table->defaultTarget);
+        for (int j = 0; j < table->capacity && valid; j++) {
+            valid = table->cases[j].target == -1 || isTarget(starts, chunk->count, table->cases[j].target);
+        }
+    }
+    for (int i = 0; i < chunk->inlinedCount && valid; i++) {
+        InlinedCall *call = &chunk->inlined[i];
+        valid = call->start >= 0 && call->start <= call->end && call->end <= chunk->count;
+    }
+    free(starts);
+    return valid;
+}
+
+static void verifyFunctions(Reader *reader) {
+    for (int i = 0; i < loading.objectCount && !reader->failed; i++) {
+        if (loading.objects[i]->type == OBJ_FUNCTION) {
+            reader->failed = !verifyFunction((ObjFunction *) loading.objects[i]);
+        }
+    }
+}
+
+// Loads a file into the VM, with the script it runs in script (NULL for a snapshot).
+static bool readImage(const uint8_t *data, size_t size, ObjFunction **script) {
+    Reader reader = {.current = data, .end = data + size, .failed = false};
+    const uint8_t *magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) {
+        fprintf(stderr, "Not a bytecode file or snapshot.\n");
+        return false;
+    }
+    uint32_t version = readInt(&reader);
+    uint32_t opcodes = readInt(&reader);
+    if (!reader.failed && (version != BYTECODE_VERSION || opcodes != BYTECODE_OPCODES)) {
+        fprintf(stderr, "File written by another version of clox, write it again.\n");
+        return false;
+    }
+
+    uint32_t stringCount = readCount(&reader, 4);
+    loading.strings = malloc(sizeof(ObjString *) * (stringCount + 1));
+    for (uint32_t i = 0; i < stringCount && !reader.failed; i++) {
+        uint32_t length = readCount(&reader, 1);
+        const char *chars = (const char *) readBytes(&reader, length);
+        if (chars != NULL) {
+            ObjString *string = makeString(chars, (int) length, true);
+            loading.strings[loading.stringCount++] = string;
+        }
+    }
+
+    readObjects(&reader);
+    bool mismatch = false;
+    readGlobals(&reader, &mismatch);
+    verifyFunctions(&reader);
+    uint32_t function = readInt(&reader);
+    *script = NULL;
+    if (function != 0) {
+        // The script gets called without arguments and has nothing to close over.
+        *script = (ObjFunction *) objectAt(function - 1, OBJ_FUNCTION);
+        reader.failed |= *script == NULL || (*script)->arity != 0 || (*script)->upvalueCount != 0;
+    }
+
+    if (mismatch) {
+        fprintf(stderr, "File written for other natives than this build of clox has.\n");
+    } else if (reader.failed) {
+        fprintf(stderr, "Broken bytecode file or snapshot.\n");
+    }
+    free(loading.strings);
+    free(loading.objects);
+    loading.strings = NULL;
+    loading.stringCount = 0;
+    loading.objects = NULL;
+    loading.objectCount = 0;
+    return !reader.failed;
+}
+
+ObjFunction *readBytecode(const uint8_t *data, size_t size) {
+    ObjFunction *script;
+    if (!readImage(data, size, &script)) {
+        return NULL;
+    }
+    if (script == NULL) {
+        fprintf(stderr, "Not a bytecode file, a snapshot.\n");
+    }
+    return script;
+}
+
+bool readSnapshot(const uint8_t *data, size_t size) {
+    ObjFunction *script;
+    return readImage(data, size, &script);
+}
+
+void markBytecodeRoots() {
+    for (int i = 0; i < loading.stringCount; i++) {
+        markObject((Obj *) loading.strings[i]);
+    }
+    for (int i = 0; i < loading.objectCount; i++) {
+        markObject(loading.objects[i]);
+    }
+}
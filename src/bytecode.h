@@ -0,0 +1,30 @@
+#ifndef CLOX_BYTECODE_H
+#define CLOX_BYTECODE_H
+
+#include "common.h"
+#include "object.h"
+
+// Bumped whenever the layout of .loxc files and snapshots or the meaning of the bytecode in them changes,
+// files of any other version get rejected rather than run.
+#define BYTECODE_VERSION 5
+
+// Writes the compiled script and every function in it to a .loxc file at path, along with the names of the
+// globals its code refers to by index. False, after reporting why, when the file can't be written.
+bool writeBytecode(ObjFunction *script, const char *path);
+
+// Rebuilds the script a .loxc file holds from its contents, NULL after reporting why when they are from
+// another version or broken. Strings point into data, which has to stay mapped for as long as the VM runs.
+ObjFunction *readBytecode(const uint8_t *data, size_t size);
+
+// Writes the globals, their values and everything those reach (functions, closures, classes, instances,
+// arrays and strings), and the consts the compiler folds, to a snapshot file at path. Only works once the
+// script that set them up returned, while no upvalue is open.
+bool writeSnapshot(const char *path);
+
+// Restores the globals of a snapshot file into a VM fresh out of initVM(), false after reporting why when
+// that fails. Strings point into data, as with readBytecode().
+bool readSnapshot(const uint8_t *data, size_t size);
+
+void markBytecodeRoots();
+
+#endif //CLOX_BYTECODE_H
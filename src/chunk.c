@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include "chunk.h"
 #include "line.h"
 #include "vm.h"
@@ -7,18 +9,35 @@ void initChunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+    chunk->switchCount = 0;
+    chunk->switchCapacity = 0;
+    chunk->switches = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlined = NULL;
     initLineArray(&chunk->lines);
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    freeConstantIndex(chunk);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        FREE_ARRAY(SwitchCase, chunk->switches[i].cases, chunk->switches[i].capacity);
+    }
+    FREE_ARRAY(SwitchTable, chunk->switches, chunk->switchCapacity);
+    FREE_ARRAY(InlinedCall, chunk->inlined, chunk->inlinedCount);
     freeLineArray(&chunk->lines);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line) {
+void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line, uint32_t column) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
@@ -27,17 +46,163 @@ void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line) {
 
     chunk->code[chunk->count] = byte;
     chunk->count++;
-    writeLineArray(&chunk->lines, line);
+    writeLineArray(&chunk->lines, line, column);
+}
+
+void truncateChunk(Chunk *chunk, int count) {
+    truncateLineArray(&chunk->lines, count);
+    chunk->count = count;
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_POPN:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_GET_CAPTURED:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_LOOP:
+        case OP_SWITCH:
+        case OP_ARRAY:
+            return 3;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL_LONG:
+            return 3;
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_ARRAY_LONG:
+            return 4;
+        case OP_CONSTANT:
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 4;
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_UNCHECKED:
+        case OP_INVOKE_SUPER:
+        case OP_TAIL_INVOKE_SUPER:
+        case OP_MOVE:
+            return 5;
+        case OP_INVOKE_SUPER_LONG:
+        case OP_TAIL_INVOKE_SUPER_LONG:
+            return 6;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 6;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+        case OP_ADD_REGISTERS_UNCHECKED:
+        case OP_SUBTRACT_REGISTERS_UNCHECKED:
+        case OP_MULTIPLY_REGISTERS_UNCHECKED:
+        case OP_DIVIDE_REGISTERS_UNCHECKED:
+            return 7;
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return 8;
+        case OP_CLOSURE: {
+            int constant = chunk->code[offset + 1] |
+                           (chunk->code[offset + 2] << 8) |
+                           (chunk->code[offset + 3] << 16);
+            return 4 + 2 * AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static int *findConstantSlot(int *index, int capacity, ValueArray *constants, Value value) {
+    uint32_t slot = hashValue(value) & (capacity - 1);
+    for (;;) {
+        if (index[slot] == 0 || valuesIdentical(constants->values[index[slot] - 1], value)) {
+            return &index[slot];
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantIndex(Chunk *chunk) {
+    int capacity = GROW_CAPACITY(chunk->constantIndexCapacity);
+    int *index = ALLOCATE(int, capacity);
+    memset(index, 0, sizeof(int) * capacity);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        *findConstantSlot(index, capacity, &chunk->constants, chunk->constants.values[i]) = i + 1;
+    }
+
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+#ifdef DEBUG_LOG_CONSTANTS
+    vm.constantIndexBytes += sizeof(int) * (capacity - chunk->constantIndexCapacity);
+#endif
+    chunk->constantIndex = index;
+    chunk->constantIndexCapacity = capacity;
 }
 
 int addConstant(Chunk *chunk, Value value) {
+#ifdef DEBUG_LOG_CONSTANTS
+    vm.constantsAdded++;
+#endif
+    if (chunk->constantIndexCapacity > 0) {
+        int *slot = findConstantSlot(chunk->constantIndex, chunk->constantIndexCapacity, &chunk->constants, value);
+        if (*slot != 0) {
+#ifdef DEBUG_LOG_CONSTANTS
+            vm.constantsShared++;
+#endif
+            return *slot - 1;
+        }
+    }
+
     push(value);
     writeValueArray(&chunk->constants, value);
+    if (chunk->constants.count > chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD) {
+        growConstantIndex(chunk);
+    } else {
+        *findConstantSlot(chunk->constantIndex, chunk->constantIndexCapacity, &chunk->constants, value) =
+                chunk->constants.count;
+    }
     pop(1);
     return chunk->constants.count - 1;
 }
 
-int writeConstant(Chunk *chunk, Value value, int line) {
+void freeConstantIndex(Chunk *chunk) {
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+}
+
+int addInlineCache(Chunk *chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
+
+int writeConstant(Chunk *chunk, Value value, int line, int column) {
     if (chunk->constants.count + 1 == UINT24_MAX) {
         printf("Too many constant in one chunk.");
         exit(127);
@@ -45,11 +210,104 @@ int writeConstant(Chunk *chunk, Value value, int line) {
 
     int constant = addConstant(chunk, value);
     push(value);
-    writeChunk(chunk, OP_CONSTANT, line);
-    writeChunk(chunk, (uint8_t) constant & 0xff, line);
-    writeChunk(chunk, (uint8_t)((constant >> 8) & 0xff), line);
-    writeChunk(chunk, (uint8_t)((constant >> 16) & 0xff), line);
+    writeChunk(chunk, OP_CONSTANT, line, column);
+    writeChunk(chunk, (uint8_t) constant & 0xff, line, column);
+    writeChunk(chunk, (uint8_t)((constant >> 8) & 0xff), line, column);
+    writeChunk(chunk, (uint8_t)((constant >> 16) & 0xff), line, column);
     pop(1);
 
     return constant;
 }
+
+static bool isInteger(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= INT32_MIN && AS_NUMBER(value) <= INT32_MAX &&
+           AS_NUMBER(value) == (int32_t) AS_NUMBER(value);
+}
+
+bool isSwitchLabel(Value value) {
+    // -0 would take the slot of 0.
+    return IS_STRING(value) || (isInteger(value) && !(AS_NUMBER(value) == 0 && signbit(AS_NUMBER(value))));
+}
+
+static uint32_t hashLabel(Value value) {
+    if (IS_STRING(value)) {
+        return AS_STRING(value)->hash;
+    }
+    return (uint32_t) (int32_t) AS_NUMBER(value) * 2654435761u;
+}
+
+static SwitchCase *findCase(SwitchTable *table, Value value) {
+    if (table->dense) {
+        if (!IS_NUMBER(value)) {
+            return NULL;
+        }
+        int64_t index = (int64_t) AS_NUMBER(value) - table->low;
+        return index >= 0 && index < table->capacity ? &table->cases[index] : NULL;
+    }
+
+    uint32_t slot = hashLabel(value) & (table->capacity - 1);
+    for (;;) {
+        SwitchCase *entry = &table->cases[slot];
+        if (entry->target == -1 || valuesEqual(entry->label, value)) {
+            return entry;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+int addSwitchTable(Chunk *chunk, Value *labels, int *targets, int count, int defaultTarget) {
+    if (chunk->switchCapacity < chunk->switchCount + 1) {
+        int oldCapacity = chunk->switchCapacity;
+        chunk->switchCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->switches = GROW_ARRAY(SwitchTable, chunk->switches, oldCapacity, chunk->switchCapacity);
+    }
+
+    SwitchTable *table = &chunk->switches[chunk->switchCount];
+    table->dense = count > 0;
+    table->defaultTarget = defaultTarget;
+    int64_t low = INT32_MAX;
+    int64_t high = INT32_MIN;
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMBER(labels[i])) {
+            table->dense = false;
+            break;
+        }
+        low = AS_NUMBER(labels[i]) < low ? (int64_t) AS_NUMBER(labels[i]) : low;
+        high = AS_NUMBER(labels[i]) > high ? (int64_t) AS_NUMBER(labels[i]) : high;
+    }
+    // A dense table is worth it while at least half of its slots hold a case.
+    if (table->dense && high - low + 1 <= 2 * (int64_t) count) {
+        table->low = (int) low;
+        table->capacity = (int) (high - low + 1);
+    } else {
+        table->dense = false;
+        table->capacity = 8;
+        while (table->capacity < 2 * count) {
+            table->capacity *= 2;
+        }
+    }
+
+    table->cases = ALLOCATE(SwitchCase, table->capacity);
+    for (int i = 0; i < table->capacity; i++) {
+        table->cases[i].label = NIL_VAL;
+        table->cases[i].target = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        SwitchCase *entry = findCase(table, labels[i]);
+        if (entry->target == -1) {
+            entry->label = labels[i];
+            entry->target = targets[i];
+        }
+    }
+    return chunk->switchCount++;
+}
+
+int switchTarget(SwitchTable *table, Value value) {
+    // Values are compared the way OP_EQUAL does, so -0 finds the slot of 0 and decides there.
+    if (!IS_STRING(value) && !isInteger(value)) {
+        return table->defaultTarget;
+    }
+    SwitchCase *entry = findCase(table, value);
+    return entry != NULL && entry->target != -1 && valuesEqual(entry->label, value) ? entry->target
+                                                                                    : table->defaultTarget;
+}
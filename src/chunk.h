@@ -21,14 +21,26 @@ typedef enum {
     OP_SET_LOCAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    // Variables a stack closure captured from the frame that created it, which is the frame right below its
+    // own: the operand is the variable's slot in that frame.
+    OP_GET_ENCLOSING,
+    OP_SET_ENCLOSING,
+    // A variable never assigned once captured, copied into the closure when it got created. The operand is
+    // the index of the upvalue it would have been.
+    OP_GET_CAPTURED,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_INVOKE_SUPER,
+    OP_TAIL_INVOKE_SUPER,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_ADD,
+    OP_ADD_LOCALS,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -38,9 +50,17 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_NOT_LESS,
     OP_LOOP,
+    // Jumps to the case of a switch statement the value on top of the stack selects, looked up in one of
+    // the chunk's switch tables. Leaves the value on the stack.
+    OP_SWITCH,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
+    // Followed by an (isLocal, index) byte pair for every upvalue of the function. Besides 0 and 1, isLocal
+    // is one of the UPVALUE_ kinds below for variables that get no upvalue.
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
@@ -50,24 +70,163 @@ typedef enum {
     OP_ARRAY,
     OP_ARRAY_GET,
     OP_ARRAY_SET,
+    // Register instructions: three-address forms of statements that only assign locals and constants to a
+    // local ("a = b + c;"), working on the frame's slots directly instead of going through the stack. Each
+    // operand is a slot index, or a constant index tagged with REGISTER_CONSTANT.
+    OP_MOVE,
+    OP_ADD_REGISTERS,
+    OP_SUBTRACT_REGISTERS,
+    OP_MULTIPLY_REGISTERS,
+    OP_DIVIDE_REGISTERS,
+    // Quickened variants, never emitted by the compiler. The VM rewrites a generic instruction into
+    // one of these after it ran with the types the variant expects, and back when the guess stops holding.
+    OP_GET_GLOBAL_DEFINED,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_MODULO_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_ARRAY_GET_NUM,
+    OP_ARRAY_SET_NUM,
+    // Unchecked variants, emitted by the optimizer where type inference proved the operands to be numbers
+    // (array indexes integers), so they skip the type checks of the generic instruction. Array accesses still
+    // check the array and the bounds, and leave anything failing them to the generic instruction.
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_GREATER_UNCHECKED,
+    OP_LESS_UNCHECKED,
+    OP_GREATER_EQUAL_UNCHECKED,
+    OP_LESS_EQUAL_UNCHECKED,
+    OP_ADD_LOCALS_UNCHECKED,
+    OP_JUMP_IF_NOT_LESS_UNCHECKED,
+    OP_ARRAY_GET_UNCHECKED,
+    OP_ARRAY_SET_UNCHECKED,
+    OP_ADD_REGISTERS_UNCHECKED,
+    OP_SUBTRACT_REGISTERS_UNCHECKED,
+    OP_MULTIPLY_REGISTERS_UNCHECKED,
+    OP_DIVIDE_REGISTERS_UNCHECKED,
+    // Long forms, emitted only when an operand outgrows the short form: global indexes, jump distances and
+    // array lengths take 24 bits instead of 16, argument counts 16 bits instead of 8.
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_JUMP_LONG,
+    OP_LOOP_LONG,
+    OP_ARRAY_LONG,
+    OP_CALL_LONG,
+    OP_TAIL_CALL_LONG,
+    OP_INVOKE_LONG,
+    OP_TAIL_INVOKE_LONG,
+    OP_INVOKE_SUPER_LONG,
+    OP_TAIL_INVOKE_SUPER_LONG,
 } OpCode;
 
+// Read by a stack closure with OP_GET_ENCLOSING.
+#define UPVALUE_ENCLOSING 2
+// Copied into the closure, from the local at index or from the value the running closure copied at index.
+#define UPVALUE_COPY_LOCAL 3
+#define UPVALUE_COPY_VALUE 4
+
+#define REGISTER_CONSTANT 0x8000
+
+#define INLINE_CACHE_ENTRIES 4
+
+// One receiver seen by a property instruction, keyed on the instance's shape (or on its class once the
+// instance is in dictionary mode). index is the field's slot, or -1 when value holds the resolved method.
+// Stores that add a field keep the shape the instance transitions to in value.
+typedef struct {
+    Obj *key;
+    int index;
+    Value value;
+} InlineCacheEntry;
+
+// Monomorphic while count == 1, polymorphic up to INLINE_CACHE_ENTRIES, not updated anymore once full.
+typedef struct {
+    int count;
+    InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+// A case of a switch table, target is the offset of its body or -1 for a free slot.
+typedef struct {
+    Value label;
+    int target;
+} SwitchCase;
+
+// Where OP_SWITCH looks its value up. Integer labels close together are found directly at label - low,
+// anything else goes through open addressing on the label. The labels are among the chunk's constants.
+typedef struct {
+    bool dense;
+    int low;
+    int capacity;
+    SwitchCase *cases;
+    // Where values matching no label go, the default case or past the end of the switch.
+    int defaultTarget;
+} SwitchTable;
+
+// Code the optimizer spliced in place of a call to the function it inlined, the ObjFunction, covering [start,
+// end). The line table has the lines of the inlined function for it, line is the line of the call. Calls
+// inlined into the inlined function come before the call they are part of. A tail call would have replaced
+// the frame it was made from, so traces leave that one out.
+typedef struct {
+    int start;
+    int end;
+    uint32_t line;
+    bool tailCall;
+    Obj *function;
+} InlinedCall;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
     ValueArray constants;
+    // Open addressing table of constant indices plus one (zero is a free slot) hashed on their value, so a
+    // literal used many times takes a single constant.
+    int *constantIndex;
+    int constantIndexCapacity;
     LineArray lines;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache *caches;
+    int switchCount;
+    int switchCapacity;
+    SwitchTable *switches;
+    int inlinedCount;
+    InlinedCall *inlined;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 
 void freeChunk(Chunk *chunk);
 
-void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line);
+void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line, uint32_t column);
+
+void truncateChunk(Chunk *chunk, int count);
+
+int instructionLength(Chunk *chunk, int offset);
 
+// Returns the index of value in the chunk's constants, adding it unless an identical value is there already.
 int addConstant(Chunk *chunk, Value value);
 
-int writeConstant(Chunk *chunk, Value value, int line);
+// Drops the lookup table addConstant uses, once the function is compiled and gets no more constants.
+void freeConstantIndex(Chunk *chunk);
+
+int addInlineCache(Chunk *chunk);
+
+int writeConstant(Chunk *chunk, Value value, int line, int column);
+
+// Whether value can label a case of a switch table: a string, or an integer that fits an int.
+bool isSwitchLabel(Value value);
+
+// Builds a switch table out of count labels and the offsets of their cases, the first of equal labels wins.
+int addSwitchTable(Chunk *chunk, Value *labels, int *targets, int count, int defaultTarget);
+
+int switchTarget(SwitchTable *table, Value value);
 
 #endif //CLOX_CHUNK_H
@@ -1,10 +1,13 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
 #include "common.h"
 #include "compiler.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "table.h"
 
@@ -43,7 +46,18 @@ typedef struct {
     Token name;
     int depth;
     bool isConst;
-    bool isCaptured;
+    // Functions capturing the variable, which then gets closed rather than popped when it goes out of scope.
+    int captures;
+    // Whether anything assigns the variable after its declaration, and where its lifetime starts in the chunk.
+    // Closures copy variables never assigned instead of sharing them through upvalues.
+    bool assigned;
+    int start;
+    // Offset of the OP_CLOSURE of a local function for as long as its closure could still become a stack
+    // closure: one that is only called, never stored or captured, so it can't outlive the frame. -1 otherwise.
+    int closure;
+    // Set for consts initialized with a literal, reads of those compile to the literal itself.
+    bool hasValue;
+    Value value;
 } Local;
 
 typedef struct {
@@ -69,9 +83,27 @@ typedef struct Compiler {
     int localCount;
     int localCapacity;
     int scopeDepth;
+    // Set when a nested function captures one of this function's upvalues, which then has to exist.
+    bool sharesUpvalues;
     int loopStart;
     int switchCaseDepth;
     int loopScopeDepth;
+    // Slots of the variable of the innermost for loop and of its per-iteration copy, -1 without a copy.
+    int loopVarSlot;
+    int loopShadowSlot;
+    int operandStart;
+    int lessOffset;
+    int jumpTarget;
+    int callOffset;
+    // Offset of the last OP_GET_GLOBAL, and the calls found to reach a function that may get inlined.
+    int globalOffset;
+    CallSite *calls;
+    int callCount;
+    int callCapacity;
+    // Jumps whose distance didn't fit, the optimizer gives them the long encoding.
+    FarJump *farJumps;
+    int farJumpCount;
+    int farJumpCapacity;
     struct {
         int stack[UINT8_MAX];
         int top;
@@ -84,6 +116,16 @@ typedef struct Compiler {
     } SwitchBreak;
 } Compiler;
 
+// A function declared at the top level of the script under a name no other declaration or assignment in
+// the source uses, so the variable holds that function from the declaration on. Calls compiled after the
+// declaration always reach it and can be inlined. function is NULL until the declaration got compiled.
+typedef struct {
+    Token name;
+    int global;
+    ObjFunction *function;
+    bool dropped;
+} InlineCandidate;
+
 typedef struct ClassCompiler {
     struct ClassCompiler *enclosing;
     bool hasSuperclass;
@@ -93,6 +135,16 @@ Parser parser;
 Compiler *current = NULL;
 ClassCompiler *currentClass = NULL;
 
+// Global consts declared from this one on came after the function being compiled lazily, which couldn't have
+// seen them had it been compiled in place.
+static int visibleConsts = INT_MAX;
+
+static struct {
+    InlineCandidate *candidates;
+    int count;
+    int capacity;
+} inlining;
+
 #define PATCH_BREAK(breakType) \
     do {                       \
         for (int i = 0; i < (breakType).count; i++) { \
@@ -195,7 +247,7 @@ static void synchronize() {
 }
 
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, parser.previous.line, parser.previous.column);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -224,6 +276,45 @@ inline static void emitLong(uint8_t instruction, int operand) {
     emitByte((uint8_t) ((operand >> 16) & 0xff));
 }
 
+// Property instructions carry the index of their own inline cache in the chunk.
+static void emitInlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+        return;
+    }
+    emitByte((uint8_t) cache & 0xff);
+    emitByte((uint8_t) ((cache >> 8) & 0xff));
+}
+
+// Globals past what 16 bits index take the long form of the instruction.
+static void emitGlobal(uint8_t instruction, int global) {
+    if (global <= UINT16_MAX) {
+        emitShort(instruction, global);
+        return;
+    }
+    switch (instruction) {
+        case OP_GET_GLOBAL:
+            emitLong(OP_GET_GLOBAL_LONG, global);
+            break;
+        case OP_SET_GLOBAL:
+            emitLong(OP_SET_GLOBAL_LONG, global);
+            break;
+        default:
+            emitLong(OP_DEFINE_GLOBAL_LONG, global);
+            break;
+    }
+}
+
+// The argument count of a call takes a byte, or two in the long form.
+static void emitArgumentCount(uint8_t instruction, uint8_t longInstruction, int argCount) {
+    if (argCount <= UINT8_MAX) {
+        emitBytes(instruction, argCount);
+    } else {
+        emitShort(longInstruction, argCount);
+    }
+}
+
 static int emitJump(uint8_t instruction) {
     emitByte(instruction);
     emitByte(0xff);
@@ -231,10 +322,138 @@ static int emitJump(uint8_t instruction) {
     return currentChunk()->count - 2;
 }
 
+// Drops the code from count on, along with whatever the fusions remember about it.
+static void truncateCode(int count) {
+    truncateChunk(currentChunk(), count);
+    if (current->lessOffset >= count) {
+        current->lessOffset = -1;
+    }
+    if (current->callOffset >= count) {
+        current->callOffset = -1;
+    }
+    while (current->farJumpCount > 0 && current->farJumps[current->farJumpCount - 1].offset >= count) {
+        current->farJumpCount--;
+    }
+    if (current->jumpTarget > count) {
+        current->jumpTarget = -1;
+    }
+}
+
+// Emits the jump out of a condition. "a < b" followed by the jump becomes a single OP_JUMP_IF_NOT_LESS,
+// which consumes both operands, so the caller must not pop the condition when *fused is set.
+static int emitConditionJump(bool *fused) {
+    Chunk *chunk = currentChunk();
+    *fused = current->lessOffset == chunk->count - 1 && current->jumpTarget != chunk->count;
+
+    if (*fused) {
+        truncateCode(chunk->count - 1);
+        return emitJump(OP_JUMP_IF_NOT_LESS);
+    }
+
+    int jump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    return jump;
+}
+
+// Turns "OP_GET_LOCAL a; OP_GET_LOCAL b" into "instruction a b" when both operands are plain locals.
+static bool fuseLocals(uint8_t instruction, int leftStart, int rightStart) {
+    Chunk *chunk = currentChunk();
+    if (rightStart - leftStart != 3 || chunk->count - rightStart != 3 ||
+        chunk->code[leftStart] != OP_GET_LOCAL || chunk->code[rightStart] != OP_GET_LOCAL) {
+        return false;
+    }
+
+    chunk->code[leftStart] = instruction;
+    chunk->code[leftStart + 3] = chunk->code[rightStart + 1];
+    chunk->code[leftStart + 4] = chunk->code[rightStart + 2];
+    truncateChunk(chunk, chunk->count - 1);
+    return true;
+}
+
+// The operand of a register instruction for an instruction that just pushes a local or a constant, -1 for
+// anything else.
+static int registerOperand(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_GET_LOCAL: {
+            int slot = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+            return slot < REGISTER_CONSTANT ? slot : -1;
+        }
+        case OP_CONSTANT: {
+            int constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+            return constant < REGISTER_CONSTANT ? constant | REGISTER_CONSTANT : -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+static uint8_t registerInstruction(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD:
+            return OP_ADD_REGISTERS;
+        case OP_SUBTRACT:
+            return OP_SUBTRACT_REGISTERS;
+        case OP_MULTIPLY:
+            return OP_MULTIPLY_REGISTERS;
+        case OP_DIVIDE:
+            return OP_DIVIDE_REGISTERS;
+        default:
+            return OP_POP;
+    }
+}
+
+// Ends an expression statement whose code starts at start by popping its value. Statements that assign
+// a local, a constant or arithmetic on two of them to a local ("a = b + c;") get rewritten into a single
+// register instruction instead, which leaves nothing on the stack to pop.
+static void endExpressionStatement(int start) {
+    Chunk *chunk = currentChunk();
+    int set = chunk->count - 3;
+    if (!vm.registers || set <= start || chunk->code[set] != OP_SET_LOCAL) {
+        emitByte(OP_POP);
+        return;
+    }
+
+    int destination = chunk->code[set + 1] | (chunk->code[set + 2] << 8);
+    uint8_t instruction = OP_POP;
+    int a = registerOperand(chunk, start);
+    int b = -1;
+    if (chunk->code[start] == OP_ADD_LOCALS && start + 5 == set) {
+        instruction = OP_ADD_REGISTERS;
+        a = chunk->code[start + 1] | (chunk->code[start + 2] << 8);
+        b = chunk->code[start + 3] | (chunk->code[start + 4] << 8);
+        if (a >= REGISTER_CONSTANT || b >= REGISTER_CONSTANT) {
+            instruction = OP_POP;
+        }
+    } else if (a != -1 && start + instructionLength(chunk, start) == set) {
+        instruction = OP_MOVE;
+    } else if (a != -1) {
+        int second = start + instructionLength(chunk, start);
+        if (second < set && (b = registerOperand(chunk, second)) != -1 &&
+            second + instructionLength(chunk, second) == set - 1) {
+            instruction = registerInstruction(chunk->code[set - 1]);
+        }
+    }
+
+    if (instruction == OP_POP || destination >= REGISTER_CONSTANT) {
+        emitByte(OP_POP);
+        return;
+    }
+
+    truncateCode(start);
+    emitShort(instruction, destination);
+    emitByte((uint8_t) a & 0xff);
+    emitByte((uint8_t) ((a >> 8) & 0xff));
+    if (instruction != OP_MOVE) {
+        emitByte((uint8_t) b & 0xff);
+        emitByte((uint8_t) ((b >> 8) & 0xff));
+    }
+}
+
 static void emitLoop(int loopStart) {
     int offset = currentChunk()->count - loopStart + 3;
     if (offset > UINT16_MAX) {
-        error("Loop body too large.");
+        emitLong(OP_LOOP_LONG, offset + 1);
+        return;
     }
     emitShort(OP_LOOP, offset);
 }
@@ -249,14 +468,64 @@ static void emitReturn() {
 }
 
 static void emitConstant(Value value) {
-    writeConstant(currentChunk(), value, parser.previous.line);
+    writeConstant(currentChunk(), value, parser.previous.line, parser.previous.column);
+}
+
+static void emitLiteral(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Whether the code from start to end is a single literal (or an expression already folded into one), which
+// lets the caller fold it further. -O0 keeps everything as written.
+static bool literalAt(int start, int end, Value *value) {
+    Chunk *chunk = currentChunk();
+    if (vm.optimizationLevel == OPTIMIZE_NONE || start < 0 || start >= end ||
+        start + instructionLength(chunk, start) != end || current->jumpTarget == end) {
+        return false;
+    }
+
+    switch (chunk->code[start]) {
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[start + 1] | (chunk->code[start + 2] << 8) |
+                                             (chunk->code[start + 3] << 16)];
+            return true;
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+    }
 }
 
+// A jump too far for its operand is left for the optimizer to relax, its operand stays as emitted.
 static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
+    current->jumpTarget = currentChunk()->count;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        if (current->farJumpCapacity < current->farJumpCount + 1) {
+            int oldCapacity = current->farJumpCapacity;
+            current->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+            current->farJumps = GROW_ARRAY(FarJump, current->farJumps, oldCapacity, current->farJumpCapacity);
+        }
+        current->farJumps[current->farJumpCount++] = (FarJump) {offset - 1, currentChunk()->count};
+        return;
     }
 
     currentChunk()->code[offset] = jump & 0xff;
@@ -265,7 +534,7 @@ static void patchJump(int offset) {
 
 static int makeConstant(Value value) {
     ValueArray *globalValues = &buffer.globalVars;
-    if (globalValues->count + 1 > UINT16_MAX) {
+    if (globalValues->count + 1 > UINT24_MAX) {
         error("Too many globalValues in one chunk.");
         return 0;
     }
@@ -276,7 +545,8 @@ static int makeConstant(Value value) {
     return globalValues->count - 1;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
+// Compiles into function, a new one when it is NULL.
+static void initCompiler(Compiler *compiler, FunctionType type, ObjFunction *function) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
@@ -285,25 +555,44 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     compiler->locals = ALLOCATE(Local, LOCALS_MIN);
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->sharesUpvalues = false;
+    compiler->function = function != NULL ? function : newFunction();
 
     compiler->loopStart = -1;
     compiler->loopScopeDepth = -1;
+    compiler->loopVarSlot = -1;
+    compiler->loopShadowSlot = -1;
     compiler->switchCaseDepth = 0;
 
+    compiler->operandStart = -1;
+    compiler->lessOffset = -1;
+    compiler->jumpTarget = -1;
+    compiler->callOffset = -1;
+    compiler->globalOffset = -1;
+    compiler->calls = NULL;
+    compiler->callCount = 0;
+    compiler->callCapacity = 0;
+    compiler->farJumps = NULL;
+    compiler->farJumpCount = 0;
+    compiler->farJumpCapacity = 0;
+
     compiler->LoopBreak.top = 0;
     compiler->LoopBreak.count = 0;
     compiler->SwitchBreak.top = 0;
     compiler->SwitchBreak.count = 0;
     current = compiler;
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = makeString(parser.previous.start, parser.previous.length, false);
     }
 
     Local *local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isConst = false;
-    local->isCaptured = false;
+    local->captures = 0;
+    local->closure = -1;
+    local->assigned = false;
+    local->start = currentChunk()->count;
+    local->hasValue = false;
 
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
@@ -314,10 +603,110 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     }
 }
 
+static ObjFunction *closureFunction(Chunk *chunk, int offset) {
+    uint8_t *code = &chunk->code[offset];
+    return AS_FUNCTION(chunk->constants.values[code[1] | (code[2] << 8) | (code[3] << 16)]);
+}
+
+// Turns the closure created by the OP_CLOSURE at offset into a stack closure, which reads the variables it
+// captured from this function's frame instead of allocating upvalues for them. Its function can only be
+// called from here, so this frame is always the one right below its own.
+static void makeStackClosure(int offset) {
+    Chunk *chunk = currentChunk();
+    ObjFunction *function = closureFunction(chunk, offset);
+    uint8_t *upvalues = &chunk->code[offset + 4];
+
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (upvalues[2 * i] == 1) {
+            upvalues[2 * i] = UPVALUE_ENCLOSING;
+            current->locals[upvalues[2 * i + 1]].captures--;
+        }
+    }
+
+    Chunk *body = &function->chunk;
+    for (int i = 0; i < body->count; i += instructionLength(body, i)) {
+        uint8_t op = body->code[i];
+        if (op != OP_GET_UPVALUE && op != OP_SET_UPVALUE) {
+            continue;
+        }
+        int upvalue = body->code[i + 1] | (body->code[i + 2] << 8);
+        if (upvalues[2 * upvalue] == UPVALUE_ENCLOSING) {
+            body->code[i] = op == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+            body->code[i + 1] = upvalues[2 * upvalue + 1];
+            body->code[i + 2] = 0;
+        }
+    }
+    function->readsEnclosingFrame = true;
+}
+
+// Makes function read its upvalue at index from a copy in its closures, and the functions nested in it that
+// capture that upvalue in turn copy it from there.
+static void readCapturedValue(ObjFunction *function, int index) {
+    function->capturesValues = true;
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        if (code[0] == OP_GET_UPVALUE && (code[1] | (code[2] << 8)) == index) {
+            code[0] = OP_GET_CAPTURED;
+        } else if (code[0] == OP_CLOSURE) {
+            ObjFunction *nested = closureFunction(chunk, offset);
+            for (int i = 0; i < nested->upvalueCount; i++) {
+                if (code[4 + 2 * i] == 0 && code[5 + 2 * i] == index) {
+                    code[4 + 2 * i] = UPVALUE_COPY_VALUE;
+                    readCapturedValue(nested, i);
+                }
+            }
+        }
+    }
+}
+
+// Makes the closures capturing the local at slot, which nothing assigned, copy its value when they are
+// created rather than share it through an upvalue.
+static void captureByValue(int slot) {
+    Local *local = &current->locals[slot];
+    Chunk *chunk = currentChunk();
+    for (int offset = local->start; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] != OP_CLOSURE) {
+            continue;
+        }
+        ObjFunction *function = closureFunction(chunk, offset);
+        uint8_t *upvalues = &chunk->code[offset + 4];
+        for (int i = 0; i < function->upvalueCount; i++) {
+            if (upvalues[2 * i] == 1 && upvalues[2 * i + 1] == slot) {
+                upvalues[2 * i] = UPVALUE_COPY_LOCAL;
+                local->captures--;
+                readCapturedValue(function, i);
+            }
+        }
+    }
+}
+
+// Settles how closures get at the local at slot when it goes out of scope, once everything that can use it
+// got compiled.
+static void finishLocal(int slot) {
+    Local *local = &current->locals[slot];
+    if (local->closure != -1) {
+        makeStackClosure(local->closure);
+    }
+    if (local->captures > 0 && !local->assigned && vm.optimizationLevel >= OPTIMIZE_BASIC && !parser.hadError) {
+        captureByValue(slot);
+    }
+}
+
 static ObjFunction *endCompiler() {
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        finishLocal(i);
+    }
     emitReturn();
     FREE_ARRAY(Local, current->locals, current->localCapacity);
     ObjFunction *function = current->function;
+    if (!parser.hadError) {
+        optimizeFunction(function, vm.optimizationLevel, current->calls, current->callCount, current->farJumps,
+                         current->farJumpCount);
+    }
+    FREE_ARRAY(CallSite, current->calls, current->callCapacity);
+    FREE_ARRAY(FarJump, current->farJumps, current->farJumpCapacity);
+    freeConstantIndex(&function->chunk);
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name);
@@ -336,7 +725,8 @@ static void endScope() {
 
     uint16_t popCount = 0;
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        finishLocal(current->localCount - 1);
+        if (current->locals[current->localCount - 1].captures > 0) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -381,6 +771,38 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
+// Whether name is a global const visible where the compiler is, with the literal it was declared with (or
+// undefined) in value.
+static bool globalConst(Token *name, Value *value) {
+    ObjString *string = makeString(name->start, name->length, true);
+    Value order;
+    return tableGet(&buffer.constVarIdentifiers, string, value) &&
+           (!tableGet(&buffer.constVarOrder, string, &order) || AS_NUMBER(order) < visibleConsts);
+}
+
+// The literal a const resolves to, looking through the locals of every enclosing function before the globals.
+// The innermost variable with the name decides, a plain var shadowing a const hides it.
+static bool resolveConstant(Compiler *compiler, Token *name, Value *value) {
+    if (vm.optimizationLevel == OPTIMIZE_NONE) {
+        return false;
+    }
+
+    for (; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local *local = &compiler->locals[i];
+            if (identifiersEqual(&local->name, name)) {
+                if (local->depth == -1 || !local->isConst || !local->hasValue) {
+                    return false;
+                }
+                *value = local->value;
+                return true;
+            }
+        }
+    }
+
+    return globalConst(name, value) && !IS_UNDEFINED(*value);
+}
+
 static int addUpvalue(Compiler *compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -395,9 +817,20 @@ static int addUpvalue(Compiler *compiler, int index, bool isLocal) {
         error("Too many closure variables in function.");
         return 0;
     }
+    // OP_CLOSURE gives the slot of a captured local in a byte.
+    if (isLocal && index > UINT8_MAX) {
+        error("Can't capture a local variable past the first 256 slots of a function.");
+        return 0;
+    }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    if (isLocal) {
+        compiler->enclosing->locals[index].captures++;
+        compiler->enclosing->locals[index].closure = -1;
+    } else {
+        compiler->enclosing->sharesUpvalues = true;
+    }
     return compiler->function->upvalueCount++;
 }
 
@@ -408,7 +841,6 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
         return addUpvalue(compiler, local, true);
     }
 
@@ -420,6 +852,16 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     return -1;
 }
 
+// Marks the variable the upvalue at index of compiler refers to as assigned.
+static void markAssigned(Compiler *compiler, int index) {
+    Upvalue *upvalue = &compiler->upvalues[index];
+    if (upvalue->isLocal) {
+        compiler->enclosing->locals[upvalue->index].assigned = true;
+    } else {
+        markAssigned(compiler->enclosing, upvalue->index);
+    }
+}
+
 static void addLocal(Token name) {
     if (current->localCount + 1 >= LOCALS_MAX) {
         error("Too many local variables in the scope.");
@@ -436,7 +878,11 @@ static void addLocal(Token name) {
     local->name = name;
     local->depth = -1;
     local->isConst = false;
-    local->isCaptured = false;
+    local->captures = 0;
+    local->closure = -1;
+    local->assigned = false;
+    local->start = currentChunk()->count;
+    local->hasValue = false;
 }
 
 static void declareVariable() {
@@ -459,8 +905,18 @@ static void declareVariable() {
     addLocal(*name);
 }
 
+// Reads of a global const may have been replaced by its value already, so it can't be declared again.
+static void checkConstRedeclaration(Token *name) {
+    Value value;
+    if (current->scopeDepth == 0 &&
+        tableGet(&buffer.constVarIdentifiers, makeString(name->start, name->length, true), &value)) {
+        error("Cannot redeclare a constant variable.");
+    }
+}
+
 static uint32_t parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
+    checkConstRedeclaration(&parser.previous);
 
     declareVariable();
     if (current->scopeDepth > 0) {
@@ -485,19 +941,22 @@ static void defineVariable(uint32_t global, Token name, bool isConst) {
     }
 
     if (isConst) {
-        tableSet(&buffer.constVarIdentifiers, makeString(name.start, name.length, true), BOOL_VAL(true));
+        // The value stays undefined unless the declaration turns out to have a literal initializer.
+        ObjString *string = makeString(name.start, name.length, true);
+        tableSet(&buffer.constVarIdentifiers, string, UNDEFINED_VAL);
+        tableSet(&buffer.constVarOrder, string, NUMBER_VAL(buffer.constCount++));
     }
 
-    emitShort(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {
-    uint8_t argCount = 0;
+static int argumentList() {
+    int argCount = 0;
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
             expression();
-            if (argCount == 255) {
-                error("Can't have more than 255 arguments.");
+            if (argCount == UINT16_MAX) {
+                error("Can't have more than 65535 arguments.");
             }
             argCount++;
         } while (match(TOKEN_COMMA));
@@ -506,13 +965,13 @@ static uint8_t argumentList() {
     return argCount;
 }
 
-static uint16_t arrayElements() {
-    uint16_t elementCount = 0;
+static int arrayElements() {
+    int elementCount = 0;
     if (!check(TOKEN_RIGHT_BRACKET)) {
         do {
             expression();
-            if (elementCount == 1024) {
-                error("Can't have more than 1024 elements in array declaration.");
+            if (elementCount == UINT24_MAX - 1) {
+                error("Can't have more than 16777215 elements in array declaration.");
             }
             elementCount++;
         } while (match(TOKEN_COMMA));
@@ -522,6 +981,12 @@ static uint16_t arrayElements() {
 }
 
 static void namedVariable(Token name, bool canAssign) {
+    Value constant;
+    if (!(canAssign && check(TOKEN_EQUAL)) && resolveConstant(current, &name, &constant)) {
+        emitLiteral(constant);
+        return;
+    }
+
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
 
@@ -539,27 +1004,64 @@ static void namedVariable(Token name, bool canAssign) {
 
     if (canAssign && match(TOKEN_EQUAL)) {
         Value val;
-        if ((tableGet(&buffer.constVarIdentifiers, makeString(name.start, name.length, true), &val)) ||
+        if (globalConst(&name, &val) ||
             (arg != -1 && setOp != OP_SET_GLOBAL && current->locals[arg].isConst)) {
             error("Cannot assign to a constant variable.");
             return;
         }
 
+        if (setOp == OP_SET_LOCAL) {
+            current->locals[arg].assigned = true;
+        } else if (setOp == OP_SET_UPVALUE) {
+            markAssigned(current, arg);
+        }
         expression();
-        emitShort(setOp, arg);
+        if (setOp == OP_SET_GLOBAL) {
+            emitGlobal(setOp, arg);
+        } else {
+            emitShort(setOp, arg);
+        }
     } else {
-        emitShort(getOp, arg);
+        // Calling a local function is the one use that doesn't let its closure escape.
+        if (getOp == OP_GET_LOCAL && !check(TOKEN_LEFT_PAREN)) {
+            current->locals[arg].closure = -1;
+        }
+        if (getOp == OP_GET_GLOBAL) {
+            emitGlobal(getOp, arg);
+            if (arg <= UINT16_MAX) {
+                current->globalOffset = currentChunk()->count - 3;
+            }
+        } else {
+            emitShort(getOp, arg);
+        }
     }
 }
 
+// Replaces "literal operator literal", just emitted, with its result. Anything the VM would reject is left
+// for it to report.
+static void foldBinary(int leftStart, int rightStart) {
+    Chunk *chunk = currentChunk();
+    int operator = chunk->count - 1;
+    Value a, b, result;
+    if (!literalAt(leftStart, rightStart, &a) || !literalAt(rightStart, operator, &b) ||
+        !foldOperation(chunk->code[operator], a, b, &result)) {
+        return;
+    }
+
+    truncateCode(leftStart);
+    emitLiteral(result);
+}
+
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    int leftStart = current->operandStart;
+    int rightStart = currentChunk()->count;
     ParseRule *rule = getRule(operatorType);
     parsePrecedence((Precedence) (rule->precedence + 1));
 
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitByte(OP_NOT_EQUAL);
             break;
         case TOKEN_EQUAL_EQUAL:
             emitByte(OP_EQUAL);
@@ -568,16 +1070,19 @@ static void binary(bool canAssign) {
             emitByte(OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitByte(OP_GREATER_EQUAL);
             break;
         case TOKEN_LESS:
             emitByte(OP_LESS);
+            current->lessOffset = currentChunk()->count - 1;
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitByte(OP_LESS_EQUAL);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            if (!fuseLocals(OP_ADD_LOCALS, leftStart, rightStart)) {
+                emitByte(OP_ADD);
+            }
             break;
         case TOKEN_MINUS:
             emitByte(OP_SUBTRACT);
@@ -594,11 +1099,108 @@ static void binary(bool canAssign) {
         default:
             return; // Unreachable.
     }
+
+    foldBinary(leftStart, rightStart);
+}
+
+static InlineCandidate *findInlineCandidate(Token *name) {
+    for (int i = 0; i < inlining.count; i++) {
+        if (identifiersEqual(&inlining.candidates[i].name, name)) {
+            return &inlining.candidates[i];
+        }
+    }
+    return NULL;
+}
+
+// Collects the functions calls can be inlined to, in two scans of the source before it gets compiled: one
+// for the functions declared at the top level, one dropping those whose name anything else declares there
+// or anything assigns. Any variable of that name counts, which is never wrong, only cautious.
+static void findInlineCandidates(const char *source) {
+    inlining.count = 0;
+    if (!vm.inlining || vm.lazyCompilation || vm.optimizationLevel < OPTIMIZE_FULL) {
+        return;
+    }
+
+    for (int scan = 0; scan < 2; scan++) {
+        initScanner(source);
+        int depth = 0;
+        Token previous = {.type = TOKEN_EOF};
+        for (Token token = scanToken(); token.type != TOKEN_EOF; previous = token, token = scanToken()) {
+            if (token.type == TOKEN_LEFT_BRACE) {
+                depth++;
+            } else if (token.type == TOKEN_RIGHT_BRACE) {
+                depth--;
+            }
+
+            bool declaration = token.type == TOKEN_IDENTIFIER && depth == 0 &&
+                               (previous.type == TOKEN_FUN || previous.type == TOKEN_VAR ||
+                                previous.type == TOKEN_CONST || previous.type == TOKEN_CLASS);
+            if (scan == 0 && declaration && previous.type == TOKEN_FUN) {
+                InlineCandidate *candidate = findInlineCandidate(&token);
+                if (candidate != NULL) {
+                    candidate->dropped = true;
+                    continue;
+                }
+                if (inlining.capacity < inlining.count + 1) {
+                    inlining.capacity = GROW_CAPACITY(inlining.capacity);
+                    inlining.candidates = realloc(inlining.candidates, sizeof(InlineCandidate) * inlining.capacity);
+                }
+                candidate = &inlining.candidates[inlining.count++];
+                candidate->name = token;
+                candidate->global = -1;
+                candidate->function = NULL;
+                candidate->dropped = false;
+            } else if (scan == 1 && ((declaration && previous.type != TOKEN_FUN) ||
+                                     (token.type == TOKEN_EQUAL && previous.type == TOKEN_IDENTIFIER))) {
+                InlineCandidate *candidate = findInlineCandidate(declaration ? &token : &previous);
+                if (candidate != NULL) {
+                    candidate->dropped = true;
+                }
+            }
+        }
+    }
+}
+
+static void freeInlineCandidates() {
+    free(inlining.candidates);
+    inlining.candidates = NULL;
+    inlining.count = 0;
+    inlining.capacity = 0;
+}
+
+// Remembers a call compiled right behind the global it calls, when that holds a function already compiled
+// which no one reassigns.
+static void addCallSite(int global, int offset) {
+    for (int i = 0; i < inlining.count; i++) {
+        InlineCandidate *candidate = &inlining.candidates[i];
+        if (candidate->global != global || candidate->function == NULL || candidate->dropped) {
+            continue;
+        }
+        if (current->callCapacity < current->callCount + 1) {
+            int oldCapacity = current->callCapacity;
+            current->callCapacity = GROW_CAPACITY(oldCapacity);
+            current->calls = GROW_ARRAY(CallSite, current->calls, oldCapacity, current->callCapacity);
+        }
+        CallSite *site = &current->calls[current->callCount++];
+        site->offset = offset;
+        site->global = global;
+        site->callee = candidate->function;
+        return;
+    }
 }
 
 static void call(bool canAssign) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    Chunk *chunk = currentChunk();
+    int global = -1;
+    if (current->globalOffset != -1 && current->globalOffset == chunk->count - 3) {
+        global = chunk->code[chunk->count - 2] | (chunk->code[chunk->count - 1] << 8);
+    }
+    int argCount = argumentList();
+    emitArgumentCount(OP_CALL, OP_CALL_LONG, argCount);
+    current->callOffset = currentChunk()->count - (argCount <= UINT8_MAX ? 2 : 3);
+    if (global != -1 && argCount <= UINT8_MAX) {
+        addCallSite(global, current->callOffset);
+    }
 }
 
 static void dot(bool canAssign) {
@@ -608,12 +1210,22 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitLong(OP_SET_PROPERTY, name);
+        emitInlineCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        emitLong(OP_INVOKE, name);
-        emitByte(argCount);
+        int argCount = argumentList();
+        int offset = currentChunk()->count;
+        if (argCount <= UINT8_MAX) {
+            emitLong(OP_INVOKE, name);
+            emitByte(argCount);
+        } else {
+            emitLong(OP_INVOKE_LONG, name);
+            emitBytes((uint8_t) argCount & 0xff, (uint8_t) ((argCount >> 8) & 0xff));
+        }
+        emitInlineCache();
+        current->callOffset = offset;
     } else {
         emitLong(OP_GET_PROPERTY, name);
+        emitInlineCache();
     }
 }
 
@@ -692,10 +1304,17 @@ static void super_(bool canAssign) {
     namedVariable(syntheticToken("this"), false);
 
     if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argumentCount = argumentList();
+        int argumentCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitLong(OP_INVOKE_SUPER, name);
-        emitByte(argumentCount);
+        int offset = currentChunk()->count;
+        if (argumentCount <= UINT8_MAX) {
+            emitLong(OP_INVOKE_SUPER, name);
+            emitByte(argumentCount);
+        } else {
+            emitLong(OP_INVOKE_SUPER_LONG, name);
+            emitBytes((uint8_t) argumentCount & 0xff, (uint8_t) ((argumentCount >> 8) & 0xff));
+        }
+        current->callOffset = offset;
     } else {
         namedVariable(syntheticToken("super"), false);
         emitLong(OP_GET_SUPER, name);
@@ -713,8 +1332,17 @@ static void this_(bool canAssign) {
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
+    int operandStart = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
 
+    Value operand;
+    if (literalAt(operandStart, currentChunk()->count, &operand) &&
+        (operatorType == TOKEN_BANG || IS_NUMBER(operand))) {
+        truncateCode(operandStart);
+        emitLiteral(operatorType == TOKEN_BANG ? BOOL_VAL(isFalsey(operand)) : NUMBER_VAL(-AS_NUMBER(operand)));
+        return;
+    }
+
     switch (operatorType) {
         case TOKEN_BANG:
             emitByte(OP_NOT);
@@ -728,6 +1356,26 @@ static void unary(bool canAssign) {
 }
 
 static void conditional(bool canAssign) {
+    // A literal condition picks its branch right away, the other one is still compiled to report its
+    // errors and then dropped.
+    Value condition;
+    int conditionStart = current->operandStart;
+    if (literalAt(conditionStart, currentChunk()->count, &condition)) {
+        truncateCode(conditionStart);
+        parsePrecedence(PREC_CONDITIONAL);
+        if (isFalsey(condition)) {
+            truncateCode(conditionStart);
+        }
+
+        consume(TOKEN_COLON, "Expected ':' after '?'.");
+        int elseStart = currentChunk()->count;
+        parsePrecedence(PREC_ASSIGNMENT);
+        if (!isFalsey(condition)) {
+            truncateCode(elseStart);
+        }
+        return;
+    }
+
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     parsePrecedence(PREC_CONDITIONAL);
@@ -742,8 +1390,12 @@ static void conditional(bool canAssign) {
 }
 
 static void array(bool canAssign) {
-    uint16_t elementCount = arrayElements();
-    emitShort(OP_ARRAY, elementCount);
+    int elementCount = arrayElements();
+    if (elementCount <= UINT16_MAX) {
+        emitShort(OP_ARRAY, elementCount);
+    } else {
+        emitLong(OP_ARRAY_LONG, elementCount);
+    }
 }
 
 static void arrayAccess(bool canAssign) {
@@ -770,17 +1422,15 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expected '}' after a block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+static void functionBody() {
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
             current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameters.");
+            if (current->function->arity > UINT16_MAX) {
+                errorAtCurrent("Can't have more than 65535 parameters.");
             }
             uint32_t constant = parseVariable("Expected parameter name.");
             defineVariable(constant, parser.previous, false);
@@ -789,27 +1439,98 @@ static void function(FunctionType type) {
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
     block();
+}
+
+// Returns the offset of the OP_CLOSURE it emits when the closure could become a stack closure, -1 otherwise.
+static int function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    functionBody();
 
     ObjFunction *function = endCompiler();
+    int closure = currentChunk()->count;
     emitLong(OP_CLOSURE, addConstant(currentChunk(), OBJ_VAL(function)));
 
+    bool capturesLocals = false;
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
+        capturesLocals |= compiler.upvalues[i].isLocal;
+    }
+    return capturesLocals && !compiler.sharesUpvalues ? closure : -1;
+}
+
+// Skips over the parameters and the body of a function declared at the top level of the script, which has
+// nothing to capture, and emits the closure of a stub the VM compiles them into on its first call.
+static void lazyFunction() {
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    function->name = makeString(parser.previous.start, parser.previous.length, false);
+    function->body = parser.current.start;
+    function->bodyLine = parser.current.line;
+    function->bodyColumn = parser.current.column;
+    function->bodyConsts = buffer.constCount;
+
+    consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            function->arity++;
+            if (function->arity > UINT16_MAX) {
+                errorAtCurrent("Can't have more than 65535 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expected parameter name.");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expected ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+    int depth = 1;
+    for (; depth > 0 && !check(TOKEN_EOF); advance()) {
+        if (check(TOKEN_LEFT_BRACE)) {
+            depth++;
+        } else if (check(TOKEN_RIGHT_BRACE)) {
+            depth--;
+        }
+    }
+    if (depth > 0) {
+        errorAtCurrent("Expected '}' after a block.");
     }
+
+    emitLong(OP_CLOSURE, addConstant(currentChunk(), OBJ_VAL(function)));
+    pop(1);
 }
 
 static void funDeclaration() {
     Token name = parser.current;
     uint32_t global = parseVariable("Expected function name.");
     markInitialized(false);
-    function(TYPE_FUNCTION);
+    int offset = currentChunk()->count;
+    if (vm.lazyCompilation && current->type == TYPE_SCRIPT && current->scopeDepth == 0) {
+        lazyFunction();
+        defineVariable(global, name, false);
+        return;
+    }
+    int closure = function(TYPE_FUNCTION);
     defineVariable(global, name, false);
+
+    InlineCandidate *candidate = current->type == TYPE_SCRIPT && current->scopeDepth == 0 && !parser.hadError
+                                 ? findInlineCandidate(&name) : NULL;
+    if (candidate != NULL) {
+        candidate->global = (int) global;
+        candidate->function = closureFunction(currentChunk(), offset);
+    }
+
+    // A function referring to itself captures its own variable, which counts as escaping.
+    Local *local = &current->locals[current->localCount - 1];
+    if (current->scopeDepth > 0 && local->captures == 0 && !parser.hadError &&
+        vm.optimizationLevel >= OPTIMIZE_BASIC) {
+        local->closure = closure;
+    }
 }
 
 static void varDeclaration(bool isConst) {
     uint32_t global = parseVariable("Expected variable name.");
     Token name = parser.previous;
+    int initializerStart = currentChunk()->count;
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -822,13 +1543,27 @@ static void varDeclaration(bool isConst) {
     }
     consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
 
+    Value value;
+    bool isLiteral = isConst && literalAt(initializerStart, currentChunk()->count, &value);
     defineVariable(global, name, isConst);
+
+    if (!isLiteral) {
+        return;
+    }
+    if (current->scopeDepth > 0) {
+        Local *local = &current->locals[current->localCount - 1];
+        local->hasValue = true;
+        local->value = value;
+    } else {
+        tableSet(&buffer.constVarIdentifiers, makeString(name.start, name.length, true), value);
+    }
 }
 
 static void expressionStatement() {
+    int start = currentChunk()->count;
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
-    emitByte(OP_POP);
+    endExpressionStatement(start);
 }
 
 static void ifStatement() {
@@ -836,14 +1571,16 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int thenJump = emitConditionJump(&fused);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
+    if (!fused) {
+        emitByte(OP_POP);
+    }
 
     if (match(TOKEN_ELSE)) statement();
     patchJump(elseJump);
@@ -855,6 +1592,26 @@ static void printStatement() {
     emitByte(OP_PRINT);
 }
 
+// The form of a call instruction that replaces the caller's frame.
+static uint8_t tailInstruction(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CALL:
+            return OP_TAIL_CALL;
+        case OP_CALL_LONG:
+            return OP_TAIL_CALL_LONG;
+        case OP_INVOKE:
+            return OP_TAIL_INVOKE;
+        case OP_INVOKE_LONG:
+            return OP_TAIL_INVOKE_LONG;
+        case OP_INVOKE_SUPER:
+            return OP_TAIL_INVOKE_SUPER;
+        case OP_INVOKE_SUPER_LONG:
+            return OP_TAIL_INVOKE_SUPER_LONG;
+        default:
+            return instruction;
+    }
+}
+
 static void returnStatement() {
     if (current->type == TYPE_SCRIPT) {
         error("Can't return from top-level code.");
@@ -869,6 +1626,13 @@ static void returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
+        // "return f(...);" and "return a.m(...);" hand the frame over to the callee. The OP_RETURN stays for
+        // callees that aren't functions, and for jumps over the call landing behind it.
+        Chunk *chunk = currentChunk();
+        int call = current->callOffset;
+        if (call != -1 && call + instructionLength(chunk, call) == chunk->count) {
+            chunk->code[call] = tailInstruction(chunk->code[call]);
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -876,28 +1640,79 @@ static void returnStatement() {
 static void whileStatement() {
     int previousLoopStart = current->loopStart;
     int previousLoopScopeDepth = current->loopScopeDepth;
+    int previousLoopShadowSlot = current->loopShadowSlot;
     current->loopStart = currentChunk()->count;
     current->loopScopeDepth = current->scopeDepth;
+    current->loopShadowSlot = -1;
 
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int exitJump = emitConditionJump(&fused);
     int previousCount = current->LoopBreak.count;
     current->LoopBreak.count = 0;
     statement();
     emitLoop(current->loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
+    if (!fused) {
+        emitByte(OP_POP);
+    }
     PATCH_BREAK(current->LoopBreak);
     current->loopStart = previousLoopStart;
     current->loopScopeDepth = previousLoopScopeDepth;
+    current->loopShadowSlot = previousLoopShadowSlot;
     current->LoopBreak.count = previousCount;
 }
 
+// Whether the statement the parser is about to compile may capture name in a closure: it declares a function
+// or a class and mentions the name somewhere. Functions can't be declared in expressions, so nothing else
+// can. Looks ahead up to the end of the statement (or a little further) and puts the scanner back.
+static bool mayCapture(Token *name) {
+    Scanner saved = saveScanner();
+    Token token = parser.current;
+    bool block = token.type == TOKEN_LEFT_BRACE;
+    bool declares = false;
+    bool mentions = false;
+    int depth = 0;
+
+    while (token.type != TOKEN_EOF) {
+        switch (token.type) {
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_BRACKET:
+                depth++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_BRACKET:
+                depth--;
+                break;
+            case TOKEN_FUN:
+            case TOKEN_CLASS:
+                declares = true;
+                break;
+            case TOKEN_IDENTIFIER:
+                mentions = mentions || identifiersEqual(&token, name);
+                break;
+            default:
+                break;
+        }
+
+        bool ends = token.type == TOKEN_RIGHT_BRACE || (!block && token.type == TOKEN_SEMICOLON);
+        token = scanToken();
+        // Statements without a block go on after an "else".
+        if (depth < 0 || (depth == 0 && ends && (block || token.type != TOKEN_ELSE))) {
+            break;
+        }
+    }
+
+    restoreScanner(saved);
+    return declares && mentions;
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
@@ -922,12 +1737,12 @@ static void forStatement() {
     current->loopScopeDepth = current->scopeDepth;
 
     int exitJump = -1;
+    bool fused = false;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitConditionJump(&fused);
     }
 
     // Increment expression
@@ -935,7 +1750,7 @@ static void forStatement() {
         int bodyJump = emitJump(OP_JUMP);
         int incrementStart = currentChunk()->count;
         expression();
-        emitByte(OP_POP);
+        endExpressionStatement(incrementStart);
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses.");
 
         emitLoop(current->loopStart);
@@ -946,21 +1761,30 @@ static void forStatement() {
     int previousCount = current->LoopBreak.count;
     current->LoopBreak.count = 0;
 
-    int loopShadowSlot = -1;
-    if (loopVarSlot != -1) {
+    // Closures created in the body capture a copy of the loop variable made for each iteration, which
+    // goes back into the variable when the iteration ends. Bodies that can't capture it use it directly.
+    int previousLoopVarSlot = current->loopVarSlot;
+    int previousLoopShadowSlot = current->loopShadowSlot;
+    current->loopVarSlot = loopVarSlot;
+    current->loopShadowSlot = -1;
+    if (loopVarSlot != -1 && mayCapture(&loopVarName)) {
         beginScope();
         emitShort(OP_GET_LOCAL, loopVarSlot);
         addLocal(loopVarName);
         markInitialized(false);
-        loopShadowSlot = current->localCount - 1;
+        current->loopShadowSlot = current->localCount - 1;
+        // The copy goes back into the loop variable at the end of every iteration.
+        current->locals[loopVarSlot].assigned = true;
     }
+    bool shadowed = current->loopShadowSlot != -1;
 
     statement();
 
-    if (loopVarSlot != -1) {
-        emitShort(OP_GET_LOCAL, loopShadowSlot);
+    if (shadowed) {
+        int copyStart = currentChunk()->count;
+        emitShort(OP_GET_LOCAL, current->loopShadowSlot);
         emitShort(OP_SET_LOCAL, loopVarSlot);
-        emitByte(OP_POP);
+        endExpressionStatement(copyStart);
         endScope();
     }
 
@@ -968,20 +1792,42 @@ static void forStatement() {
 
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP);
+        if (!fused) {
+            emitByte(OP_POP);
+        }
     }
 
     PATCH_BREAK(current->LoopBreak);
-    if (current->LoopBreak.count > 0 && loopVarSlot != -1) {
-        emitByte(OP_POP);
-    }
 
     endScope();
     current->loopStart = previousLoopStart;
     current->loopScopeDepth = previousLoopScopeDepth;
+    current->loopVarSlot = previousLoopVarSlot;
+    current->loopShadowSlot = previousLoopShadowSlot;
     current->LoopBreak.count = previousCount;
 }
 
+// Drops the locals declared inside the innermost loop before a break or a continue jumps out of their scope,
+// closing those that are captured.
+static void popLoopLocals() {
+    uint16_t popCount = 0;
+    for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth > current->loopScopeDepth; i--) {
+        if (current->locals[i].captures == 0) {
+            popCount++;
+            continue;
+        }
+        if (popCount > 0) {
+            emitShort(OP_POPN, popCount);
+            popCount = 0;
+        }
+        emitByte(OP_CLOSE_UPVALUE);
+    }
+
+    if (popCount > 0) {
+        emitShort(OP_POPN, popCount);
+    }
+}
+
 static void breakStatement() {
 #define EMIT_BREAK(breakType) \
     do {                      \
@@ -1000,6 +1846,7 @@ static void breakStatement() {
     }
 
     if (current->loopStart != -1) {
+        popLoopLocals();
         EMIT_BREAK(current->LoopBreak);
     } else {
         EMIT_BREAK(current->SwitchBreak);
@@ -1013,17 +1860,27 @@ static void continueStatement() {
     if (current->loopStart == -1) {
         error("Unexpected 'continue' outside of loop.");
     }
-    uint16_t popCount = 0;
-    for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth > current->loopScopeDepth; i--) {
-        popCount++;
+    // The iteration's copy of a for loop variable goes back into it, as at the end of the body.
+    if (current->loopShadowSlot != -1) {
+        emitShort(OP_GET_LOCAL, current->loopShadowSlot);
+        emitShort(OP_SET_LOCAL, current->loopVarSlot);
+        emitByte(OP_POP);
     }
 
-    if (popCount > 0) {
-        emitShort(OP_POPN, popCount);
-    }
+    popLoopLocals();
     emitLoop(current->loopStart);
 }
 
+// Where a switch statement is with its switch table.
+typedef enum {
+    // No case went into a table (yet), every case compares the value in turn.
+    SWITCH_CHAIN,
+    // Every label so far is an integer or a string literal, OP_SWITCH jumps straight to their bodies.
+    SWITCH_TABLE,
+    // The table has its default, cases after it are never compared.
+    SWITCH_TABLE_DEFAULT,
+} SwitchMode;
+
 static void switchStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'switch'.");
@@ -1037,6 +1894,17 @@ static void switchStatement() {
     addLocal(parser.previous);
     markInitialized(false);
 
+    // Cases go into a switch table for as long as their labels are literals, the first label that has to be
+    // evaluated ends the table and becomes its default, from there on cases compare the value one by one.
+    // Bodies in the table follow each other, so their fallthrough jumps get dropped again.
+    SwitchMode mode = SWITCH_CHAIN;
+    int switchOffset = -1;
+    int defaultTarget = -1;
+    Value *labels = NULL;
+    int *targets = NULL;
+    int caseCount = 0;
+    int caseCapacity = 0;
+
     bool defaultCaseCompiled = false;
     int fallthroughJump = -1;
     while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
@@ -1048,19 +1916,59 @@ static void switchStatement() {
         if (defaultCaseCompiled && parser.previous.type == TOKEN_SWITCH_DEFAULT) {
             error("switch statement can only have 1 default case.");
         }
-        if (parser.previous.type == TOKEN_SWITCH_DEFAULT) {
+        bool isDefault = parser.previous.type == TOKEN_SWITCH_DEFAULT;
+        int caseStart = currentChunk()->count;
+        Value label = NIL_VAL;
+        if (isDefault) {
             defaultCaseCompiled = true;
             emitByte(OP_TRUE);
         } else {
             emitByte(OP_DUPLICATE);
+            int labelStart = currentChunk()->count;
             expression();
+            if (!literalAt(labelStart, currentChunk()->count, &label) || !isSwitchLabel(label)) {
+                label = UNDEFINED_VAL;
+            }
             emitByte(OP_EQUAL);
         }
 
         consume(TOKEN_COLON, "Expected ':' after switch case.");
 
-        int nextCaseJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        if (mode == SWITCH_CHAIN && switchOffset == -1 && fallthroughJump == -1 && !isDefault &&
+            !IS_UNDEFINED(label)) {
+            truncateCode(caseStart);
+            switchOffset = currentChunk()->count;
+            emitShort(OP_SWITCH, 0);
+            caseStart = currentChunk()->count;
+            mode = SWITCH_TABLE;
+        } else if (mode == SWITCH_TABLE && !isDefault && IS_UNDEFINED(label)) {
+            defaultTarget = caseStart;
+            mode = SWITCH_CHAIN;
+        }
+
+        if (mode != SWITCH_CHAIN) {
+            truncateCode(fallthroughJump == -1 ? caseStart : fallthroughJump - 1);
+            fallthroughJump = -1;
+            if (mode == SWITCH_TABLE && isDefault) {
+                defaultTarget = currentChunk()->count;
+                mode = SWITCH_TABLE_DEFAULT;
+            } else if (mode == SWITCH_TABLE) {
+                if (caseCount + 1 > caseCapacity) {
+                    int oldCapacity = caseCapacity;
+                    caseCapacity = GROW_CAPACITY(oldCapacity);
+                    labels = GROW_ARRAY(Value, labels, oldCapacity, caseCapacity);
+                    targets = GROW_ARRAY(int, targets, oldCapacity, caseCapacity);
+                }
+                labels[caseCount] = label;
+                targets[caseCount++] = currentChunk()->count;
+            }
+        }
+
+        int nextCaseJump = -1;
+        if (mode == SWITCH_CHAIN) {
+            nextCaseJump = emitJump(OP_JUMP_IF_FALSE);
+            emitByte(OP_POP);
+        }
         if (fallthroughJump != -1) {
             patchJump(fallthroughJump);
         }
@@ -1073,15 +1981,32 @@ static void switchStatement() {
         current->switchCaseDepth--;
 
         fallthroughJump = emitJump(OP_JUMP);
-        patchJump(nextCaseJump);
-        emitByte(OP_POP);
+        if (nextCaseJump != -1) {
+            patchJump(nextCaseJump);
+            emitByte(OP_POP);
+        }
     }
     consume(TOKEN_RIGHT_BRACE, "Expected '}' after switch body.");
 
-    if (fallthroughJump != -1) {
+    if (fallthroughJump != -1 && mode != SWITCH_CHAIN) {
+        truncateCode(fallthroughJump - 1);
+    } else if (fallthroughJump != -1) {
         patchJump(fallthroughJump);
     }
 
+    if (switchOffset != -1) {
+        Chunk *chunk = currentChunk();
+        int table = addSwitchTable(chunk, labels, targets, caseCount,
+                                   defaultTarget == -1 ? chunk->count : defaultTarget);
+        if (table > UINT16_MAX) {
+            error("Too many switch statements in one function.");
+        }
+        chunk->code[switchOffset + 1] = (uint8_t) table & 0xff;
+        chunk->code[switchOffset + 2] = (uint8_t) ((table >> 8) & 0xff);
+    }
+    FREE_ARRAY(Value, labels, caseCapacity);
+    FREE_ARRAY(int, targets, caseCapacity);
+
     PATCH_BREAK(current->SwitchBreak);
     current->SwitchBreak.count = previousCount;
     endScope();
@@ -1101,6 +2026,7 @@ static void method() {
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expected class name.");
+    checkConstRedeclaration(&parser.previous);
     int nameConstant = addConstant(currentChunk(),
                                    OBJ_VAL(makeString(parser.previous.start, parser.previous.length, true)));
     int classIdentifier = globalVariable(&parser.previous);
@@ -1254,11 +2180,13 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int operandStart = currentChunk()->count;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        current->operandStart = operandStart;
         infixRule(canAssign);
     }
 
@@ -1272,9 +2200,10 @@ static ParseRule *getRule(TokenType type) {
 }
 
 ObjFunction *compile(const char *source) {
+    findInlineCandidates(source);
     initScanner(source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -1284,9 +2213,33 @@ ObjFunction *compile(const char *source) {
         declaration();
     }
     ObjFunction *function = endCompiler();
+    freeInlineCandidates();
     return parser.hadError ? NULL : function;
 }
 
+bool compileFunction(ObjFunction *function) {
+    restoreScanner((Scanner) {.start = function->body, .current = function->body, .line = function->bodyLine,
+                              .lineStart = function->body - (function->bodyColumn - 1)});
+    parser.hadError = false;
+    parser.panicMode = false;
+    advance();
+
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, function);
+    function->arity = 0;
+    visibleConsts = function->bodyConsts;
+    functionBody();
+    endCompiler();
+    visibleConsts = INT_MAX;
+
+    if (parser.hadError) {
+        freeChunk(&function->chunk);
+        return false;
+    }
+    function->body = NULL;
+    return true;
+}
+
 void markCompilerRoots() {
     Compiler *compiler = current;
     while (compiler != NULL) {
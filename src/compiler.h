@@ -17,6 +17,10 @@ typedef struct {
 
 ObjFunction *compile(const char *source);
 
+// Compiles the body of a function compile() only skipped over into the function itself, reporting the errors
+// in it the way compile() would. The function is left to compile again when there are some.
+bool compileFunction(ObjFunction *function);
+
 void markCompilerRoots();
 
 #endif //CLOX_COMPILER_H
@@ -29,6 +29,21 @@ inline static int byteInstruction(const char *name, Chunk *chunk,
     return offset + 2;
 }
 
+static const char *upvalueKind(int isLocal) {
+    switch (isLocal) {
+        case 0:
+            return "upvalue";
+        case 1:
+            return "local";
+        case UPVALUE_ENCLOSING:
+            return "enclosing";
+        case UPVALUE_COPY_LOCAL:
+            return "local value";
+        default:
+            return "upvalue value";
+    }
+}
+
 inline static int shortInstruction(const char *name, Chunk *chunk, int offset) {
     uint16_t operand = chunk->code[offset + 1] |
                        (chunk->code[offset + 2] << 8);
@@ -44,6 +59,38 @@ inline static int longInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 4;
 }
 
+inline static int localsInstruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t first = chunk->code[offset + 1] |
+                     (chunk->code[offset + 2] << 8);
+    uint16_t second = chunk->code[offset + 3] |
+                      (chunk->code[offset + 4] << 8);
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 5;
+}
+
+inline static void registerOperand(Chunk *chunk, int offset) {
+    uint16_t operand = chunk->code[offset] |
+                       (chunk->code[offset + 1] << 8);
+    if (operand & REGISTER_CONSTANT) {
+        printf(" '");
+        printValue(chunk->constants.values[operand & ~REGISTER_CONSTANT]);
+        printf("'");
+    } else {
+        printf(" %4d", operand);
+    }
+}
+
+inline static int registerInstruction(const char *name, int operands, Chunk *chunk, int offset) {
+    uint16_t destination = chunk->code[offset + 1] |
+                           (chunk->code[offset + 2] << 8);
+    printf("%-16s %4d <-", name, destination);
+    for (int i = 0; i < operands; i++) {
+        registerOperand(chunk, offset + 3 + 2 * i);
+    }
+    printf("\n");
+    return offset + 3 + 2 * operands;
+}
+
 inline static int constantInstruction(Chunk *chunk, int offset) {
     uint32_t operand = chunk->code[offset + 1] |
                        (chunk->code[offset + 2] << 8) |
@@ -62,16 +109,73 @@ inline static int jumpInstruction(const char *name, int sign, Chunk *chunk, int
     return offset + 3;
 }
 
-inline static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
+inline static int longJumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
+    uint32_t jump = chunk->code[offset + 1] |
+                    (chunk->code[offset + 2] << 8) |
+                    (chunk->code[offset + 3] << 16);
+    printf("%-16s %4d -> %d\n", name, offset,
+           offset + 4 + sign * (int) jump);
+    return offset + 4;
+}
+
+// Prints the cases of the switch table one per line, in slot order, followed by the default.
+inline static int switchInstruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t index = chunk->code[offset + 1] |
+                     (chunk->code[offset + 2] << 8);
+    SwitchTable *table = &chunk->switches[index];
+    printf("%-16s %4d (%s)\n", name, index, table->dense ? "dense" : "hashed");
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->cases[i].target != -1) {
+            printf("        |                            '");
+            printValue(table->cases[i].label);
+            printf("' -> %d\n", table->cases[i].target);
+        }
+    }
+    printf("        |                            default -> %d\n", table->defaultTarget);
+    return offset + 3;
+}
+
+// The long forms take two bytes for the argument count.
+inline static int invokeInstruction(const char *name, bool wide, Chunk *chunk, int offset) {
     uint32_t constant = chunk->code[offset + 1] |
                         (chunk->code[offset + 2] << 8) |
                         (chunk->code[offset + 3] << 16);
-    uint8_t argCount = chunk->code[offset + 4];
+    uint16_t argCount = chunk->code[offset + 4] |
+                        (wide ? chunk->code[offset + 5] << 8 : 0);
 
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 5;
+    return offset + (wide ? 6 : 5);
+}
+
+inline static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+    uint32_t constant = chunk->code[offset + 1] |
+                        (chunk->code[offset + 2] << 8) |
+                        (chunk->code[offset + 3] << 16);
+    uint16_t cache = chunk->code[offset + 4] |
+                     (chunk->code[offset + 5] << 8);
+
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 6;
+}
+
+inline static int invokeCachedInstruction(const char *name, bool wide, Chunk *chunk, int offset) {
+    uint32_t constant = chunk->code[offset + 1] |
+                        (chunk->code[offset + 2] << 8) |
+                        (chunk->code[offset + 3] << 16);
+    int cacheOffset = offset + (wide ? 6 : 5);
+    uint16_t argCount = chunk->code[offset + 4] |
+                        (wide ? chunk->code[offset + 5] << 8 : 0);
+    uint16_t cache = chunk->code[cacheOffset] |
+                     (chunk->code[cacheOffset + 1] << 8);
+
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return cacheOffset + 2;
 }
 
 int disassembleInstruction(Chunk *chunk, int offset) {
@@ -82,7 +186,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     } else {
         printf("%4d ", getLine(&chunk->lines, offset));
     }
-    printf("%4d ", getLine(&chunk->lines, offset));
+    printf("%3d ", getColumn(&chunk->lines, offset));
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
@@ -114,10 +218,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return shortInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return shortInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_ENCLOSING:
+            return shortInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return shortInstruction("OP_SET_ENCLOSING", chunk, offset);
+        case OP_GET_CAPTURED:
+            return shortInstruction("OP_GET_CAPTURED", chunk, offset);
         case OP_GET_PROPERTY:
-            return longInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return longInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return longInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -126,8 +236,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
@@ -146,14 +264,24 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_SWITCH:
+            return switchInstruction("OP_SWITCH", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeCachedInstruction("OP_INVOKE", false, chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeCachedInstruction("OP_TAIL_INVOKE", false, chunk, offset);
         case OP_INVOKE_SUPER:
-            return invokeInstruction("OP_INVOKE_SUPER", chunk, offset);
+            return invokeInstruction("OP_INVOKE_SUPER", false, chunk, offset);
+        case OP_TAIL_INVOKE_SUPER:
+            return invokeInstruction("OP_TAIL_INVOKE_SUPER", false, chunk, offset);
         case OP_CLOSURE: {
             int constant = (chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16));
             offset += 4;
@@ -166,7 +294,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
                 int isLocal = chunk->code[offset++];
                 int index = chunk->code[offset++];
                 printf("%04d    |                            %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                       offset - 2, upvalueKind(isLocal), index);
             }
 
             return offset;
@@ -187,6 +315,96 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_ARRAY_GET", offset);
         case OP_ARRAY_SET:
             return simpleInstruction("OP_ARRAY_SET", offset);
+        case OP_MOVE:
+            return registerInstruction("OP_MOVE", 1, chunk, offset);
+        case OP_ADD_REGISTERS:
+            return registerInstruction("OP_ADD_REGISTERS", 2, chunk, offset);
+        case OP_SUBTRACT_REGISTERS:
+            return registerInstruction("OP_SUBTRACT_REGISTERS", 2, chunk, offset);
+        case OP_MULTIPLY_REGISTERS:
+            return registerInstruction("OP_MULTIPLY_REGISTERS", 2, chunk, offset);
+        case OP_DIVIDE_REGISTERS:
+            return registerInstruction("OP_DIVIDE_REGISTERS", 2, chunk, offset);
+        case OP_GET_GLOBAL_DEFINED:
+            return shortInstruction("OP_GET_GLOBAL_DEFINED", chunk, offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_MODULO_NUM:
+            return simpleInstruction("OP_MODULO_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GREATER_EQUAL_NUM:
+            return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+        case OP_LESS_EQUAL_NUM:
+            return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+        case OP_ARRAY_GET_NUM:
+            return simpleInstruction("OP_ARRAY_GET_NUM", offset);
+        case OP_ARRAY_SET_NUM:
+            return simpleInstruction("OP_ARRAY_SET_NUM", offset);
+        case OP_ADD_UNCHECKED:
+            return simpleInstruction("OP_ADD_UNCHECKED", offset);
+        case OP_SUBTRACT_UNCHECKED:
+            return simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+        case OP_MULTIPLY_UNCHECKED:
+            return simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+        case OP_DIVIDE_UNCHECKED:
+            return simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+        case OP_GREATER_UNCHECKED:
+            return simpleInstruction("OP_GREATER_UNCHECKED", offset);
+        case OP_LESS_UNCHECKED:
+            return simpleInstruction("OP_LESS_UNCHECKED", offset);
+        case OP_GREATER_EQUAL_UNCHECKED:
+            return simpleInstruction("OP_GREATER_EQUAL_UNCHECKED", offset);
+        case OP_LESS_EQUAL_UNCHECKED:
+            return simpleInstruction("OP_LESS_EQUAL_UNCHECKED", offset);
+        case OP_ADD_LOCALS_UNCHECKED:
+            return localsInstruction("OP_ADD_LOCALS_UNCHECKED", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_UNCHECKED", 1, chunk, offset);
+        case OP_ARRAY_GET_UNCHECKED:
+            return simpleInstruction("OP_ARRAY_GET_UNCHECKED", offset);
+        case OP_ARRAY_SET_UNCHECKED:
+            return simpleInstruction("OP_ARRAY_SET_UNCHECKED", offset);
+        case OP_ADD_REGISTERS_UNCHECKED:
+            return registerInstruction("OP_ADD_REGISTERS_UNCHECKED", 2, chunk, offset);
+        case OP_SUBTRACT_REGISTERS_UNCHECKED:
+            return registerInstruction("OP_SUBTRACT_REGISTERS_UNCHECKED", 2, chunk, offset);
+        case OP_MULTIPLY_REGISTERS_UNCHECKED:
+            return registerInstruction("OP_MULTIPLY_REGISTERS_UNCHECKED", 2, chunk, offset);
+        case OP_DIVIDE_REGISTERS_UNCHECKED:
+            return registerInstruction("OP_DIVIDE_REGISTERS_UNCHECKED", 2, chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return longInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return longInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return longInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_JUMP_LONG:
+            return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_LOOP_LONG:
+            return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_ARRAY_LONG:
+            return longInstruction("OP_ARRAY_LONG", chunk, offset);
+        case OP_CALL_LONG:
+            return shortInstruction("OP_CALL_LONG", chunk, offset);
+        case OP_TAIL_CALL_LONG:
+            return shortInstruction("OP_TAIL_CALL_LONG", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invokeCachedInstruction("OP_INVOKE_LONG", true, chunk, offset);
+        case OP_TAIL_INVOKE_LONG:
+            return invokeCachedInstruction("OP_TAIL_INVOKE_LONG", true, chunk, offset);
+        case OP_INVOKE_SUPER_LONG:
+            return invokeInstruction("OP_INVOKE_SUPER_LONG", true, chunk, offset);
+        case OP_TAIL_INVOKE_SUPER_LONG:
+            return invokeInstruction("OP_TAIL_INVOKE_SUPER_LONG", true, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             exit(1);
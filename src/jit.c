@@ -0,0 +1,1667 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#ifndef NAN_BOXING
+#error "The JIT works on NaN-boxed values only."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buffer.h"
+#include "trace.h"
+
+// A baseline template compiler: every bytecode instruction becomes a fixed sequence of x86-64 code working
+// on the interpreter's own value stack, so compiled code and the interpreter can hand execution to each
+// other at any instruction boundary.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+// Compiled code keeps the interpreter state in callee-saved registers, so calls into C helpers keep them.
+#define SP          RBX
+#define SLOTS       R12
+#define UPVALUES    R13
+#define STACK_LIMIT R14
+#define STATE       R15
+
+#define XMM0 0
+#define XMM1 1
+
+#define ALU_ADD 0x01
+#define ALU_OR  0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+#define IMM_ADD 0
+#define IMM_OR  1
+#define IMM_SUB 5
+#define IMM_XOR 6
+#define IMM_CMP 7
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_P  0xa
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+
+typedef struct {
+    int position;
+    int offset;
+} Patch;
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    // Native position of every instruction, jumps are resolved against it once everything is emitted.
+    int *labels;
+    int *entries;
+
+    Patch *jumps;
+    int jumpCount;
+    int jumpCapacity;
+
+    Patch *exits;
+    int exitCount;
+    int exitCapacity;
+
+    int exitStub;
+    // Set while compiling an instruction the optimizer proved the operands of, number guards are left out.
+    bool unchecked;
+} Assembler;
+
+static void emit(Assembler *as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitInt(Assembler *as, int32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit(as, (uint8_t) (((uint32_t) value >> (8 * i)) & 0xff));
+    }
+}
+
+static void emitQuad(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit(as, (uint8_t) ((value >> (8 * i)) & 0xff));
+    }
+}
+
+static void patchInt(Assembler *as, int position, int32_t value) {
+    for (int i = 0; i < 4; i++) {
+        as->code[position + i] = (uint8_t) (((uint32_t) value >> (8 * i)) & 0xff);
+    }
+}
+
+static void addPatch(Patch **patches, int *count, int *capacity, int position, int offset) {
+    if (*capacity < *count + 1) {
+        *capacity = *capacity < 8 ? 8 : *capacity * 2;
+        *patches = realloc(*patches, sizeof(Patch) * *capacity);
+    }
+    (*patches)[*count].position = position;
+    (*patches)[*count].offset = offset;
+    (*count)++;
+}
+
+static void rex(Assembler *as, int reg, int rm) {
+    emit(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// [base + disp32]
+static void memOperand(Assembler *as, int reg, int base, int32_t disp) {
+    emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) {
+        emit(as, 0x24);
+    }
+    emitInt(as, disp);
+}
+
+static void movImm(Assembler *as, int reg, uint64_t imm) {
+    emit(as, 0x48 | (reg >> 3));
+    emit(as, 0xb8 | (reg & 7));
+    emitQuad(as, imm);
+}
+
+static void load(Assembler *as, int dst, int base, int32_t disp) {
+    rex(as, dst, base);
+    emit(as, 0x8b);
+    memOperand(as, dst, base, disp);
+}
+
+static void store(Assembler *as, int base, int32_t disp, int src) {
+    rex(as, src, base);
+    emit(as, 0x89);
+    memOperand(as, src, base, disp);
+}
+
+// mov dst, [base + index * 8], base and index are one of the first 8 registers (and base isn't rbp).
+static void loadIndexed(Assembler *as, int dst, int base, int index) {
+    rex(as, dst, 0);
+    emit(as, 0x8b);
+    emit(as, 0x04 | ((dst & 7) << 3));
+    emit(as, 0xc0 | (index << 3) | base);
+}
+
+static void storeIndexed(Assembler *as, int base, int index, int src) {
+    rex(as, src, 0);
+    emit(as, 0x89);
+    emit(as, 0x04 | ((src & 7) << 3));
+    emit(as, 0xc0 | (index << 3) | base);
+}
+
+static void aluReg(Assembler *as, uint8_t op, int dst, int src) {
+    rex(as, src, dst);
+    emit(as, op);
+    emit(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void aluImm(Assembler *as, int ext, int reg, int32_t imm) {
+    rex(as, 0, reg);
+    emit(as, 0x81);
+    emit(as, 0xc0 | (ext << 3) | (reg & 7));
+    emitInt(as, imm);
+}
+
+static void movqToXmm(Assembler *as, int xmm, int reg) {
+    emit(as, 0x66);
+    rex(as, xmm, reg);
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    emit(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+static void movqFromXmm(Assembler *as, int reg, int xmm) {
+    emit(as, 0x66);
+    rex(as, xmm, reg);
+    emit(as, 0x0f);
+    emit(as, 0x7e);
+    emit(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+static void sse(Assembler *as, uint8_t prefix, uint8_t op, int dst, int src) {
+    emit(as, prefix);
+    if (dst >= 8 || src >= 8) {
+        emit(as, 0x40 | ((dst >> 3) << 2) | (src >> 3));
+    }
+    emit(as, 0x0f);
+    emit(as, op);
+    emit(as, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// Same with [base + disp32] as the second operand.
+static void sseMemory(Assembler *as, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp) {
+    emit(as, prefix);
+    if (xmm >= 8 || base >= 8) {
+        emit(as, 0x40 | ((xmm >> 3) << 2) | (base >> 3));
+    }
+    emit(as, 0x0f);
+    emit(as, op);
+    memOperand(as, xmm, base, disp);
+}
+
+// al = condition, then rax = FALSE_VAL + al which is TRUE_VAL when the condition holds.
+static void boolFromCondition(Assembler *as, int cc) {
+    emit(as, 0x0f);
+    emit(as, 0x90 | cc);
+    emit(as, 0xc0);
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    emit(as, 0xc0);
+    movImm(as, RCX, FALSE_VAL);
+    aluReg(as, ALU_ADD, RAX, RCX);
+}
+
+static void pushReg(Assembler *as, int reg) {
+    if (reg >= 8) emit(as, 0x41);
+    emit(as, 0x50 | (reg & 7));
+}
+
+static void popReg(Assembler *as, int reg) {
+    if (reg >= 8) emit(as, 0x41);
+    emit(as, 0x58 | (reg & 7));
+}
+
+static int jcc(Assembler *as, int cc) {
+    emit(as, 0x0f);
+    emit(as, 0x80 | cc);
+    emitInt(as, 0);
+    return as->count - 4;
+}
+
+static int jmp(Assembler *as) {
+    emit(as, 0xe9);
+    emitInt(as, 0);
+    return as->count - 4;
+}
+
+static void jumpTo(Assembler *as, int cc, int offset) {
+    int position = cc == -1 ? jmp(as) : jcc(as, cc);
+    addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, position, offset);
+}
+
+// Leaves compiled code when the condition holds, the interpreter then runs the instruction at offset.
+static void guard(Assembler *as, int cc, int offset) {
+    int position = jcc(as, cc);
+    addPatch(&as->exits, &as->exitCount, &as->exitCapacity, position, offset);
+}
+
+static void exitAt(Assembler *as, int offset) {
+    emit(as, 0x41);
+    emit(as, 0xc7);
+    memOperand(as, 0, STATE, offsetof(JitState, offset));
+    emitInt(as, offset);
+    int position = jmp(as);
+    patchInt(as, position, as->exitStub - (position + 4));
+}
+
+// Expects QNAN in rcx.
+static void guardNumber(Assembler *as, int reg, int offset) {
+    if (as->unchecked) {
+        return;
+    }
+    aluReg(as, ALU_MOV, R8, reg);
+    aluReg(as, ALU_AND, R8, RCX);
+    aluReg(as, ALU_CMP, R8, RCX);
+    guard(as, CC_E, offset);
+}
+
+static void guardStack(Assembler *as, int offset) {
+    aluReg(as, ALU_CMP, SP, STACK_LIMIT);
+    guard(as, CC_AE, offset);
+}
+
+static void pushStack(Assembler *as, int reg) {
+    store(as, SP, 0, reg);
+    aluImm(as, IMM_ADD, SP, sizeof(Value));
+}
+
+static void pushConstant(Assembler *as, Value value, int offset) {
+    guardStack(as, offset);
+    movImm(as, RAX, value);
+    pushStack(as, RAX);
+}
+
+// rax = a, rdx = b, both checked to be numbers.
+static void loadNumbers(Assembler *as, int offset) {
+    load(as, RAX, SP, -2 * (int) sizeof(Value));
+    load(as, RDX, SP, -(int) sizeof(Value));
+    movImm(as, RCX, QNAN);
+    guardNumber(as, RAX, offset);
+    guardNumber(as, RDX, offset);
+    movqToXmm(as, XMM0, RAX);
+    movqToXmm(as, XMM1, RDX);
+}
+
+static void arithmetic(Assembler *as, uint8_t op, int offset) {
+    loadNumbers(as, offset);
+    sse(as, 0xf2, op, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    store(as, SP, -2 * (int) sizeof(Value), RAX);
+    aluImm(as, IMM_SUB, SP, sizeof(Value));
+}
+
+// Only "above" conditions are used, they are false for NaN the same way C comparisons are.
+static void comparison(Assembler *as, bool swap, int cc, int offset) {
+    loadNumbers(as, offset);
+    sse(as, 0x66, 0x2e, swap ? XMM1 : XMM0, swap ? XMM0 : XMM1);
+    boolFromCondition(as, cc);
+    store(as, SP, -2 * (int) sizeof(Value), RAX);
+    aluImm(as, IMM_SUB, SP, sizeof(Value));
+}
+
+// Jumps to the given offset when rax holds nil or false.
+static void jumpIfFalsey(Assembler *as, int offset) {
+    movImm(as, RCX, NIL_VAL);
+    aluReg(as, ALU_CMP, RAX, RCX);
+    jumpTo(as, CC_E, offset);
+    movImm(as, RCX, FALSE_VAL);
+    aluReg(as, ALU_CMP, RAX, RCX);
+    jumpTo(as, CC_E, offset);
+}
+
+static void loadGlobals(Assembler *as, int reg) {
+    // The array can move when more globals get defined, so always go through buffer.
+    movImm(as, reg, (uint64_t) (uintptr_t) &buffer.globalVars.values);
+    load(as, reg, reg, 0);
+}
+
+// Exits unless rax holds an ObjArray, which is left in rax without its tag.
+static void guardArray(Assembler *as, int offset) {
+    movImm(as, RCX, SIGN_BIT | QNAN);
+    aluReg(as, ALU_MOV, R8, RAX);
+    aluReg(as, ALU_AND, R8, RCX);
+    aluReg(as, ALU_CMP, R8, RCX);
+    guard(as, CC_NE, offset);
+    movImm(as, RCX, ~(SIGN_BIT | QNAN));
+    aluReg(as, ALU_AND, RAX, RCX);
+
+    // cmp dword [rax + type], OBJ_ARRAY
+    emit(as, 0x81);
+    memOperand(as, 7, RAX, offsetof(Obj, type));
+    emitInt(as, OBJ_ARRAY);
+    guard(as, CC_NE, offset);
+}
+
+// Expects the ObjArray in rax and the index as a number in xmm0. Leaves the array's values in rax and
+// the integer index in rcx, exits unless the index is an integer inside of the array.
+static void arrayIndex(Assembler *as, int offset) {
+    // cvttsd2si rcx, xmm0 then back with cvtsi2sd xmm1, rcx, the index is integral if nothing got lost.
+    emit(as, 0xf2);
+    rex(as, RCX, XMM0);
+    emit(as, 0x0f);
+    emit(as, 0x2c);
+    emit(as, 0xc0 | (RCX << 3) | XMM0);
+    emit(as, 0xf2);
+    rex(as, XMM1, RCX);
+    emit(as, 0x0f);
+    emit(as, 0x2a);
+    emit(as, 0xc0 | (XMM1 << 3) | RCX);
+    sse(as, 0x66, 0x2e, XMM0, XMM1);
+    guard(as, CC_NE, offset);
+    guard(as, CC_P, offset);
+
+    aluImm(as, IMM_CMP, RCX, 0);
+    guard(as, CC_L, offset);
+    // movsxd r8, dword [rax + count]
+    rex(as, R8, RAX);
+    emit(as, 0x63);
+    memOperand(as, R8, RAX, offsetof(ObjArray, count));
+    aluReg(as, ALU_CMP, RCX, R8);
+    guard(as, CC_GE, offset);
+
+    load(as, RAX, RAX, offsetof(ObjArray, values));
+}
+
+// Leaves the array's values in rax and the integer index in rcx, exits unless
+// array is an ObjArray and index is an integer inside of it.
+static void arrayElement(Assembler *as, int arrayDistance, int offset) {
+    load(as, RAX, SP, -arrayDistance * (int) sizeof(Value));
+    load(as, RDX, SP, -(arrayDistance - 1) * (int) sizeof(Value));
+    guardArray(as, offset);
+    movImm(as, RCX, QNAN);
+    guardNumber(as, RDX, offset);
+    movqToXmm(as, XMM0, RDX);
+    arrayIndex(as, offset);
+}
+
+static void printHelper(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+static int readShort(Chunk *chunk, int offset) {
+    return chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+}
+
+// Loads the operand of a register instruction at position into reg.
+static void loadRegister(Assembler *as, int reg, Chunk *chunk, int position) {
+    int operand = chunk->code[position] | (chunk->code[position + 1] << 8);
+    if (operand & REGISTER_CONSTANT) {
+        movImm(as, reg, chunk->constants.values[operand & ~REGISTER_CONSTANT]);
+    } else {
+        load(as, reg, SLOTS, operand * (int) sizeof(Value));
+    }
+}
+
+// Anything but two numbers (string concatenation, type errors) exits to the interpreter.
+static void registerArithmetic(Assembler *as, Chunk *chunk, uint8_t op, int offset) {
+    loadRegister(as, RAX, chunk, offset + 3);
+    loadRegister(as, RDX, chunk, offset + 5);
+    movImm(as, RCX, QNAN);
+    guardNumber(as, RAX, offset);
+    guardNumber(as, RDX, offset);
+    movqToXmm(as, XMM0, RAX);
+    movqToXmm(as, XMM1, RDX);
+    sse(as, 0xf2, op, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    store(as, SLOTS, readShort(chunk, offset) * (int) sizeof(Value), RAX);
+}
+
+// Displacement of a captured value from the closure's upvalues, which it follows.
+static int32_t capturedValue(int upvalueCount, int index) {
+    return upvalueCount * (int) sizeof(ObjUpvalue *) + index * (int) sizeof(Value);
+}
+
+// Returns false for instructions that are always left to the interpreter.
+static bool compileInstruction(Assembler *as, ObjFunction *function, int offset) {
+    Chunk *chunk = &function->chunk;
+    const int size = sizeof(Value);
+
+    as->unchecked = chunk->code[offset] >= OP_ADD_UNCHECKED && chunk->code[offset] <= OP_DIVIDE_REGISTERS_UNCHECKED;
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT: {
+            int constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+            pushConstant(as, chunk->constants.values[constant], offset);
+            return true;
+        }
+        case OP_NIL:
+            pushConstant(as, NIL_VAL, offset);
+            return true;
+        case OP_TRUE:
+            pushConstant(as, TRUE_VAL, offset);
+            return true;
+        case OP_FALSE:
+            pushConstant(as, FALSE_VAL, offset);
+            return true;
+        case OP_DUPLICATE:
+            guardStack(as, offset);
+            load(as, RAX, SP, -size);
+            pushStack(as, RAX);
+            return true;
+        case OP_POP:
+            aluImm(as, IMM_SUB, SP, size);
+            return true;
+        case OP_POPN:
+            aluImm(as, IMM_SUB, SP, readShort(chunk, offset) * size);
+            return true;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+            guardStack(as, offset);
+            loadGlobals(as, RDX);
+            load(as, RAX, RDX, readShort(chunk, offset) * size);
+            movImm(as, RCX, UNDEFINED_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            guard(as, CC_E, offset);
+            pushStack(as, RAX);
+            return true;
+        case OP_SET_GLOBAL:
+            loadGlobals(as, RDX);
+            load(as, RAX, RDX, readShort(chunk, offset) * size);
+            movImm(as, RCX, UNDEFINED_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            guard(as, CC_E, offset);
+            load(as, RAX, SP, -size);
+            store(as, RDX, readShort(chunk, offset) * size, RAX);
+            return true;
+        case OP_GET_LOCAL:
+            guardStack(as, offset);
+            load(as, RAX, SLOTS, readShort(chunk, offset) * size);
+            pushStack(as, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            load(as, RAX, SP, -size);
+            store(as, SLOTS, readShort(chunk, offset) * size, RAX);
+            return true;
+        case OP_GET_UPVALUE:
+            guardStack(as, offset);
+            load(as, RAX, UPVALUES, readShort(chunk, offset) * (int) sizeof(ObjUpvalue *));
+            load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            load(as, RAX, RAX, 0);
+            pushStack(as, RAX);
+            return true;
+        case OP_SET_UPVALUE:
+            load(as, RAX, UPVALUES, readShort(chunk, offset) * (int) sizeof(ObjUpvalue *));
+            load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            load(as, RDX, SP, -size);
+            store(as, RAX, 0, RDX);
+            return true;
+        case OP_GET_ENCLOSING:
+            guardStack(as, offset);
+            load(as, RAX, STATE, offsetof(JitState, enclosing));
+            load(as, RAX, RAX, readShort(chunk, offset) * size);
+            pushStack(as, RAX);
+            return true;
+        case OP_SET_ENCLOSING:
+            load(as, RAX, STATE, offsetof(JitState, enclosing));
+            load(as, RDX, SP, -size);
+            store(as, RAX, readShort(chunk, offset) * size, RDX);
+            return true;
+        case OP_GET_CAPTURED:
+            guardStack(as, offset);
+            load(as, RAX, UPVALUES, capturedValue(function->upvalueCount, readShort(chunk, offset)));
+            pushStack(as, RAX);
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            load(as, RAX, SP, -2 * size);
+            load(as, RDX, SP, -size);
+            aluReg(as, ALU_CMP, RAX, RDX);
+            boolFromCondition(as, chunk->code[offset] == OP_EQUAL ? CC_E : CC_NE);
+            store(as, SP, -2 * size, RAX);
+            aluImm(as, IMM_SUB, SP, size);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_UNCHECKED:
+        case OP_GREATER_NUM:
+            comparison(as, false, CC_A, offset);
+            return true;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_UNCHECKED:
+        case OP_GREATER_EQUAL_NUM:
+            comparison(as, true, CC_BE, offset);
+            return true;
+        case OP_LESS:
+        case OP_LESS_UNCHECKED:
+        case OP_LESS_NUM:
+            comparison(as, true, CC_A, offset);
+            return true;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_UNCHECKED:
+        case OP_LESS_EQUAL_NUM:
+            comparison(as, false, CC_BE, offset);
+            return true;
+        case OP_ADD:
+        case OP_ADD_UNCHECKED:
+        case OP_ADD_NUM:
+            arithmetic(as, SSE_ADD, offset);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_SUBTRACT_NUM:
+            arithmetic(as, SSE_SUB, offset);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_MULTIPLY_NUM:
+            arithmetic(as, SSE_MUL, offset);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_DIVIDE_NUM:
+            arithmetic(as, SSE_DIV, offset);
+            return true;
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_UNCHECKED:
+            guardStack(as, offset);
+            load(as, RAX, SLOTS, readShort(chunk, offset) * size);
+            load(as, RDX, SLOTS, (chunk->code[offset + 3] | (chunk->code[offset + 4] << 8)) * size);
+            movImm(as, RCX, QNAN);
+            guardNumber(as, RAX, offset);
+            guardNumber(as, RDX, offset);
+            movqToXmm(as, XMM0, RAX);
+            movqToXmm(as, XMM1, RDX);
+            sse(as, 0xf2, SSE_ADD, XMM0, XMM1);
+            movqFromXmm(as, RAX, XMM0);
+            pushStack(as, RAX);
+            return true;
+        case OP_NOT:
+            load(as, RAX, SP, -size);
+            movImm(as, RCX, NIL_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            emit(as, 0x0f); // sete dl
+            emit(as, 0x94);
+            emit(as, 0xc2);
+            movImm(as, RCX, FALSE_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            emit(as, 0x0f); // sete al
+            emit(as, 0x94);
+            emit(as, 0xc0);
+            emit(as, 0x08); // or al, dl
+            emit(as, 0xd0);
+            emit(as, 0x0f); // movzx eax, al
+            emit(as, 0xb6);
+            emit(as, 0xc0);
+            aluReg(as, ALU_ADD, RAX, RCX);
+            store(as, SP, -size, RAX);
+            return true;
+        case OP_NEGATE:
+            load(as, RAX, SP, -size);
+            movImm(as, RCX, QNAN);
+            guardNumber(as, RAX, offset);
+            movImm(as, RCX, SIGN_BIT);
+            aluReg(as, ALU_XOR, RAX, RCX);
+            store(as, SP, -size, RAX);
+            return true;
+        case OP_PRINT:
+            load(as, RDI, SP, -size);
+            aluImm(as, IMM_SUB, SP, size);
+            movImm(as, RAX, (uint64_t) (uintptr_t) printHelper);
+            emit(as, 0xff); // call rax
+            emit(as, 0xd0);
+            return true;
+        case OP_JUMP:
+            jumpTo(as, -1, offset + 3 + readShort(chunk, offset));
+            return true;
+        case OP_JUMP_IF_FALSE:
+            load(as, RAX, SP, -size);
+            jumpIfFalsey(as, offset + 3 + readShort(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            loadNumbers(as, offset);
+            aluImm(as, IMM_SUB, SP, 2 * size);
+            sse(as, 0x66, 0x2e, XMM1, XMM0);
+            jumpTo(as, CC_BE, offset + 3 + readShort(chunk, offset));
+            return true;
+        case OP_LOOP: {
+            // Counts down towards tracing the loop, the interpreter takes the back-edge once it gets there.
+            int header = offset + 3 - readShort(chunk, offset);
+            movImm(as, RAX, (uint64_t) (uintptr_t) &traceLoopAt(function, header)->countdown);
+            emit(as, 0x83); // sub dword [rax], 1
+            memOperand(as, 5, RAX, 0);
+            emit(as, 1);
+            guard(as, CC_LE, offset);
+            jumpTo(as, -1, header);
+            return true;
+        }
+        case OP_ARRAY_GET:
+        case OP_ARRAY_GET_UNCHECKED:
+        case OP_ARRAY_GET_NUM:
+            arrayElement(as, 2, offset);
+            loadIndexed(as, RAX, RAX, RCX);
+            store(as, SP, -2 * size, RAX);
+            aluImm(as, IMM_SUB, SP, size);
+            return true;
+        case OP_ARRAY_SET:
+        case OP_ARRAY_SET_UNCHECKED:
+        case OP_ARRAY_SET_NUM:
+            arrayElement(as, 3, offset);
+            load(as, RDX, SP, -size);
+            storeIndexed(as, RAX, RCX, RDX);
+            store(as, SP, -3 * size, RDX);
+            aluImm(as, IMM_SUB, SP, 2 * size);
+            return true;
+        case OP_MOVE:
+            loadRegister(as, RAX, chunk, offset + 3);
+            store(as, SLOTS, readShort(chunk, offset) * size, RAX);
+            return true;
+        case OP_ADD_REGISTERS:
+        case OP_ADD_REGISTERS_UNCHECKED:
+            registerArithmetic(as, chunk, SSE_ADD, offset);
+            return true;
+        case OP_SUBTRACT_REGISTERS:
+        case OP_SUBTRACT_REGISTERS_UNCHECKED:
+            registerArithmetic(as, chunk, SSE_SUB, offset);
+            return true;
+        case OP_MULTIPLY_REGISTERS:
+        case OP_MULTIPLY_REGISTERS_UNCHECKED:
+            registerArithmetic(as, chunk, SSE_MUL, offset);
+            return true;
+        case OP_DIVIDE_REGISTERS:
+        case OP_DIVIDE_REGISTERS_UNCHECKED:
+            registerArithmetic(as, chunk, SSE_DIV, offset);
+            return true;
+        default:
+            exitAt(as, offset);
+            return false;
+    }
+}
+
+static void freeAssembler(Assembler *as) {
+    free(as->code);
+    free(as->labels);
+    free(as->jumps);
+    free(as->exits);
+}
+
+// Copies the code into executable memory, NULL when the memory can't be had.
+static uint8_t *install(Assembler *as) {
+    uint8_t *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, as->code, as->count);
+    if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as->count);
+        return NULL;
+    }
+    return code;
+}
+
+bool jitCompile(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    Assembler as = {0};
+    as.labels = malloc(sizeof(int) * chunk->count);
+    as.entries = malloc(sizeof(int) * chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+        as.entries[i] = -1;
+    }
+
+    // Entry: void (JitState *state, void *target)
+    pushReg(&as, RBX);
+    pushReg(&as, R12);
+    pushReg(&as, R13);
+    pushReg(&as, R14);
+    pushReg(&as, R15);
+    aluReg(&as, ALU_MOV, STATE, RDI);
+    load(&as, SP, STATE, offsetof(JitState, sp));
+    load(&as, SLOTS, STATE, offsetof(JitState, slots));
+    load(&as, UPVALUES, STATE, offsetof(JitState, upvalues));
+    load(&as, STACK_LIMIT, STATE, offsetof(JitState, stackLimit));
+    emit(&as, 0xff); // jmp rsi
+    emit(&as, 0xe6);
+
+    as.exitStub = as.count;
+    store(&as, STATE, offsetof(JitState, sp), SP);
+    popReg(&as, R15);
+    popReg(&as, R14);
+    popReg(&as, R13);
+    popReg(&as, R12);
+    popReg(&as, RBX);
+    emit(&as, 0xc3);
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        as.labels[offset] = as.count;
+        if (compileInstruction(&as, function, offset)) {
+            as.entries[offset] = as.labels[offset];
+        }
+    }
+
+    for (int i = 0; i < as.jumpCount; i++) {
+        Patch *jump = &as.jumps[i];
+        patchInt(&as, jump->position, as.labels[jump->offset] - (jump->position + 4));
+    }
+
+    for (int i = 0; i < as.exitCount; i++) {
+        Patch *exit = &as.exits[i];
+        patchInt(&as, exit->position, as.count - (exit->position + 4));
+        exitAt(&as, exit->offset);
+    }
+
+    uint8_t *code = install(&as);
+    if (code == NULL) {
+        freeAssembler(&as);
+        free(as.entries);
+        return false;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+    jit->code = code;
+    jit->size = as.count;
+    jit->entries = as.entries;
+    jit->entryCount = chunk->count;
+    function->jit = jit;
+
+    freeAssembler(&as);
+    return true;
+}
+
+void jitFree(ObjFunction *function) {
+    JitCode *jit = function->jit;
+    if (jit == NULL) {
+        return;
+    }
+
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+    function->jit = NULL;
+}
+
+bool jitRun(ObjFunction *function, JitState *state, int offset) {
+    JitCode *jit = function->jit;
+    if (jit->entries[offset] == -1) {
+        return false;
+    }
+
+    void (*entry)(JitState *, void *) = (void (*)(JitState *, void *)) jit->code;
+    entry(state, jit->code + jit->entries[offset]);
+    return true;
+}
+
+// Traces. A recorded loop iteration is a straight line of instructions whose types are all known, so
+// the operand stack goes away: every stack slot, global and upvalue the trace touches becomes a home
+// with a fixed place, ideally one of the xmm registers, and instructions turn into moves and arithmetic
+// between homes. Values read before the trace writes them get their types checked once before the loop
+// starts, everything computed inside of it has a type known up front, so the loop itself only keeps
+// the guards for the path (branches, array bounds and the elements read out of arrays).
+
+// Traces don't check the stack on the way, so the stack limit register holds the globals instead.
+#define GLOBALS R14
+
+#define FIRST_HOME_REGISTER 2
+#define HOME_REGISTERS 14
+
+// Jumps of the entry guards use this instead of a snapshot.
+#define ENTRY_MISS (-1)
+
+typedef enum {
+    HOME_STACK,
+    HOME_GLOBAL,
+    HOME_UPVALUE,
+    HOME_ENCLOSING,
+    HOME_CAPTURED,
+} HomeKind;
+
+typedef struct {
+    HomeKind kind;
+    int index;
+    // xmm register the value lives in for the whole trace, -1 when it stays in memory.
+    int reg;
+    int uses;
+    // Type checked on entry, -1 unless the value is read before the trace writes it.
+    int entryType;
+    bool dirty;
+
+    // Where the walk through the trace is at.
+    bool set;
+    int type;
+} Home;
+
+// Interpreter state at a side exit: the instruction it resumes at and how many stack slots are live.
+// A fused comparison leaves its result as a constant, the opposite of what got recorded.
+typedef struct {
+    int offset;
+    int height;
+    int constantAt;
+    Value constant;
+} Snapshot;
+
+typedef struct {
+    Assembler as;
+    Chunk *chunk;
+    int upvalueCount;
+    TraceStep *steps;
+    int count;
+    int entryHeight;
+    int height;
+    int maxHeight;
+
+    Home *homes;
+    int homeCount;
+    int homeCapacity;
+
+    Snapshot *snapshots;
+    int snapshotCount;
+    int snapshotCapacity;
+    int stepSnapshot;
+
+    bool failed;
+} TraceCompiler;
+
+static Home *findHome(TraceCompiler *tc, HomeKind kind, int index) {
+    for (int i = 0; i < tc->homeCount; i++) {
+        if (tc->homes[i].kind == kind && tc->homes[i].index == index) {
+            return &tc->homes[i];
+        }
+    }
+
+    if (tc->homeCapacity < tc->homeCount + 1) {
+        tc->homeCapacity = tc->homeCapacity < 16 ? 16 : tc->homeCapacity * 2;
+        tc->homes = realloc(tc->homes, sizeof(Home) * tc->homeCapacity);
+    }
+    Home *home = &tc->homes[tc->homeCount++];
+    home->kind = kind;
+    home->index = index;
+    home->reg = -1;
+    home->uses = 0;
+    home->entryType = -1;
+    home->dirty = false;
+    home->set = false;
+    home->type = -1;
+    return home;
+}
+
+static Home *stackHome(TraceCompiler *tc, int position) {
+    if (position >= tc->maxHeight) {
+        tc->maxHeight = position + 1;
+    }
+    return findHome(tc, HOME_STACK, position);
+}
+
+// Returns the static type of the home's value, observed is what the recording saw for it.
+static int readHome(TraceCompiler *tc, Home *home, int observed) {
+    home->uses++;
+    if (home->set) {
+        return home->type;
+    }
+    if (home->entryType == -1) {
+        if (observed == -1 || (home->kind == HOME_STACK && home->index >= tc->entryHeight)) {
+            tc->failed = true;
+            return TYPE_OBJECT;
+        }
+        home->entryType = observed;
+    }
+    return home->entryType;
+}
+
+static void writeHome(Home *home, int type) {
+    home->uses++;
+    home->dirty = true;
+    home->set = true;
+    home->type = type;
+}
+
+static int snapshot(TraceCompiler *tc, int offset, int height, int constantAt, Value constant) {
+    if (tc->snapshotCapacity < tc->snapshotCount + 1) {
+        tc->snapshotCapacity = tc->snapshotCapacity < 16 ? 16 : tc->snapshotCapacity * 2;
+        tc->snapshots = realloc(tc->snapshots, sizeof(Snapshot) * tc->snapshotCapacity);
+    }
+    Snapshot *snapshot = &tc->snapshots[tc->snapshotCount];
+    snapshot->offset = offset;
+    snapshot->height = height;
+    snapshot->constantAt = constantAt;
+    snapshot->constant = constant;
+    return tc->snapshotCount++;
+}
+
+// Guards of an instruction exit to the state right before it.
+static int stepSnapshot(TraceCompiler *tc, int offset) {
+    if (tc->stepSnapshot == -1) {
+        tc->stepSnapshot = snapshot(tc, offset, tc->height, -1, NIL_VAL);
+    }
+    return tc->stepSnapshot;
+}
+
+// Points base and disp at the home's memory, loading the location of upvalues and the enclosing frame's
+// slots into r9.
+static void homeMemory(TraceCompiler *tc, Home *home, int *base, int32_t *disp) {
+    switch (home->kind) {
+        case HOME_STACK:
+            *base = SLOTS;
+            *disp = home->index * (int) sizeof(Value);
+            return;
+        case HOME_GLOBAL:
+            *base = GLOBALS;
+            *disp = home->index * (int) sizeof(Value);
+            return;
+        case HOME_UPVALUE:
+            load(&tc->as, R9, UPVALUES, home->index * (int) sizeof(ObjUpvalue *));
+            load(&tc->as, R9, R9, offsetof(ObjUpvalue, location));
+            *base = R9;
+            *disp = 0;
+            return;
+        case HOME_ENCLOSING:
+            load(&tc->as, R9, STATE, offsetof(JitState, enclosing));
+            *base = R9;
+            *disp = home->index * (int) sizeof(Value);
+            return;
+        case HOME_CAPTURED:
+            *base = UPVALUES;
+            *disp = capturedValue(tc->upvalueCount, home->index);
+            return;
+    }
+}
+
+static void homeToGpr(TraceCompiler *tc, int reg, Home *home) {
+    if (home->reg != -1) {
+        movqFromXmm(&tc->as, reg, home->reg);
+        return;
+    }
+    int base;
+    int32_t disp;
+    homeMemory(tc, home, &base, &disp);
+    load(&tc->as, reg, base, disp);
+}
+
+static void gprToHome(TraceCompiler *tc, Home *home, int reg) {
+    if (home->reg != -1) {
+        movqToXmm(&tc->as, home->reg, reg);
+        return;
+    }
+    int base;
+    int32_t disp;
+    homeMemory(tc, home, &base, &disp);
+    store(&tc->as, base, disp, reg);
+}
+
+static void homeToXmm(TraceCompiler *tc, int xmm, Home *home) {
+    if (home->reg != -1) {
+        if (home->reg != xmm) {
+            sse(&tc->as, 0x66, 0x28, xmm, home->reg); // movapd
+        }
+        return;
+    }
+    int base;
+    int32_t disp;
+    homeMemory(tc, home, &base, &disp);
+    sseMemory(&tc->as, 0xf3, 0x7e, xmm, base, disp); // movq xmm, [mem]
+}
+
+static void xmmToHome(TraceCompiler *tc, Home *home, int xmm) {
+    if (home->reg != -1) {
+        if (home->reg != xmm) {
+            sse(&tc->as, 0x66, 0x28, home->reg, xmm);
+        }
+        return;
+    }
+    int base;
+    int32_t disp;
+    homeMemory(tc, home, &base, &disp);
+    sseMemory(&tc->as, 0x66, 0xd6, xmm, base, disp); // movq [mem], xmm
+}
+
+static void moveHome(TraceCompiler *tc, Home *dst, Home *src) {
+    if (dst == src) {
+        return;
+    }
+    if (src->reg != -1) {
+        xmmToHome(tc, dst, src->reg);
+    } else if (dst->reg != -1) {
+        homeToXmm(tc, dst->reg, src);
+    } else {
+        homeToGpr(tc, RAX, src);
+        gprToHome(tc, dst, RAX);
+    }
+}
+
+// op xmm, home
+static void sseHome(TraceCompiler *tc, uint8_t prefix, uint8_t op, int xmm, Home *home) {
+    if (home->reg != -1) {
+        sse(&tc->as, prefix, op, xmm, home->reg);
+        return;
+    }
+    int base;
+    int32_t disp;
+    homeMemory(tc, home, &base, &disp);
+    sseMemory(&tc->as, prefix, op, xmm, base, disp);
+}
+
+// Exits unless the value in rax has the given type, clobbers rcx and r8.
+static void guardType(Assembler *as, int type, int exit) {
+    switch (type) {
+        case TYPE_NUMBER:
+            movImm(as, RCX, QNAN);
+            guardNumber(as, RAX, exit);
+            return;
+        case TYPE_BOOL:
+            movImm(as, RCX, TRUE_VAL);
+            aluReg(as, ALU_MOV, R8, RAX);
+            aluImm(as, IMM_OR, R8, 1);
+            aluReg(as, ALU_CMP, R8, RCX);
+            guard(as, CC_NE, exit);
+            return;
+        case TYPE_NIL:
+            movImm(as, RCX, NIL_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            guard(as, CC_NE, exit);
+            return;
+        case TYPE_ARRAY:
+            // guardArray untags rax, keep the value itself.
+            aluReg(as, ALU_MOV, RDX, RAX);
+            guardArray(as, exit);
+            aluReg(as, ALU_MOV, RAX, RDX);
+            return;
+        default:
+            movImm(as, RCX, SIGN_BIT | QNAN);
+            aluReg(as, ALU_MOV, R8, RAX);
+            aluReg(as, ALU_AND, R8, RCX);
+            aluReg(as, ALU_CMP, R8, RCX);
+            guard(as, CC_NE, exit);
+            return;
+    }
+}
+
+static void pushValue(TraceCompiler *tc, Value value) {
+    Home *home = stackHome(tc, tc->height++);
+    movImm(&tc->as, RAX, value);
+    gprToHome(tc, home, RAX);
+    writeHome(home, traceType(value));
+}
+
+static void pushHome(TraceCompiler *tc, Home *src, int observed) {
+    int type = readHome(tc, src, observed);
+    Home *dst = stackHome(tc, tc->height++);
+    moveHome(tc, dst, src);
+    writeHome(dst, type);
+}
+
+static void storeHome(TraceCompiler *tc, Home *dst) {
+    Home *src = stackHome(tc, tc->height - 1);
+    int type = readHome(tc, src, -1);
+    moveHome(tc, dst, src);
+    writeHome(dst, type);
+}
+
+static bool numbers(TraceCompiler *tc, Home *a, Home *b) {
+    return readHome(tc, a, -1) == TYPE_NUMBER && readHome(tc, b, -1) == TYPE_NUMBER;
+}
+
+static void traceArithmetic(TraceCompiler *tc, uint8_t op) {
+    Home *a = stackHome(tc, tc->height - 2);
+    Home *b = stackHome(tc, tc->height - 1);
+    if (!numbers(tc, a, b)) {
+        tc->failed = true;
+        return;
+    }
+    homeToXmm(tc, XMM0, a);
+    sseHome(tc, 0xf2, op, XMM0, b);
+    xmmToHome(tc, a, XMM0);
+    writeHome(a, TYPE_NUMBER);
+    tc->height--;
+}
+
+static int negate(int cc) {
+    return cc ^ 1;
+}
+
+// a > b and a >= b are compared as is, a < b and a <= b swapped, see comparison().
+static void traceComparison(TraceCompiler *tc, bool swap, int cc, int step) {
+    Home *a = stackHome(tc, tc->height - 2);
+    Home *b = stackHome(tc, tc->height - 1);
+    if (!numbers(tc, a, b)) {
+        tc->failed = true;
+        return;
+    }
+    homeToXmm(tc, XMM0, swap ? b : a);
+    sseHome(tc, 0x66, 0x2e, XMM0, swap ? a : b);
+    tc->height--;
+    writeHome(a, TYPE_BOOL);
+
+    // Followed by a conditional jump the comparison becomes a guard on its flags and the bool only
+    // exists in case the interpreter needs it: as the opposite of the recording when the guard fails,
+    // as the recorded result when the jump doesn't pop it right away.
+    TraceStep *next = step + 1 < tc->count ? &tc->steps[step + 1] : NULL;
+    if (next != NULL && tc->chunk->code[next->offset] == OP_JUMP_IF_FALSE) {
+        bool taken = next->type;
+        int exit = snapshot(tc, next->offset, tc->height, tc->height - 1, BOOL_VAL(taken));
+        guard(&tc->as, taken ? cc : negate(cc), exit);
+        tc->steps[step + 1].type |= 2;
+        if (step + 2 >= tc->count || tc->chunk->code[tc->steps[step + 2].offset] != OP_POP) {
+            movImm(&tc->as, RAX, BOOL_VAL(!taken));
+            gprToHome(tc, a, RAX);
+        }
+        return;
+    }
+
+    boolFromCondition(&tc->as, cc);
+    gprToHome(tc, a, RAX);
+}
+
+// Loads a register operand the recording saw as a number into xmm, false when it can't be one.
+static bool registerNumber(TraceCompiler *tc, int xmm, int position) {
+    int operand = tc->chunk->code[position] | (tc->chunk->code[position + 1] << 8);
+    if (operand & REGISTER_CONSTANT) {
+        Value value = tc->chunk->constants.values[operand & ~REGISTER_CONSTANT];
+        if (!IS_NUMBER(value)) {
+            return false;
+        }
+        movImm(&tc->as, RAX, value);
+        movqToXmm(&tc->as, xmm, RAX);
+        return true;
+    }
+    Home *home = stackHome(tc, operand);
+    if (readHome(tc, home, TYPE_NUMBER) != TYPE_NUMBER) {
+        return false;
+    }
+    homeToXmm(tc, xmm, home);
+    return true;
+}
+
+static void traceRegisterArithmetic(TraceCompiler *tc, uint8_t op, int offset) {
+    if (!registerNumber(tc, XMM0, offset + 3) || !registerNumber(tc, XMM1, offset + 5)) {
+        tc->failed = true;
+        return;
+    }
+    sse(&tc->as, 0xf2, op, XMM0, XMM1);
+    Home *destination = stackHome(tc, readShort(tc->chunk, offset));
+    xmmToHome(tc, destination, XMM0);
+    writeHome(destination, TYPE_NUMBER);
+}
+
+static void traceArray(TraceCompiler *tc, Home *array, Home *index, int exit) {
+    if (readHome(tc, array, -1) != TYPE_ARRAY || readHome(tc, index, -1) != TYPE_NUMBER) {
+        tc->failed = true;
+        return;
+    }
+    homeToXmm(tc, XMM0, index);
+    homeToGpr(tc, RAX, array);
+    movImm(&tc->as, RCX, ~(SIGN_BIT | QNAN));
+    aluReg(&tc->as, ALU_AND, RAX, RCX);
+    arrayIndex(&tc->as, exit);
+}
+
+static void traceStep(TraceCompiler *tc, int step) {
+    Assembler *as = &tc->as;
+    Chunk *chunk = tc->chunk;
+    int offset = tc->steps[step].offset;
+    int type = tc->steps[step].type;
+    tc->stepSnapshot = -1;
+
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT: {
+            int constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+            pushValue(tc, chunk->constants.values[constant]);
+            return;
+        }
+        case OP_NIL:
+            pushValue(tc, NIL_VAL);
+            return;
+        case OP_TRUE:
+            pushValue(tc, TRUE_VAL);
+            return;
+        case OP_FALSE:
+            pushValue(tc, FALSE_VAL);
+            return;
+        case OP_DUPLICATE:
+            pushHome(tc, stackHome(tc, tc->height - 1), -1);
+            return;
+        case OP_POP:
+            tc->height--;
+            return;
+        case OP_POPN:
+            tc->height -= readShort(chunk, offset);
+            return;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+            pushHome(tc, findHome(tc, HOME_GLOBAL, readShort(chunk, offset)), type);
+            return;
+        case OP_SET_GLOBAL:
+            storeHome(tc, findHome(tc, HOME_GLOBAL, readShort(chunk, offset)));
+            return;
+        case OP_GET_LOCAL:
+            pushHome(tc, stackHome(tc, readShort(chunk, offset)), type);
+            return;
+        case OP_SET_LOCAL:
+            storeHome(tc, stackHome(tc, readShort(chunk, offset)));
+            return;
+        case OP_GET_UPVALUE:
+            pushHome(tc, findHome(tc, HOME_UPVALUE, readShort(chunk, offset)), type);
+            return;
+        case OP_SET_UPVALUE:
+            storeHome(tc, findHome(tc, HOME_UPVALUE, readShort(chunk, offset)));
+            return;
+        case OP_GET_ENCLOSING:
+            pushHome(tc, findHome(tc, HOME_ENCLOSING, readShort(chunk, offset)), type);
+            return;
+        case OP_SET_ENCLOSING:
+            storeHome(tc, findHome(tc, HOME_ENCLOSING, readShort(chunk, offset)));
+            return;
+        case OP_GET_CAPTURED:
+            pushHome(tc, findHome(tc, HOME_CAPTURED, readShort(chunk, offset)), type);
+            return;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL: {
+            Home *a = stackHome(tc, tc->height - 2);
+            Home *b = stackHome(tc, tc->height - 1);
+            readHome(tc, a, -1);
+            readHome(tc, b, -1);
+            homeToGpr(tc, RAX, a);
+            homeToGpr(tc, RDX, b);
+            aluReg(as, ALU_CMP, RAX, RDX);
+            boolFromCondition(as, chunk->code[offset] == OP_EQUAL ? CC_E : CC_NE);
+            gprToHome(tc, a, RAX);
+            writeHome(a, TYPE_BOOL);
+            tc->height--;
+            return;
+        }
+        case OP_GREATER:
+        case OP_GREATER_UNCHECKED:
+        case OP_GREATER_NUM:
+            traceComparison(tc, false, CC_A, step);
+            return;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_UNCHECKED:
+        case OP_GREATER_EQUAL_NUM:
+            traceComparison(tc, true, CC_BE, step);
+            return;
+        case OP_LESS:
+        case OP_LESS_UNCHECKED:
+        case OP_LESS_NUM:
+            traceComparison(tc, true, CC_A, step);
+            return;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_UNCHECKED:
+        case OP_LESS_EQUAL_NUM:
+            traceComparison(tc, false, CC_BE, step);
+            return;
+        case OP_ADD:
+        case OP_ADD_UNCHECKED:
+        case OP_ADD_NUM:
+            traceArithmetic(tc, SSE_ADD);
+            return;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_SUBTRACT_NUM:
+            traceArithmetic(tc, SSE_SUB);
+            return;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_MULTIPLY_NUM:
+            traceArithmetic(tc, SSE_MUL);
+            return;
+        case OP_DIVIDE:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_DIVIDE_NUM:
+            traceArithmetic(tc, SSE_DIV);
+            return;
+        case OP_ADD_LOCALS_UNCHECKED:
+        case OP_ADD_LOCALS: {
+            Home *a = stackHome(tc, readShort(chunk, offset));
+            Home *b = stackHome(tc, chunk->code[offset + 3] | (chunk->code[offset + 4] << 8));
+            if (readHome(tc, a, TYPE_NUMBER) != TYPE_NUMBER || readHome(tc, b, TYPE_NUMBER) != TYPE_NUMBER) {
+                tc->failed = true;
+                return;
+            }
+            Home *result = stackHome(tc, tc->height++);
+            homeToXmm(tc, XMM0, a);
+            sseHome(tc, 0xf2, SSE_ADD, XMM0, b);
+            xmmToHome(tc, result, XMM0);
+            writeHome(result, TYPE_NUMBER);
+            return;
+        }
+        case OP_NOT: {
+            Home *home = stackHome(tc, tc->height - 1);
+            int operand = readHome(tc, home, -1);
+            if (operand == TYPE_BOOL) {
+                homeToGpr(tc, RAX, home);
+                aluImm(as, IMM_XOR, RAX, 1);
+            } else {
+                movImm(as, RAX, BOOL_VAL(operand == TYPE_NIL));
+            }
+            gprToHome(tc, home, RAX);
+            writeHome(home, TYPE_BOOL);
+            return;
+        }
+        case OP_NEGATE: {
+            Home *home = stackHome(tc, tc->height - 1);
+            if (readHome(tc, home, -1) != TYPE_NUMBER) {
+                tc->failed = true;
+                return;
+            }
+            homeToGpr(tc, RAX, home);
+            movImm(as, RCX, SIGN_BIT);
+            aluReg(as, ALU_XOR, RAX, RCX);
+            gprToHome(tc, home, RAX);
+            writeHome(home, TYPE_NUMBER);
+            return;
+        }
+        case OP_JUMP:
+        case OP_LOOP:
+            return;
+        case OP_JUMP_IF_FALSE: {
+            // Bit 1 marks a jump already guarded by the comparison in front of it.
+            if (type & 2) {
+                return;
+            }
+            Home *home = stackHome(tc, tc->height - 1);
+            int operand = readHome(tc, home, -1);
+            if (operand == TYPE_BOOL) {
+                homeToGpr(tc, RAX, home);
+                movImm(as, RCX, FALSE_VAL);
+                aluReg(as, ALU_CMP, RAX, RCX);
+                guard(as, type ? CC_NE : CC_E, stepSnapshot(tc, offset));
+            }
+            // Anything else is always (nil) or never falsey, the recording took the only way there is.
+            return;
+        }
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_LESS: {
+            Home *a = stackHome(tc, tc->height - 2);
+            Home *b = stackHome(tc, tc->height - 1);
+            if (!numbers(tc, a, b)) {
+                tc->failed = true;
+                return;
+            }
+            homeToXmm(tc, XMM0, b);
+            sseHome(tc, 0x66, 0x2e, XMM0, a);
+            guard(as, type ? CC_A : CC_BE, stepSnapshot(tc, offset));
+            tc->height -= 2;
+            return;
+        }
+        case OP_ARRAY_GET:
+        case OP_ARRAY_GET_UNCHECKED:
+        case OP_ARRAY_GET_NUM: {
+            Home *array = stackHome(tc, tc->height - 2);
+            int exit = stepSnapshot(tc, offset);
+            traceArray(tc, array, stackHome(tc, tc->height - 1), exit);
+            loadIndexed(as, RAX, RAX, RCX);
+            guardType(as, type, exit);
+            gprToHome(tc, array, RAX);
+            writeHome(array, type);
+            tc->height--;
+            return;
+        }
+        case OP_ARRAY_SET:
+        case OP_ARRAY_SET_UNCHECKED:
+        case OP_ARRAY_SET_NUM: {
+            Home *array = stackHome(tc, tc->height - 3);
+            Home *value = stackHome(tc, tc->height - 1);
+            traceArray(tc, array, stackHome(tc, tc->height - 2), stepSnapshot(tc, offset));
+            int valueType = readHome(tc, value, -1);
+            homeToGpr(tc, RDX, value);
+            storeIndexed(as, RAX, RCX, RDX);
+            gprToHome(tc, array, RDX);
+            writeHome(array, valueType);
+            tc->height -= 2;
+            return;
+        }
+        case OP_MOVE: {
+            Home *destination = stackHome(tc, readShort(chunk, offset));
+            int operand = chunk->code[offset + 3] | (chunk->code[offset + 4] << 8);
+            if (operand & REGISTER_CONSTANT) {
+                Value value = chunk->constants.values[operand & ~REGISTER_CONSTANT];
+                movImm(as, RAX, value);
+                gprToHome(tc, destination, RAX);
+                writeHome(destination, traceType(value));
+                return;
+            }
+            Home *source = stackHome(tc, operand);
+            int sourceType = readHome(tc, source, type);
+            moveHome(tc, destination, source);
+            writeHome(destination, sourceType);
+            return;
+        }
+        case OP_ADD_REGISTERS:
+        case OP_ADD_REGISTERS_UNCHECKED:
+            traceRegisterArithmetic(tc, SSE_ADD, offset);
+            return;
+        case OP_SUBTRACT_REGISTERS:
+        case OP_SUBTRACT_REGISTERS_UNCHECKED:
+            traceRegisterArithmetic(tc, SSE_SUB, offset);
+            return;
+        case OP_MULTIPLY_REGISTERS:
+        case OP_MULTIPLY_REGISTERS_UNCHECKED:
+            traceRegisterArithmetic(tc, SSE_MUL, offset);
+            return;
+        case OP_DIVIDE_REGISTERS:
+        case OP_DIVIDE_REGISTERS_UNCHECKED:
+            traceRegisterArithmetic(tc, SSE_DIV, offset);
+            return;
+        default:
+            tc->failed = true;
+            return;
+    }
+}
+
+// Walks the trace emitting the loop body. Fails for types that change from one iteration to the next.
+static void traceBody(TraceCompiler *tc) {
+    tc->height = tc->entryHeight;
+    for (int i = 0; i < tc->homeCount; i++) {
+        tc->homes[i].set = false;
+    }
+
+    int loop = tc->as.count;
+    for (int i = 0; i < tc->count - 1 && !tc->failed; i++) {
+        traceStep(tc, i);
+    }
+    jmp(&tc->as);
+    patchInt(&tc->as, tc->as.count - 4, loop - tc->as.count);
+
+    if (tc->height != tc->entryHeight) {
+        tc->failed = true;
+    }
+    for (int i = 0; i < tc->homeCount; i++) {
+        Home *home = &tc->homes[i];
+        if (home->entryType != -1 && home->set && home->type != home->entryType) {
+            tc->failed = true;
+        }
+    }
+}
+
+// Loads every home the trace reads or writes in a register, checking types (and that globals are
+// defined) on the way. Jumps to the entry miss when the types don't match the recording.
+static void traceEntry(TraceCompiler *tc) {
+    Assembler *as = &tc->as;
+    load(as, SLOTS, STATE, offsetof(JitState, slots));
+    load(as, UPVALUES, STATE, offsetof(JitState, upvalues));
+    loadGlobals(as, GLOBALS);
+
+    // The trace keeps temporaries on the stack above the frame.
+    aluReg(as, ALU_MOV, RAX, SLOTS);
+    aluImm(as, IMM_ADD, RAX, tc->maxHeight * (int) sizeof(Value));
+    load(as, RDX, STATE, offsetof(JitState, stackLimit));
+    aluReg(as, ALU_CMP, RAX, RDX);
+    guard(as, CC_A, ENTRY_MISS);
+
+    for (int i = 0; i < tc->homeCount; i++) {
+        Home *home = &tc->homes[i];
+        bool live = home->kind != HOME_STACK || home->index < tc->entryHeight;
+        if (!live || (home->entryType == -1 && (home->reg == -1 || !home->dirty) && home->kind != HOME_GLOBAL)) {
+            continue;
+        }
+
+        int reg = home->reg;
+        home->reg = -1;
+        homeToGpr(tc, RAX, home);
+        home->reg = reg;
+        if (home->entryType != -1) {
+            guardType(as, home->entryType, ENTRY_MISS);
+        } else if (home->kind == HOME_GLOBAL) {
+            movImm(as, RCX, UNDEFINED_VAL);
+            aluReg(as, ALU_CMP, RAX, RCX);
+            guard(as, CC_E, ENTRY_MISS);
+        }
+        if (reg != -1) {
+            movqToXmm(as, reg, RAX);
+        }
+    }
+}
+
+// Writes back registers holding values the interpreter can see at the snapshot, then leaves.
+static void traceExit(TraceCompiler *tc, Snapshot *snapshot, int epilogue) {
+    Assembler *as = &tc->as;
+    for (int i = 0; i < tc->homeCount; i++) {
+        Home *home = &tc->homes[i];
+        if (home->reg == -1 || !home->dirty ||
+            (home->kind == HOME_STACK && (home->index >= snapshot->height || home->index == snapshot->constantAt))) {
+            continue;
+        }
+        int reg = home->reg;
+        home->reg = -1;
+        xmmToHome(tc, home, reg);
+        home->reg = reg;
+    }
+
+    if (snapshot->constantAt != -1) {
+        movImm(as, RAX, snapshot->constant);
+        store(as, SLOTS, snapshot->constantAt * (int) sizeof(Value), RAX);
+    }
+    aluReg(as, ALU_MOV, RAX, SLOTS);
+    aluImm(as, IMM_ADD, RAX, snapshot->height * (int) sizeof(Value));
+    store(as, STATE, offsetof(JitState, sp), RAX);
+    emit(as, 0x41); // mov dword [r15 + offset], imm32
+    emit(as, 0xc7);
+    memOperand(as, 0, STATE, offsetof(JitState, offset));
+    emitInt(as, snapshot->offset);
+    int position = jmp(as);
+    patchInt(as, position, epilogue - (position + 4));
+}
+
+static int byUses(const void *a, const void *b) {
+    return (*(Home **) b)->uses - (*(Home **) a)->uses;
+}
+
+static void allocateRegisters(TraceCompiler *tc) {
+    Home **order = malloc(sizeof(Home *) * tc->homeCount);
+    for (int i = 0; i < tc->homeCount; i++) {
+        order[i] = &tc->homes[i];
+    }
+    qsort(order, tc->homeCount, sizeof(Home *), byUses);
+    for (int i = 0; i < tc->homeCount && i < HOME_REGISTERS; i++) {
+        order[i]->reg = FIRST_HOME_REGISTER + i;
+    }
+    free(order);
+}
+
+static void freeTraceCompiler(TraceCompiler *tc) {
+    freeAssembler(&tc->as);
+    free(tc->homes);
+    free(tc->snapshots);
+}
+
+Trace *jitCompileTrace(ObjFunction *function, int header, int height, TraceStep *steps, int count) {
+    TraceCompiler tc = {0};
+    tc.chunk = &function->chunk;
+    tc.upvalueCount = function->upvalueCount;
+    tc.steps = steps;
+    tc.count = count;
+    tc.entryHeight = height;
+    tc.maxHeight = height;
+
+    // A first walk finds the homes, their types and how often they are used. Its code is thrown away.
+    traceBody(&tc);
+    if (tc.failed) {
+        freeTraceCompiler(&tc);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        tc.steps[i].type &= ~2;
+    }
+    allocateRegisters(&tc);
+    freeAssembler(&tc.as);
+    memset(&tc.as, 0, sizeof(Assembler));
+    tc.snapshotCount = 0;
+
+    // Entry: void (JitState *state)
+    pushReg(&tc.as, RBX);
+    pushReg(&tc.as, R12);
+    pushReg(&tc.as, R13);
+    pushReg(&tc.as, R14);
+    pushReg(&tc.as, R15);
+    aluReg(&tc.as, ALU_MOV, STATE, RDI);
+    traceEntry(&tc);
+    traceBody(&tc);
+
+    int epilogue = tc.as.count;
+    popReg(&tc.as, R15);
+    popReg(&tc.as, R14);
+    popReg(&tc.as, R13);
+    popReg(&tc.as, R12);
+    popReg(&tc.as, RBX);
+    emit(&tc.as, 0xc3);
+
+    int miss = tc.as.count;
+    emit(&tc.as, 0x41); // mov dword [r15 + offset], -1
+    emit(&tc.as, 0xc7);
+    memOperand(&tc.as, 0, STATE, offsetof(JitState, offset));
+    emitInt(&tc.as, -1);
+    int position = jmp(&tc.as);
+    patchInt(&tc.as, position, epilogue - (position + 4));
+
+    int *stubs = malloc(sizeof(int) * (tc.snapshotCount + 1));
+    for (int i = 0; i < tc.snapshotCount; i++) {
+        stubs[i] = tc.as.count;
+        traceExit(&tc, &tc.snapshots[i], epilogue);
+    }
+    for (int i = 0; i < tc.as.exitCount; i++) {
+        Patch *exit = &tc.as.exits[i];
+        int target = exit->offset == ENTRY_MISS ? miss : stubs[exit->offset];
+        patchInt(&tc.as, exit->position, target - (exit->position + 4));
+    }
+    free(stubs);
+
+    Trace *trace = NULL;
+    uint8_t *code = install(&tc.as);
+    if (code != NULL) {
+        trace = malloc(sizeof(Trace));
+        trace->code = code;
+        trace->size = tc.as.count;
+        trace->misses = 0;
+    }
+    freeTraceCompiler(&tc);
+    return trace;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "object.h"
+
+#ifdef JIT
+
+// Calls plus loop back-edges a function has to go through before it gets compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// Interpreter state handed to compiled code. Compiled code runs inside the current frame only, whenever
+// it reaches something it doesn't handle (calls, allocations, failed type guards, runtime errors, returns)
+// it stores sp and the offset of that instruction and returns so the interpreter carries on from there.
+typedef struct {
+    Value *sp;
+    Value *slots;
+    ObjUpvalue **upvalues;
+    // Slots of the frame below, for functions reading the variables they captured from it.
+    Value *enclosing;
+    Value *stackLimit;
+    int offset;
+} JitState;
+
+struct JitCode {
+    uint8_t *code;
+    size_t size;
+    // Native offset of every instruction compiled code can be entered at, -1 for the others.
+    int *entries;
+    int entryCount;
+};
+
+bool jitCompile(ObjFunction *function);
+
+void jitFree(ObjFunction *function);
+
+bool jitRun(ObjFunction *function, JitState *state, int offset);
+
+#endif
+
+#endif //CLOX_JIT_H
@@ -9,42 +9,59 @@ void initLineArray(LineArray* lineArray) {
     lineArray->array = NULL;
 }
 
-void writeLineArray(LineArray* lineArray, uint32_t line) {
+void writeLineArray(LineArray* lineArray, uint32_t line, uint32_t column) {
+    int offset = lineArray->count == 0 ? 0 : lineArray->array[lineArray->count - 1].end;
+    if (lineArray->count > 0 && lineArray->array[lineArray->count - 1].line == line &&
+        lineArray->array[lineArray->count - 1].column == column) {
+        lineArray->array[lineArray->count - 1].end++;
+        return;
+    }
+
     if (lineArray->capacity < lineArray->count + 1) {
         int oldCapacity = lineArray->capacity;
         lineArray->capacity = GROW_CAPACITY(oldCapacity);
         lineArray->array = GROW_ARRAY(Line, lineArray->array, oldCapacity, lineArray->capacity);
     }
 
-    if (lineArray->count == 0 || lineArray->array[lineArray->count - 1].line != line) {
-        lineArray->array[lineArray->count] = (Line){line, 1};
-        lineArray->count++;
-        return;
-    }
-
-    lineArray->array[lineArray->count - 1].count++;
+    lineArray->array[lineArray->count] = (Line){line, column, offset + 1};
+    lineArray->count++;
 }
 
-uint32_t getLine(LineArray* lineArray, uint32_t offset) {
-    size_t len = 0, at = 0;
-
-    for (int i = 0; i < lineArray->count; i++) {
-        len += lineArray->array[i].count;
+// Drops every byte from offset count on.
+void truncateLineArray(LineArray* lineArray, int count) {
+    while (lineArray->count > 0) {
+        Line* last = &lineArray->array[lineArray->count - 1];
+        int start = lineArray->count == 1 ? 0 : lineArray->array[lineArray->count - 2].end;
+        if (start < count) {
+            if (last->end > count) {
+                last->end = count;
+            }
+            return;
+        }
+        lineArray->count--;
     }
+}
 
-    uint32_t* lines = malloc(sizeof(uint32_t) * len);
-
-    for (int i = 0; i < lineArray->count; i++) {
-        for (int j = 0; j < lineArray->array[i].count; j++) {
-            lines[at] = lineArray->array[i].line;
-            at++;
+static Line* findRun(LineArray* lineArray, uint32_t offset) {
+    int low = 0;
+    int high = lineArray->count - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if ((uint32_t) lineArray->array[middle].end <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
     }
+    return &lineArray->array[low];
+}
 
-    uint32_t result = lines[offset];
-    free(lines);
+uint32_t getLine(LineArray* lineArray, uint32_t offset) {
+    return findRun(lineArray, offset)->line;
+}
 
-    return result;
+uint32_t getColumn(LineArray* lineArray, uint32_t offset) {
+    return findRun(lineArray, offset)->column;
 }
 
 void freeLineArray(LineArray* lineArray) {
@@ -3,9 +3,12 @@
 
 #include "common.h"
 
+// A run of bytes compiled from the same token position. Runs only store the offset one past their last
+// byte, which grows from one run to the next, so the run of an offset can be binary searched.
 typedef struct {
     uint32_t line;
-    int count;
+    uint32_t column;
+    int end;
 } Line;
 
 typedef struct {
@@ -15,8 +18,10 @@ typedef struct {
 } LineArray;
 
 void initLineArray(LineArray* lineArray);
-void writeLineArray(LineArray* lineArray, uint32_t line);
+void writeLineArray(LineArray* lineArray, uint32_t line, uint32_t column);
+void truncateLineArray(LineArray* lineArray, int count);
 uint32_t getLine(LineArray* lineArray, uint32_t offset);
+uint32_t getColumn(LineArray* lineArray, uint32_t offset);
 void freeLineArray(LineArray* lineArray);
 
 #endif //CLOX_LINE_H
@@ -2,11 +2,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bytecode.h"
+#include "compiler.h"
 #include "vm.h"
 
 static void repl() {
     uint32_t maxLines = 1024;
+    useInlining(false);
 
     char lines[maxLines][1024];
     for (int i = 0; i < maxLines; i++) {
@@ -50,10 +57,65 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
-static void runFile(const char *path) {
+static bool isBytecodeFile(const char *path) {
+    size_t length = strlen(path);
+    return length >= 5 && strcmp(path + length - 5, ".loxc") == 0;
+}
+
+// Maps a .loxc file or a snapshot for good, the strings loaded from it point into it.
+static const uint8_t *mapFile(const char *path, size_t *size) {
+    int file = open(path, O_RDONLY);
+    struct stat status;
+    if (file == -1 || fstat(file, &status) == -1) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    *size = status.st_size;
+    void *data = mmap(NULL, *size > 0 ? *size : 1, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    close(file);
+    return data;
+}
+
+static void compileFile(const char *path, const char *output) {
+    char *source = readFile(path);
+    ObjFunction *script = compile(source);
+    if (script == NULL) exit(65);
+    if (!writeBytecode(script, output)) exit(74);
+    free(source);
+}
+
+// Runs the script at path, then writes what it left in the globals to a snapshot at output.
+static void snapshotFile(const char *path, const char *output) {
     char *source = readFile(path);
     InterpretResult result = interpret(source);
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (!writeSnapshot(output)) exit(74);
     free(source);
+}
+
+static void loadSnapshot(const char *path) {
+    size_t size;
+    const uint8_t *data = mapFile(path, &size);
+    if (!readSnapshot(data, size)) exit(65);
+}
+
+static void runFile(const char *path) {
+    InterpretResult result;
+    if (isBytecodeFile(path)) {
+        size_t size;
+        const uint8_t *data = mapFile(path, &size);
+        result = interpretBytecode(data, size);
+    } else {
+        char *source = readFile(path);
+        result = interpret(source);
+        free(source);
+    }
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
@@ -62,13 +124,76 @@ static void runFile(const char *path) {
 int main(int argc, const char *argv[]) {
     initVM();
 
-    if (argc == 1) {
+    const char *path = NULL;
+    const char *output = NULL;
+    const char *snapshot = NULL;
+    bool compileOnly = false;
+    bool snapshotOnly = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-jit") == 0) {
+            useJit(false);
+        } else if (strcmp(argv[i], "--no-registers") == 0) {
+            useRegisters(false);
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            useInlining(false);
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            useLazyCompilation(true);
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            snapshotOnly = true;
+        } else if (strcmp(argv[i], "--from-snapshot") == 0 && i + 1 < argc && snapshot == NULL) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && output == NULL) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+            setOptimizationLevel(argv[i][2] - '0');
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: clox [--no-jit] [--no-registers] [--no-inline] [--lazy] [-O0|-O1|-O2] "
+                            "[--from-snapshot snapshot] [path]\n"
+                            "       clox --compile [-O0|-O1|-O2] path [-o output]\n"
+                            "       clox --snapshot [-O0|-O1|-O2] path [-o output]\n");
+            exit(64);
+        }
+    }
+
+    if (snapshot != NULL) {
+        loadSnapshot(snapshot);
+    }
+
+    if (compileOnly) {
+        if (path == NULL) {
+            fprintf(stderr, "Usage: clox --compile [-O0|-O1|-O2] path [-o output]\n");
+            exit(64);
+        }
+        // Lazy functions have no bytecode to write yet.
+        useLazyCompilation(false);
+        char defaultOutput[strlen(path) + 2];
+        snprintf(defaultOutput, sizeof(defaultOutput), "%sc", path);
+        compileFile(path, output != NULL ? output : defaultOutput);
+    } else if (snapshotOnly) {
+        if (path == NULL) {
+            fprintf(stderr, "Usage: clox --snapshot [-O0|-O1|-O2] path [-o output]\n");
+            exit(64);
+        }
+        useLazyCompilation(false);
+        // Scripts run from the snapshot may reassign the prelude's functions, copies inlined into its code
+        // would go on running the old bodies.
+        useInlining(false);
+        // prelude.lox goes to prelude.snap, anything else gets .snap added.
+        size_t length = strlen(path);
+        if (length >= 4 && strcmp(path + length - 4, ".lox") == 0) {
+            length -= 4;
+        }
+        char defaultOutput[length + 6];
+        snprintf(defaultOutput, sizeof(defaultOutput), "%.*s.snap", (int) length, path);
+        snapshotFile(path, output != NULL ? output : defaultOutput);
+    } else if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
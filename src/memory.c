@@ -14,7 +14,10 @@
 #endif
 
 #include "buffer.h"
+#include "bytecode.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
@@ -54,6 +57,10 @@ static void freeObject(Obj *object) {
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
+#ifdef JIT
+            jitFree(function);
+            traceFree(function);
+#endif
             freeChunk(&function->chunk);
             FREE(ObjFunction, object);
             break;
@@ -63,7 +70,7 @@ static void freeObject(Obj *object) {
             break;
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            reallocate(closure->upvalues, CAPTURES_SIZE(closure->upvalueCount, closure->values != NULL), 0);
             FREE(ObjClosure, object);
             break;
         }
@@ -78,10 +85,18 @@ static void freeObject(Obj *object) {
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
+            FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
             freeTable(&instance->fields);
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_BOUND_METHOD: {
             FREE(ObjBoundMethod, object);
             break;
@@ -136,6 +151,16 @@ void markArray(ValueArray *array) {
     }
 }
 
+static void markInlineCaches(Chunk *chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            markObject(cache->entries[j].key);
+            markValue(cache->entries[j].value);
+        }
+    }
+}
+
 void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void *) object);
@@ -149,6 +174,9 @@ void blackenObject(Obj *object) {
             markObject((Obj *) closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
                 markObject((Obj *) closure->upvalues[i]);
+                if (closure->values != NULL) {
+                    markValue(closure->values[i]);
+                }
             }
             break;
         }
@@ -156,6 +184,10 @@ void blackenObject(Obj *object) {
             ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
             markArray(&function->chunk.constants);
+            markInlineCaches(&function->chunk);
+            for (int i = 0; i < function->chunk.inlinedCount; i++) {
+                markObject(function->chunk.inlined[i].function);
+            }
             break;
         }
         case OBJ_UPVALUE:
@@ -166,14 +198,27 @@ void blackenObject(Obj *object) {
             markObject((Obj *) klass->name);
             markValue(klass->initializer);
             markTable(&klass->methods);
+            markObject((Obj *) klass->rootShape);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             markObject((Obj *) instance->klass);
+            if (instance->shape != NULL) {
+                markObject((Obj *) instance->shape);
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    markValue(instance->slots[i]);
+                }
+            }
             markTable(&instance->fields);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
+            break;
+        }
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *) object;
             markValue(bound->receiver);
@@ -181,6 +226,8 @@ void blackenObject(Obj *object) {
             break;
         }
         case OBJ_NATIVE:
+            markObject((Obj *) ((ObjNative *) object)->name);
+            break;
         case OBJ_STRING:
             break;
     }
@@ -201,6 +248,7 @@ static void markRoots() {
 
     markBufferRoots();
     markCompilerRoots();
+    markBytecodeRoots();
     markObject((Obj *) vm.initString);
 }
 
@@ -246,6 +294,7 @@ void collectGarbage() {
     tableRemoveWhite(&vm.strings);
     tableRemoveWhite(&buffer.globalVarIdentifiers);
     tableRemoveWhite(&buffer.constVarIdentifiers);
+    tableRemoveWhite(&buffer.constVarOrder);
     sweep();
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
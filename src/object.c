@@ -75,26 +75,41 @@ ObjFunction *newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->readsEnclosingFrame = false;
+    function->capturesValues = false;
+    function->body = NULL;
+    function->bodyLine = 0;
+    function->bodyColumn = 0;
+    function->bodyConsts = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->loops = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative *newNative(NativeFn function, int arity) {
+ObjNative *newNative(ObjString *name, NativeFn function, int arity) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->name = name;
     native->function = function;
     native->arity = arity;
     return native;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    ObjUpvalue **upvalues = reallocate(NULL, 0, CAPTURES_SIZE(function->upvalueCount, function->capturesValues));
+    Value *values = function->capturesValues ? (Value *) (upvalues + function->upvalueCount) : NULL;
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = NULL;
+        if (values != NULL) {
+            values[i] = NIL_VAL;
+        }
     }
 
     ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
+    closure->values = values;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
@@ -104,16 +119,145 @@ ObjClass *newClass(ObjString *name) {
     klass->name = name;
     klass->initializer = NIL_VAL;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+    klass->slotHint = 0;
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape();
+    pop(1);
     return klass;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
     ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
+    instance->shape = klass->rootShape;
+    instance->slotCapacity = 0;
+    instance->slots = NULL;
     initTable(&instance->fields);
+
+    if (klass->slotHint > 0) {
+        push(OBJ_VAL(instance));
+        instance->slots = GROW_ARRAY(Value, NULL, 0, klass->slotHint);
+        instance->slotCapacity = klass->slotHint;
+        pop(1);
+    }
     return instance;
 }
 
+ObjShape *newShape() {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->slotCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjShape *child = newShape();
+    push(OBJ_VAL(child));
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL(shape->slotCount));
+    child->slotCount = shape->slotCount + 1;
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    pop(1);
+    return child;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (int) AS_NUMBER(slot);
+}
+
+// Also records how many fields instances of the class end up with, so new ones get their slots upfront.
+void reserveInstanceSlots(ObjInstance *instance, int count) {
+    if (count > instance->klass->slotHint) {
+        instance->klass->slotHint = count;
+    }
+
+    if (count <= instance->slotCapacity) {
+        return;
+    }
+
+    int oldCapacity = instance->slotCapacity;
+    int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    if (capacity < count) {
+        capacity = count;
+    }
+    instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity, capacity);
+    instance->slotCapacity = capacity;
+}
+
+static void toDictionary(ObjInstance *instance) {
+    ObjShape *shape = instance->shape;
+    for (int i = 0; i < shape->slots.capacity; i++) {
+        Entry *entry = &shape->slots.entries[i];
+        if (entry->key == NULL) continue;
+        tableSet(&instance->fields, entry->key, instance->slots[(int) AS_NUMBER(entry->value)]);
+    }
+
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    instance->slots = NULL;
+    instance->slotCapacity = 0;
+    instance->shape = NULL;
+}
+
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->fields, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) {
+        return false;
+    }
+    *value = instance->slots[slot];
+    return true;
+}
+
+// The instance, name and value must be reachable by the GC, every caller has them on the stack.
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            instance->slots[slot] = value;
+            return;
+        }
+
+        if (instance->shape->slotCount < SHAPE_MAX_SLOTS) {
+            ObjShape *shape = shapeTransition(instance->shape, name);
+            reserveInstanceSlots(instance, shape->slotCount);
+            instance->slots[shape->slotCount - 1] = value;
+            instance->shape = shape;
+            return;
+        }
+
+        toDictionary(instance);
+    }
+
+    tableSet(&instance->fields, name, value);
+}
+
+// Shapes only ever grow, so deleting a field moves the instance to dictionary mode for good.
+bool deleteInstanceField(ObjInstance *instance, ObjString *name) {
+    if (instance->shape != NULL) {
+        if (shapeSlot(instance->shape, name) == -1) {
+            return false;
+        }
+        toDictionary(instance);
+    }
+
+    return tableDelete(&instance->fields, name);
+}
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -121,7 +265,7 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
     return bound;
 }
 
-ObjArray *newArray(Value *source, uint16_t length) {
+ObjArray *newArray(Value *source, int length) {
     int capacity = length;
     if (length != 0) {
         capacity -= 1;
@@ -193,6 +337,9 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_SHAPE:
+            printf("<shape %d>", AS_SHAPE(value)->slotCount);
+            break;
         case OBJ_ARRAY: {
             ObjArray *array = AS_ARRAY(value);
             printf("[");
@@ -16,6 +16,7 @@
 #define IS_INSTANCE(value)      (isObjType(value, OBJ_INSTANCE))
 #define IS_BOUND_METHOD(value)  (isObjType(value, OBJ_BOUND_METHOD))
 #define IS_ARRAY(value)         (isObjType(value, OBJ_ARRAY))
+#define IS_SHAPE(value)         (isObjType(value, OBJ_SHAPE))
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
@@ -26,6 +27,10 @@
 #define AS_INSTANCE(value)      (((ObjInstance*)AS_OBJ(value)))
 #define AS_BOUND_METHOD(value)  (((ObjBoundMethod*)AS_OBJ(value)))
 #define AS_ARRAY(value)         (((ObjArray*)AS_OBJ(value)))
+#define AS_SHAPE(value)         (((ObjShape*)AS_OBJ(value)))
+
+// Instances with more fields than this fall back to dictionary mode.
+#define SHAPE_MAX_SLOTS 64
 
 
 typedef enum {
@@ -38,6 +43,7 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
     OBJ_ARRAY,
+    OBJ_SHAPE,
 } ObjType;
 
 struct Obj {
@@ -54,12 +60,31 @@ struct ObjString {
     bool reference;
 };
 
+typedef struct JitCode JitCode;
+typedef struct TraceLoop TraceLoop;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+    // Set for local functions only ever called by the function declaring them, whose closures read the
+    // variables they capture from its frame instead of through upvalues.
+    bool readsEnclosingFrame;
+    // Set when some variables its closures capture get copied into them rather than shared through upvalues.
+    bool capturesValues;
+    // Set while the body is left for the first call to compile (see --lazy): where the parameter list starts
+    // in the source, and on which line. The source has to outlive the call to interpret().
+    const char *body;
+    int bodyLine;
+    int bodyColumn;
+    // How many global consts were declared before the function, the body only folds those.
+    int bodyConsts;
+    // Only used when built with the JIT.
+    int hotness;
+    JitCode *jit;
+    TraceLoop *loops;
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -74,18 +99,36 @@ typedef struct {
     ObjFunction *function;
     int upvalueCount;
     ObjUpvalue **upvalues;
+    // Variables the closure captured by value, NULL unless its function has some. Shares the allocation of
+    // upvalues, right behind them: value i is used when upvalue i isn't.
+    Value *values;
 } ObjClosure;
 
+// Layout shared by every instance that got the same fields in the same order. Adding a field moves
+// the instance along a transition to the next shape, the field values themselves live in the instance.
+typedef struct ObjShape {
+    Obj obj;
+    int slotCount;
+    Table slots;
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString *name;
     Value initializer;
     Table methods;
+    ObjShape *rootShape;
+    int slotHint;
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass *klass;
+    ObjShape *shape;
+    int slotCapacity;
+    Value *slots;
+    // Only used in dictionary mode, when shape is NULL.
     Table fields;
 } ObjInstance;
 
@@ -108,6 +151,8 @@ typedef struct {
     Obj obj;
     NativeFn function;
     int arity;
+    // What initVM() defined it as, snapshots refer to natives by it.
+    ObjString *name;
 } ObjNative;
 
 uint32_t hashString(const char *key, int length);
@@ -120,7 +165,11 @@ Obj *allocateObject(size_t size, ObjType type);
 
 ObjFunction *newFunction();
 
-ObjNative *newNative(NativeFn function, int arity);
+ObjNative *newNative(ObjString *name, NativeFn function, int arity);
+
+// Bytes the upvalues of a closure take, with the values it captured when it has some.
+#define CAPTURES_SIZE(count, hasValues) \
+    ((size_t) (count) * (sizeof(ObjUpvalue *) + ((hasValues) ? sizeof(Value) : 0)))
 
 ObjClosure *newClosure(ObjFunction *function);
 
@@ -130,9 +179,23 @@ ObjClass *newClass(ObjString *name);
 
 ObjInstance *newInstance(ObjClass *klass);
 
+ObjShape *newShape();
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+
+int shapeSlot(ObjShape *shape, ObjString *name);
+
+void reserveInstanceSlots(ObjInstance *instance, int count);
+
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value);
+
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value);
+
+bool deleteInstanceField(ObjInstance *instance, ObjString *name);
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 
-ObjArray *newArray(Value *start, uint16_t length);
+ObjArray *newArray(Value *start, int length);
 
 void printObject(Value value);
 
@@ -0,0 +1,1748 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "chunk.h"
+#include "memory.h"
+
+// The compiler writes bytecode while it parses, so it never sees more than the instruction it just emitted.
+// Once a function is complete its bytecode gets lifted into an IR with one entry per instruction, where
+// jumps point at the instruction they land on instead of carrying byte distances. Passes rewrite and drop
+// instructions freely, lowering lays the survivors out again and re-encodes the jumps and the line table.
+// Passes never make an instruction longer (only jump threading can stretch a jump, and it checks). Every jump
+// is a short one in the IR: lifting folds the long forms back into it, and lowering picks the long form again
+// for any jump whose distance doesn't fit 16 bits.
+
+// Instructions longer than this (closures) are never rewritten, their bytes are copied from the source.
+#define INLINE_BYTES 7
+// Rounds of the whole pipeline, one pass often opens up work for another.
+#define MAX_ROUNDS 4
+// Jumps followed when threading a single jump.
+#define MAX_THREADING 8
+// Copies between locals tracked at once.
+#define MAX_COPIES 32
+// Bytes of bytecode a function may have to get inlined.
+#define INLINE_BUDGET 48
+// Bytes the type of every stack slot before every instruction may take, functions needing more (huge array
+// literals push a slot per element) keep their type checks.
+#define INFERENCE_BUDGET (1 << 24)
+
+typedef struct {
+    uint8_t bytes[INLINE_BYTES];
+    int length;
+    // Offset in the lifted code.
+    int source;
+    uint32_t line;
+    uint32_t column;
+    // Index of the instruction a jump lands on, -1 for anything but a jump.
+    int target;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    ObjFunction *function;
+    uint8_t *source;
+    Instruction *code;
+    int count;
+    // Whether a jump lands on the instruction, one past the end included.
+    bool *targets;
+    // Instructions the slots of each of the chunk's switch tables jump to (-1 for free slots), followed by
+    // the one its default jumps to.
+    int **switchTargets;
+    int switchCount;
+    int switchTargetCount;
+    // Calls inlined into the function, start and end are instruction indices.
+    InlinedCall *inlined;
+    int inlinedCount;
+} Ir;
+
+typedef struct {
+    const char *name;
+    int level;
+    // Returns whether anything changed.
+    bool (*run)(Ir *ir);
+} Pass;
+
+static uint8_t opcode(Instruction *instruction) {
+    return instruction->bytes[0];
+}
+
+static int readShortAt(Instruction *instruction, int at) {
+    return instruction->bytes[at] | (instruction->bytes[at + 1] << 8);
+}
+
+static void writeShortAt(Instruction *instruction, int at, int value) {
+    instruction->bytes[at] = (uint8_t) value & 0xff;
+    instruction->bytes[at + 1] = (uint8_t) ((value >> 8) & 0xff);
+}
+
+static int readLongAt(Instruction *instruction, int at) {
+    return instruction->bytes[at] | (instruction->bytes[at + 1] << 8) | (instruction->bytes[at + 2] << 16);
+}
+
+static void writeLongAt(Instruction *instruction, int at, int value) {
+    instruction->bytes[at] = (uint8_t) value & 0xff;
+    instruction->bytes[at + 1] = (uint8_t) ((value >> 8) & 0xff);
+    instruction->bytes[at + 2] = (uint8_t) ((value >> 16) & 0xff);
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_NOT_LESS || op == OP_JUMP_IF_NOT_LESS_UNCHECKED ||
+           op == OP_LOOP;
+}
+
+static bool isRegisterInstruction(uint8_t op) {
+    return op == OP_MOVE || op == OP_ADD_REGISTERS || op == OP_SUBTRACT_REGISTERS ||
+           op == OP_MULTIPLY_REGISTERS || op == OP_DIVIDE_REGISTERS || op == OP_ADD_REGISTERS_UNCHECKED ||
+           op == OP_SUBTRACT_REGISTERS_UNCHECKED || op == OP_MULTIPLY_REGISTERS_UNCHECKED ||
+           op == OP_DIVIDE_REGISTERS_UNCHECKED;
+}
+
+static int *switchTargets(Ir *ir, Instruction *instruction, int *count) {
+    int table = readShortAt(instruction, 1);
+    *count = ir->function->chunk.switches[table].capacity + 1;
+    return ir->switchTargets[table];
+}
+
+static void markTargets(Ir *ir) {
+    memset(ir->targets, 0, sizeof(bool) * (ir->count + 1));
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->code[i].target != -1) {
+            ir->targets[ir->code[i].target] = true;
+        }
+    }
+    for (int i = 0; i < ir->switchCount; i++) {
+        int count = ir->function->chunk.switches[i].capacity + 1;
+        for (int j = 0; j < count; j++) {
+            if (ir->switchTargets[i][j] != -1) {
+                ir->targets[ir->switchTargets[i][j]] = true;
+            }
+        }
+    }
+}
+
+// Jumps the compiler couldn't encode (see FarJump) get their targets from farJumps.
+static void lift(Ir *ir, ObjFunction *function, FarJump *farJumps, int farJumpCount) {
+    Chunk *chunk = &function->chunk;
+    ir->function = function;
+    ir->source = malloc(chunk->count);
+    memcpy(ir->source, chunk->code, chunk->count);
+    ir->code = malloc(sizeof(Instruction) * chunk->count);
+    ir->count = 0;
+
+    int *indexAt = malloc(sizeof(int) * (chunk->count + 1));
+    // Lines are run-length encoded, walk the runs alongside the code.
+    int run = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction *instruction = &ir->code[ir->count];
+        instruction->length = instructionLength(chunk, offset);
+        memcpy(instruction->bytes, chunk->code + offset,
+               instruction->length < INLINE_BYTES ? instruction->length : INLINE_BYTES);
+        instruction->source = offset;
+        instruction->line = chunk->lines.array[run].line;
+        instruction->column = chunk->lines.array[run].column;
+        instruction->target = -1;
+        instruction->removed = false;
+        indexAt[offset] = ir->count++;
+
+        offset += instruction->length;
+        while (run < chunk->lines.count - 1 && offset >= chunk->lines.array[run].end) {
+            run++;
+        }
+    }
+    indexAt[chunk->count] = ir->count;
+
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        if (op == OP_JUMP_LONG || op == OP_LOOP_LONG) {
+            int distance = readLongAt(instruction, 1);
+            int after = instruction->source + 4;
+            instruction->target = indexAt[op == OP_LOOP_LONG ? after - distance : after + distance];
+            instruction->bytes[0] = op == OP_LOOP_LONG ? OP_LOOP : OP_JUMP;
+            instruction->length = 3;
+        } else if (isJump(op)) {
+            int distance = readShortAt(instruction, 1);
+            int after = instruction->source + 3;
+            instruction->target = indexAt[op == OP_LOOP ? after - distance : after + distance];
+        }
+    }
+    for (int i = 0; i < farJumpCount; i++) {
+        ir->code[indexAt[farJumps[i].offset]].target = indexAt[farJumps[i].target];
+    }
+
+    ir->switchCount = chunk->switchCount;
+    ir->switchTargetCount = 0;
+    ir->switchTargets = malloc(sizeof(int *) * chunk->switchCount);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        SwitchTable *table = &chunk->switches[i];
+        int *targets = malloc(sizeof(int) * (table->capacity + 1));
+        for (int j = 0; j < table->capacity; j++) {
+            targets[j] = table->cases[j].target == -1 ? -1 : indexAt[table->cases[j].target];
+        }
+        targets[table->capacity] = indexAt[table->defaultTarget];
+        ir->switchTargets[i] = targets;
+        ir->switchTargetCount += table->capacity + 1;
+    }
+
+    ir->inlinedCount = chunk->inlinedCount;
+    ir->inlined = malloc(sizeof(InlinedCall) * chunk->inlinedCount);
+    for (int i = 0; i < chunk->inlinedCount; i++) {
+        ir->inlined[i] = chunk->inlined[i];
+        ir->inlined[i].start = indexAt[chunk->inlined[i].start];
+        ir->inlined[i].end = indexAt[chunk->inlined[i].end];
+    }
+    free(indexAt);
+
+    ir->targets = malloc(sizeof(bool) * (ir->count + 1));
+    markTargets(ir);
+}
+
+// Drops removed instructions, jumps to one of them land on the next instruction that is left.
+static void compact(Ir *ir) {
+    int *newIndex = malloc(sizeof(int) * (ir->count + 1));
+    int count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        newIndex[i] = count;
+        if (!ir->code[i].removed) {
+            ir->code[count++] = ir->code[i];
+        }
+    }
+    newIndex[ir->count] = count;
+
+    for (int i = 0; i < count; i++) {
+        if (ir->code[i].target != -1) {
+            ir->code[i].target = newIndex[ir->code[i].target];
+        }
+    }
+    for (int i = 0; i < ir->switchCount; i++) {
+        int targetCount = ir->function->chunk.switches[i].capacity + 1;
+        for (int j = 0; j < targetCount; j++) {
+            if (ir->switchTargets[i][j] != -1) {
+                ir->switchTargets[i][j] = newIndex[ir->switchTargets[i][j]];
+            }
+        }
+    }
+    // Inlined calls optimized away altogether are forgotten.
+    int inlinedCount = 0;
+    for (int i = 0; i < ir->inlinedCount; i++) {
+        InlinedCall call = ir->inlined[i];
+        call.start = newIndex[call.start];
+        call.end = newIndex[call.end];
+        if (call.start < call.end) {
+            ir->inlined[inlinedCount++] = call;
+        }
+    }
+    ir->inlinedCount = inlinedCount;
+    ir->count = count;
+    free(newIndex);
+    markTargets(ir);
+}
+
+// Unconditional jumps have long forms. A conditional jump can't get that far itself, it hops over an OP_JUMP
+// onto an OP_JUMP_LONG instead, and the OP_JUMP skips the long one when the condition doesn't jump.
+static int farJumpLength(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP ? 4 : 10;
+}
+
+static void lowerFarJump(Chunk *chunk, Instruction *instruction, int offset, int target) {
+    uint8_t op = opcode(instruction);
+    Instruction jump = *instruction;
+    if (op == OP_JUMP || op == OP_LOOP) {
+        jump.bytes[0] = op == OP_LOOP ? OP_LOOP_LONG : OP_JUMP_LONG;
+        writeLongAt(&jump, 1, op == OP_LOOP ? offset + 4 - target : target - (offset + 4));
+    } else {
+        uint8_t hops[6] = {op, 3, 0, OP_JUMP, 4, 0};
+        for (int j = 0; j < 6; j++) {
+            writeChunk(chunk, hops[j], instruction->line, instruction->column);
+        }
+        jump.bytes[0] = OP_JUMP_LONG;
+        writeLongAt(&jump, 1, target - (offset + 10));
+    }
+    for (int j = 0; j < 4; j++) {
+        writeChunk(chunk, jump.bytes[j], instruction->line, instruction->column);
+    }
+}
+
+// Offsets of the instructions laid out one after the other, plus the end. Jumps marked far take their long
+// encoding.
+static int *layoutJumps(Ir *ir, bool *far) {
+    int *offsets = malloc(sizeof(int) * (ir->count + 1));
+    int offset = 0;
+    for (int i = 0; i < ir->count; i++) {
+        offsets[i] = offset;
+        offset += far != NULL && far[i] ? farJumpLength(opcode(&ir->code[i])) : ir->code[i].length;
+    }
+    offsets[ir->count] = offset;
+    return offsets;
+}
+
+static int *layout(Ir *ir) {
+    return layoutJumps(ir, NULL);
+}
+
+// Branch relaxation: every jump starts out short, the ones whose distance doesn't fit get the long encoding.
+// That moves the code after them, which can push more jumps out of range, so it goes on until none is left.
+// Jumps only ever grow, so that ends.
+static int *relaxJumps(Ir *ir, bool *far) {
+    int *offsets = layout(ir);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->count; i++) {
+            Instruction *instruction = &ir->code[i];
+            if (instruction->target == -1 || far[i]) {
+                continue;
+            }
+            int after = offsets[i] + 3;
+            int distance = opcode(instruction) == OP_LOOP ? after - offsets[instruction->target]
+                                                          : offsets[instruction->target] - after;
+            if (distance > UINT16_MAX) {
+                far[i] = true;
+                changed = true;
+            }
+        }
+        if (changed) {
+            free(offsets);
+            offsets = layoutJumps(ir, far);
+        }
+    }
+    return offsets;
+}
+
+static void lower(Ir *ir, Chunk *chunk) {
+    bool *far = calloc(ir->count, sizeof(bool));
+    int *offsets = relaxJumps(ir, far);
+    chunk->count = 0;
+    freeLineArray(&chunk->lines);
+
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        if (far[i]) {
+            lowerFarJump(chunk, instruction, offsets[i], offsets[instruction->target]);
+            continue;
+        }
+        if (instruction->target != -1) {
+            int after = offsets[i] + 3;
+            int distance = opcode(instruction) == OP_LOOP ? after - offsets[instruction->target]
+                                                          : offsets[instruction->target] - after;
+            writeShortAt(instruction, 1, distance);
+        }
+
+        uint8_t *bytes = instruction->length > INLINE_BYTES ? ir->source + instruction->source : instruction->bytes;
+        for (int j = 0; j < instruction->length; j++) {
+            writeChunk(chunk, bytes[j], instruction->line, instruction->column);
+        }
+    }
+    free(far);
+
+    for (int i = 0; i < ir->switchCount; i++) {
+        SwitchTable *table = &chunk->switches[i];
+        for (int j = 0; j < table->capacity; j++) {
+            if (table->cases[j].target != -1) {
+                table->cases[j].target = offsets[ir->switchTargets[i][j]];
+            }
+        }
+        table->defaultTarget = offsets[ir->switchTargets[i][table->capacity]];
+    }
+
+    InlinedCall *inlined = ALLOCATE(InlinedCall, ir->inlinedCount);
+    for (int i = 0; i < ir->inlinedCount; i++) {
+        inlined[i] = ir->inlined[i];
+        inlined[i].start = offsets[ir->inlined[i].start];
+        inlined[i].end = offsets[ir->inlined[i].end];
+    }
+    FREE_ARRAY(InlinedCall, chunk->inlined, chunk->inlinedCount);
+    chunk->inlined = inlined;
+    chunk->inlinedCount = ir->inlinedCount;
+    free(offsets);
+}
+
+static void freeIr(Ir *ir) {
+    free(ir->source);
+    free(ir->code);
+    free(ir->targets);
+    for (int i = 0; i < ir->switchCount; i++) {
+        free(ir->switchTargets[i]);
+    }
+    free(ir->switchTargets);
+    free(ir->inlined);
+}
+
+static int previous(Ir *ir, int i) {
+    do {
+        i--;
+    } while (i >= 0 && ir->code[i].removed);
+    return i;
+}
+
+static int next(Ir *ir, int i) {
+    do {
+        i++;
+    } while (i < ir->count && ir->code[i].removed);
+    return i;
+}
+
+static void removeInstruction(Instruction *instruction) {
+    instruction->removed = true;
+}
+
+// Constant folding.
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// The value an instruction pushes when it is a constant or a literal.
+static bool constantValue(Ir *ir, Instruction *instruction, Value *value) {
+    switch (opcode(instruction)) {
+        case OP_CONSTANT: {
+            int constant = instruction->bytes[1] | (instruction->bytes[2] << 8) | (instruction->bytes[3] << 16);
+            *value = ir->function->chunk.constants.values[constant];
+            return true;
+        }
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool registerConstant(Ir *ir, Instruction *instruction, int at, Value *value) {
+    int operand = readShortAt(instruction, at);
+    if (!(operand & REGISTER_CONSTANT)) {
+        return false;
+    }
+    *value = ir->function->chunk.constants.values[operand & ~REGISTER_CONSTANT];
+    return true;
+}
+
+// Turns the instruction into one pushing value, false when the constant table is full.
+static bool setConstant(Ir *ir, Instruction *instruction, Value value) {
+    if (IS_BOOL(value) || IS_NIL(value)) {
+        instruction->bytes[0] = IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instruction->length = 1;
+        return true;
+    }
+
+    Chunk *chunk = &ir->function->chunk;
+    if (chunk->constants.count + 1 > UINT24_MAX) {
+        return false;
+    }
+    int constant = addConstant(chunk, value);
+    instruction->bytes[0] = OP_CONSTANT;
+    instruction->bytes[1] = (uint8_t) constant & 0xff;
+    instruction->bytes[2] = (uint8_t) ((constant >> 8) & 0xff);
+    instruction->bytes[3] = (uint8_t) ((constant >> 16) & 0xff);
+    instruction->length = 4;
+    return true;
+}
+
+bool foldOperation(uint8_t op, Value a, Value b, Value *result) {
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL));
+        return true;
+    }
+    if ((op == OP_ADD || op == OP_ADD_REGISTERS) && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(makeString(chars, length, false));
+        FREE_ARRAY(char, chars, length + 1);
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_REGISTERS:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_REGISTERS:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_REGISTERS:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_REGISTERS:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        case OP_GREATER_EQUAL:
+            *result = BOOL_VAL(!(x < y));
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_LESS_EQUAL:
+            *result = BOOL_VAL(!(x > y));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Evaluates operators whose operands are all constants, and conditional jumps on a constant. Operands
+// that would raise a runtime error are left for the VM to complain about.
+static bool foldConstants(Ir *ir) {
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        Value a, b, result;
+
+        switch (op) {
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL: {
+                // A jump may land on the first operand, which still pushes the folded value.
+                int right = previous(ir, i);
+                int left = right == -1 ? -1 : previous(ir, right);
+                if (left == -1 || ir->targets[i] || ir->targets[right] ||
+                    !constantValue(ir, &ir->code[left], &a) || !constantValue(ir, &ir->code[right], &b) ||
+                    !foldOperation(op, a, b, &result) || !setConstant(ir, &ir->code[left], result)) {
+                    break;
+                }
+                removeInstruction(&ir->code[right]);
+                removeInstruction(instruction);
+                changed = true;
+                break;
+            }
+            case OP_NEGATE:
+            case OP_NOT: {
+                int operand = previous(ir, i);
+                if (operand == -1 || ir->targets[i] || !constantValue(ir, &ir->code[operand], &a)) {
+                    break;
+                }
+                if (op == OP_NEGATE && !IS_NUMBER(a)) {
+                    break;
+                }
+                result = op == OP_NEGATE ? NUMBER_VAL(-AS_NUMBER(a)) : BOOL_VAL(isFalsey(a));
+                if (setConstant(ir, &ir->code[operand], result)) {
+                    removeInstruction(instruction);
+                    changed = true;
+                }
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                // The condition stays on the stack either way, whoever is at the other end pops it.
+                int condition = previous(ir, i);
+                if (condition == -1 || ir->targets[i] || !constantValue(ir, &ir->code[condition], &a)) {
+                    break;
+                }
+                if (isFalsey(a)) {
+                    instruction->bytes[0] = OP_JUMP;
+                } else {
+                    removeInstruction(instruction);
+                }
+                changed = true;
+                break;
+            }
+            case OP_ADD_REGISTERS:
+            case OP_SUBTRACT_REGISTERS:
+            case OP_MULTIPLY_REGISTERS:
+            case OP_DIVIDE_REGISTERS: {
+                Chunk *chunk = &ir->function->chunk;
+                if (!registerConstant(ir, instruction, 3, &a) || !registerConstant(ir, instruction, 5, &b) ||
+                    !foldOperation(op, a, b, &result) || chunk->constants.count >= REGISTER_CONSTANT) {
+                    break;
+                }
+                instruction->bytes[0] = OP_MOVE;
+                writeShortAt(instruction, 3, addConstant(chunk, result) | REGISTER_CONSTANT);
+                instruction->length = 5;
+                changed = true;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return changed;
+}
+
+// Jump threading.
+
+// Points jumps that land on another jump at where that one goes, unconditional jumps become a back-edge
+// or a forward jump depending on where they end up. Jumps to the very next instruction go away.
+static bool threadJumps(Ir *ir) {
+    int *offsets = layout(ir);
+    bool changed = false;
+
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        if (!isJump(op)) {
+            continue;
+        }
+        bool unconditional = op == OP_JUMP || op == OP_LOOP;
+
+        int target = instruction->target;
+        for (int n = 0; n < MAX_THREADING && target < ir->count && target != i; n++) {
+            Instruction *landing = &ir->code[target];
+            uint8_t landingOp = opcode(landing);
+            // A falsey condition makes the next OP_JUMP_IF_FALSE on the same value jump too.
+            bool follows = landingOp == OP_JUMP || (unconditional && landingOp == OP_LOOP) ||
+                           (op == OP_JUMP_IF_FALSE && landingOp == OP_JUMP_IF_FALSE);
+            if (!follows || (!unconditional && landing->target <= i)) {
+                break;
+            }
+            target = landing->target;
+        }
+
+        if ((unconditional || op == OP_JUMP_IF_FALSE) && target == next(ir, i)) {
+            removeInstruction(instruction);
+            changed = true;
+            continue;
+        }
+
+        uint8_t threaded = unconditional ? (target > i ? OP_JUMP : OP_LOOP) : op;
+        int distance = threaded == OP_LOOP ? offsets[i] + 3 - offsets[target] : offsets[target] - (offsets[i] + 3);
+        if ((target != instruction->target || threaded != op) && distance <= UINT16_MAX) {
+            instruction->bytes[0] = threaded;
+            instruction->target = target;
+            changed = true;
+        }
+    }
+
+    free(offsets);
+    return changed;
+}
+
+// Dead code elimination.
+
+static bool isPurePush(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUPLICATE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_GET_CAPTURED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Drops instructions no path from the entry reaches, and values pushed only to be popped right away.
+static bool eliminateDeadCode(Ir *ir) {
+    bool *reached = calloc(ir->count + 1, sizeof(bool));
+    // Every instruction adds at most two successors when it is reached for the first time, besides switches.
+    int *worklist = malloc(sizeof(int) * (2 * ir->count + ir->switchTargetCount + 1));
+    int pending = 0;
+    worklist[pending++] = 0;
+
+    while (pending > 0) {
+        int i = worklist[--pending];
+        if (i >= ir->count || reached[i]) {
+            continue;
+        }
+        reached[i] = true;
+
+        uint8_t op = opcode(&ir->code[i]);
+        if (op == OP_SWITCH) {
+            int count;
+            int *targets = switchTargets(ir, &ir->code[i], &count);
+            for (int j = 0; j < count; j++) {
+                if (targets[j] != -1) {
+                    worklist[pending++] = targets[j];
+                }
+            }
+            continue;
+        }
+        if (isJump(op)) {
+            worklist[pending++] = ir->code[i].target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) {
+            worklist[pending++] = i + 1;
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++) {
+        if (!reached[i]) {
+            removeInstruction(&ir->code[i]);
+            changed = true;
+        }
+    }
+    free(reached);
+    free(worklist);
+
+    for (int i = 0; i < ir->count; i++) {
+        int pop = next(ir, i);
+        if (ir->code[i].removed || !isPurePush(opcode(&ir->code[i])) || pop == ir->count ||
+            opcode(&ir->code[pop]) != OP_POP || ir->targets[pop]) {
+            continue;
+        }
+        removeInstruction(&ir->code[i]);
+        removeInstruction(&ir->code[pop]);
+        changed = true;
+    }
+    return changed;
+}
+
+// Copy propagation.
+
+static int stackEffect(Instruction *instruction) {
+    switch (opcode(instruction)) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUPLICATE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_GET_CAPTURED:
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_UNCHECKED:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_ARRAY_GET:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_GREATER_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+        case OP_GREATER_EQUAL_UNCHECKED:
+        case OP_LESS_EQUAL_UNCHECKED:
+        case OP_ARRAY_GET_UNCHECKED:
+            return -1;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_ARRAY_SET:
+        case OP_ARRAY_SET_UNCHECKED:
+            return -2;
+        case OP_POPN:
+            return -readShortAt(instruction, 1);
+        case OP_ARRAY:
+            return 1 - readShortAt(instruction, 1);
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -instruction->bytes[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -instruction->bytes[4];
+        case OP_INVOKE_SUPER:
+        case OP_TAIL_INVOKE_SUPER:
+            return -instruction->bytes[4] - 1;
+        case OP_ARRAY_LONG:
+            return 1 - readLongAt(instruction, 1);
+        case OP_CALL_LONG:
+        case OP_TAIL_CALL_LONG:
+            return -readShortAt(instruction, 1);
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return -readShortAt(instruction, 4);
+        case OP_INVOKE_SUPER_LONG:
+        case OP_TAIL_INVOKE_SUPER_LONG:
+            return -readShortAt(instruction, 4) - 1;
+        default:
+            return 0;
+    }
+}
+
+// Stack height before every instruction, -1 where no path gets to. NULL when two paths disagree, which
+// the compiler never does, so better leave the function alone.
+static int *stackHeights(Ir *ir) {
+    int *heights = malloc(sizeof(int) * (ir->count + 1));
+    for (int i = 0; i <= ir->count; i++) {
+        heights[i] = -1;
+    }
+    int *worklist = malloc(sizeof(int) * (2 * ir->count + ir->switchTargetCount + 1));
+    int pending = 0;
+    worklist[pending++] = 0;
+    heights[0] = ir->function->arity + 1;
+
+    while (pending > 0) {
+        int i = worklist[--pending];
+        if (i >= ir->count) {
+            continue;
+        }
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        int after = heights[i] + stackEffect(instruction);
+
+        int pair[2];
+        int *successors = pair;
+        int successorCount = 0;
+        if (op == OP_SWITCH) {
+            successors = switchTargets(ir, instruction, &successorCount);
+        } else if (isJump(op)) {
+            successors[successorCount++] = instruction->target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN && op != OP_SWITCH) {
+            successors[successorCount++] = i + 1;
+        }
+        for (int j = 0; j < successorCount; j++) {
+            int successor = successors[j];
+            if (successor == -1) {
+                continue;
+            }
+            if (heights[successor] == -1) {
+                heights[successor] = after;
+                worklist[pending++] = successor;
+            } else if (heights[successor] != after) {
+                free(worklist);
+                free(heights);
+                return NULL;
+            }
+        }
+    }
+
+    free(worklist);
+    return heights;
+}
+
+// A local known to hold the same value as another local, or a constant (as a register operand).
+typedef struct {
+    int slot;
+    int source;
+} Copy;
+
+typedef struct {
+    Copy copies[MAX_COPIES];
+    int count;
+} Copies;
+
+static bool isLocalSource(int source) {
+    return !(source & REGISTER_CONSTANT);
+}
+
+static int findCopy(Copies *copies, int slot) {
+    for (int i = 0; i < copies->count; i++) {
+        if (copies->copies[i].slot == slot) {
+            return copies->copies[i].source;
+        }
+    }
+    return -1;
+}
+
+// Forgets the copies a write to slot breaks, or with above set every copy touching slot or anything above.
+static void killCopies(Copies *copies, int slot, bool above) {
+    int kept = 0;
+    for (int i = 0; i < copies->count; i++) {
+        Copy *copy = &copies->copies[i];
+        bool killed = above ? copy->slot >= slot || (isLocalSource(copy->source) && copy->source >= slot)
+                            : copy->slot == slot || copy->source == slot;
+        if (!killed) {
+            copies->copies[kept++] = *copy;
+        }
+    }
+    copies->count = kept;
+}
+
+static void addCopy(Copies *copies, int slot, int source) {
+    if (slot != source && copies->count < MAX_COPIES) {
+        copies->copies[copies->count].slot = slot;
+        copies->copies[copies->count].source = source;
+        copies->count++;
+    }
+}
+
+// Rewrites the local operand at the given position to the local (or constant, when allowed) it is a copy of.
+static bool propagateOperand(Copies *copies, Instruction *instruction, int at, bool constants) {
+    int operand = readShortAt(instruction, at);
+    if (!isLocalSource(operand)) {
+        return false;
+    }
+    int source = findCopy(copies, operand);
+    if (source == -1 || (!constants && !isLocalSource(source))) {
+        return false;
+    }
+    writeShortAt(instruction, at, source);
+    return true;
+}
+
+// Within a block, reads of a local that was just assigned another local or a constant read that one
+// instead, which lets constant folding see through register moves. Calls may run closures writing any
+// captured local, so nothing survives them, and copies die with the slots the stack pops.
+static bool propagateCopies(Ir *ir) {
+    int *heights = stackHeights(ir);
+    if (heights == NULL) {
+        return false;
+    }
+
+    Copies copies = {.count = 0};
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        if (ir->targets[i] || heights[i] == -1) {
+            copies.count = 0;
+        }
+        if (heights[i] == -1) {
+            continue;
+        }
+
+        switch (op) {
+            case OP_GET_LOCAL:
+                changed |= propagateOperand(&copies, instruction, 1, false);
+                break;
+            case OP_ADD_LOCALS:
+                changed |= propagateOperand(&copies, instruction, 1, false);
+                changed |= propagateOperand(&copies, instruction, 3, false);
+                break;
+            case OP_SET_LOCAL: {
+                int slot = readShortAt(instruction, 1);
+                killCopies(&copies, slot, false);
+                Instruction *value = i > 0 && !ir->targets[i] ? &ir->code[i - 1] : NULL;
+                if (value != NULL && opcode(value) == OP_GET_LOCAL) {
+                    addCopy(&copies, slot, readShortAt(value, 1));
+                } else if (value != NULL && opcode(value) == OP_CONSTANT && value->bytes[3] == 0 &&
+                           readShortAt(value, 1) < REGISTER_CONSTANT) {
+                    addCopy(&copies, slot, readShortAt(value, 1) | REGISTER_CONSTANT);
+                }
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+            case OP_INVOKE_SUPER:
+            case OP_TAIL_INVOKE_SUPER:
+            case OP_CALL_LONG:
+            case OP_TAIL_CALL_LONG:
+            case OP_INVOKE_LONG:
+            case OP_TAIL_INVOKE_LONG:
+            case OP_INVOKE_SUPER_LONG:
+            case OP_TAIL_INVOKE_SUPER_LONG:
+                copies.count = 0;
+                break;
+            default:
+                if (isRegisterInstruction(op)) {
+                    changed |= propagateOperand(&copies, instruction, 3, true);
+                    if (op != OP_MOVE) {
+                        changed |= propagateOperand(&copies, instruction, 5, true);
+                    }
+                    int slot = readShortAt(instruction, 1);
+                    killCopies(&copies, slot, false);
+                    if (op == OP_MOVE) {
+                        addCopy(&copies, slot, readShortAt(instruction, 3));
+                    }
+                }
+                break;
+        }
+
+        killCopies(&copies, heights[i] + stackEffect(instruction), true);
+    }
+
+    free(heights);
+    return changed;
+}
+
+// Inlining.
+
+// Splicing the body of a callee in place of a call to it. The callee's frame would start at the slot the
+// function was pushed to, so that is where its locals end up in the caller: the slot gets nil instead of
+// the function, its locals are renamed by that base and every return stores its value in the slot and pops
+// the rest. The stack is the same afterwards as after the call.
+
+typedef struct {
+    CallSite *site;
+    int push;
+    int call;
+    int base;
+    Ir body;
+    int *heights;
+} Splice;
+
+static bool isInlinableInstruction(uint8_t op) {
+    if (op >= OP_ADD_UNCHECKED && op <= OP_DIVIDE_REGISTERS_UNCHECKED) {
+        return true;
+    }
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUPLICATE:
+        case OP_POP:
+        case OP_POPN:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_RETURN:
+        case OP_ARRAY:
+        case OP_ARRAY_GET:
+        case OP_ARRAY_SET:
+        case OP_MOVE:
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Lifts the body of the callee a site calls, false unless it is small, doesn't call itself, and only has
+// instructions that keep working in another frame. Tail calls only do in place of a tail call, anywhere else
+// they would leave a frame behind the callee never needed.
+static bool liftCallee(CallSite *site, bool tailCall, Ir *body, int **heights) {
+    ObjFunction *callee = site->callee;
+    if (callee->chunk.count > INLINE_BUDGET || callee->upvalueCount > 0 || callee->chunk.switchCount > 0) {
+        return false;
+    }
+    lift(body, callee, NULL, 0);
+    for (int i = 0; i < body->count; i++) {
+        Instruction *instruction = &body->code[i];
+        uint8_t op = opcode(instruction);
+        if (!isInlinableInstruction(op) || (op == OP_GET_GLOBAL && readShortAt(instruction, 1) == site->global) ||
+            ((op == OP_TAIL_CALL || op == OP_TAIL_INVOKE) && !tailCall)) {
+            freeIr(body);
+            return false;
+        }
+    }
+    *heights = stackHeights(body);
+    for (int i = 0; *heights != NULL && i < body->count; i++) {
+        if ((*heights)[i] == -1) {
+            free(*heights);
+            *heights = NULL;
+        }
+    }
+    if (*heights == NULL) {
+        freeIr(body);
+        return false;
+    }
+    return true;
+}
+
+// Finds the instruction pushing the function a call calls: the OP_GET_GLOBAL of the site at the height the
+// arguments start from, with straight-line code from there to the call. -1 when it isn't there.
+static int findCalleePush(Ir *ir, int *heights, int call, int base, int global) {
+    for (int i = call - 1; i >= 0; i--) {
+        if (heights[i] < base || ir->targets[i + 1] || isJump(opcode(&ir->code[i])) ||
+            opcode(&ir->code[i]) == OP_SWITCH) {
+            return -1;
+        }
+        if (heights[i] == base) {
+            Instruction *push = &ir->code[i];
+            return opcode(push) == OP_GET_GLOBAL && readShortAt(push, 1) == global ? i : -1;
+        }
+    }
+    return -1;
+}
+
+// Instructions a return of the callee turns into: storing the result in the base slot, popping the rest of
+// the frame and, unless it comes last, jumping behind the inlined body.
+static int returnLength(Splice *splice, int i) {
+    return 1 + (splice->heights[i] > 1) + (i != splice->body.count - 1);
+}
+
+static Instruction makeInstruction(uint8_t op, int operand, int length, Instruction *from) {
+    Instruction instruction = *from;
+    instruction.bytes[0] = op;
+    if (length == 3) {
+        writeShortAt(&instruction, 1, operand);
+    }
+    instruction.length = length;
+    instruction.target = -1;
+    return instruction;
+}
+
+// Rewrites an instruction of the callee for the caller's frame and chunk.
+static void relocate(Ir *ir, Splice *splice, Instruction *instruction) {
+    Chunk *chunk = &ir->function->chunk;
+    Chunk *calleeChunk = &splice->site->callee->chunk;
+    uint8_t op = opcode(instruction);
+    switch (op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            writeShortAt(instruction, 1, readShortAt(instruction, 1) + splice->base);
+            break;
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_UNCHECKED:
+            writeShortAt(instruction, 1, readShortAt(instruction, 1) + splice->base);
+            writeShortAt(instruction, 3, readShortAt(instruction, 3) + splice->base);
+            break;
+        case OP_CONSTANT:
+            writeLongAt(instruction, 1, addConstant(chunk, calleeChunk->constants.values[readLongAt(instruction, 1)]));
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            writeLongAt(instruction, 1, addConstant(chunk, calleeChunk->constants.values[readLongAt(instruction, 1)]));
+            writeShortAt(instruction, op == OP_INVOKE || op == OP_TAIL_INVOKE ? 5 : 4, addInlineCache(chunk));
+            break;
+        default:
+            if (isRegisterInstruction(op)) {
+                writeShortAt(instruction, 1, readShortAt(instruction, 1) + splice->base);
+                for (int at = 3; at < (op == OP_MOVE ? 5 : 7); at += 2) {
+                    int operand = readShortAt(instruction, at);
+                    if (operand & REGISTER_CONSTANT) {
+                        Value value = calleeChunk->constants.values[operand & ~REGISTER_CONSTANT];
+                        writeShortAt(instruction, at, addConstant(chunk, value) | REGISTER_CONSTANT);
+                    } else {
+                        writeShortAt(instruction, at, operand + splice->base);
+                    }
+                }
+            }
+            break;
+    }
+}
+
+// Writes the relocated body of the splice from code[at] on, returns where it ends.
+static int emitSplice(Ir *ir, Splice *splice, Instruction *code, int at) {
+    Ir *body = &splice->body;
+    int *position = malloc(sizeof(int) * (body->count + 1));
+    int end = at;
+    for (int i = 0; i < body->count; i++) {
+        position[i] = end;
+        end += opcode(&body->code[i]) == OP_RETURN ? returnLength(splice, i) : 1;
+    }
+    position[body->count] = end;
+
+    for (int i = 0; i < body->count; i++) {
+        Instruction *instruction = &body->code[i];
+        instruction->source = ir->code[splice->call].source;
+        if (opcode(instruction) != OP_RETURN) {
+            code[at] = *instruction;
+            relocate(ir, splice, &code[at]);
+            if (instruction->target != -1) {
+                code[at].target = position[instruction->target];
+            }
+            at++;
+            continue;
+        }
+
+        code[at++] = makeInstruction(OP_SET_LOCAL, splice->base, 3, instruction);
+        int popCount = splice->heights[i] - 1;
+        if (popCount == 1) {
+            code[at++] = makeInstruction(OP_POP, 0, 1, instruction);
+        } else if (popCount > 1) {
+            code[at++] = makeInstruction(OP_POPN, popCount, 3, instruction);
+        }
+        if (i != body->count - 1) {
+            code[at] = makeInstruction(OP_JUMP, 0, 3, instruction);
+            code[at++].target = end;
+        }
+    }
+
+    // Calls inlined into the callee go first, they are part of this one.
+    for (int i = 0; i < body->inlinedCount; i++) {
+        InlinedCall call = body->inlined[i];
+        call.start = position[call.start];
+        call.end = position[call.end];
+        ir->inlined[ir->inlinedCount++] = call;
+    }
+    InlinedCall *call = &ir->inlined[ir->inlinedCount++];
+    call->start = position[0];
+    call->end = end;
+    call->line = ir->code[splice->call].line;
+    call->tailCall = opcode(&ir->code[splice->call]) == OP_TAIL_CALL;
+    call->function = (Obj *) splice->site->callee;
+
+    free(position);
+    return end;
+}
+
+// Splices the callees of the calls the compiler found into the function, within the limits of the
+// operands that have to address the bigger frame and chunk.
+static bool inlineCalls(Ir *ir, CallSite *calls, int callCount) {
+    int *heights = stackHeights(ir);
+    if (heights == NULL) {
+        return false;
+    }
+
+    Chunk *chunk = &ir->function->chunk;
+    Splice *splices = malloc(sizeof(Splice) * callCount);
+    int spliceCount = 0;
+    int *spliceAt = malloc(sizeof(int) * ir->count);
+    for (int i = 0; i < ir->count; i++) {
+        spliceAt[i] = -1;
+    }
+    int size = chunk->count;
+    int constants = chunk->constants.count;
+    int caches = chunk->cacheCount;
+    int instructions = ir->count;
+    int inlinedCount = ir->inlinedCount;
+
+    int call = 0;
+    for (int i = 0; i < callCount; i++) {
+        CallSite *site = &calls[i];
+        while (call < ir->count && ir->code[call].source < site->offset) {
+            call++;
+        }
+        if (call == ir->count || ir->code[call].source != site->offset || heights[call] == -1 ||
+            (opcode(&ir->code[call]) != OP_CALL && opcode(&ir->code[call]) != OP_TAIL_CALL) ||
+            ir->code[call].bytes[1] != site->callee->arity) {
+            continue;
+        }
+
+        Splice *splice = &splices[spliceCount];
+        splice->site = site;
+        splice->call = call;
+        splice->base = heights[call] - site->callee->arity - 1;
+        splice->push = findCalleePush(ir, heights, call, splice->base, site->global);
+        bool tailCall = opcode(&ir->code[call]) == OP_TAIL_CALL;
+        if (splice->push == -1 || !liftCallee(site, tailCall, &splice->body, &splice->heights)) {
+            continue;
+        }
+
+        Chunk *calleeChunk = &site->callee->chunk;
+        int frameSize = 0;
+        int returns = 0;
+        for (int j = 0; j < splice->body.count; j++) {
+            int after = splice->heights[j] + stackEffect(&splice->body.code[j]);
+            frameSize = frameSize > after ? frameSize : after;
+            returns += opcode(&splice->body.code[j]) == OP_RETURN;
+        }
+        if (splice->base + frameSize >= REGISTER_CONSTANT ||
+            size + calleeChunk->count + 7 * returns > UINT16_MAX ||
+            constants + calleeChunk->constants.count >= REGISTER_CONSTANT ||
+            caches + calleeChunk->cacheCount > UINT16_MAX) {
+            free(splice->heights);
+            freeIr(&splice->body);
+            continue;
+        }
+        size += calleeChunk->count + 7 * returns;
+        constants += calleeChunk->constants.count;
+        caches += calleeChunk->cacheCount;
+        instructions += splice->body.count + 2 * returns;
+        inlinedCount += splice->body.inlinedCount + 1;
+        spliceAt[call] = spliceCount++;
+    }
+
+    if (spliceCount > 0) {
+        Instruction *code = malloc(sizeof(Instruction) * instructions);
+        int *newIndex = malloc(sizeof(int) * (ir->count + 1));
+        int inlined = ir->inlinedCount;
+        ir->inlined = realloc(ir->inlined, sizeof(InlinedCall) * inlinedCount);
+        int count = 0;
+        for (int i = 0; i < ir->count; i++) {
+            newIndex[i] = count;
+            if (spliceAt[i] != -1) {
+                count = emitSplice(ir, &splices[spliceAt[i]], code, count);
+            } else {
+                code[count++] = ir->code[i];
+            }
+        }
+        newIndex[ir->count] = count;
+
+        for (int i = 0; i < spliceCount; i++) {
+            Instruction *push = &code[newIndex[splices[i].push]];
+            *push = makeInstruction(OP_NIL, 0, 1, push);
+        }
+        for (int i = 0; i < ir->count; i++) {
+            if (spliceAt[i] == -1 && ir->code[i].target != -1) {
+                code[newIndex[i]].target = newIndex[ir->code[i].target];
+            }
+        }
+        for (int i = 0; i < ir->switchCount; i++) {
+            int targetCount = chunk->switches[i].capacity + 1;
+            for (int j = 0; j < targetCount; j++) {
+                if (ir->switchTargets[i][j] != -1) {
+                    ir->switchTargets[i][j] = newIndex[ir->switchTargets[i][j]];
+                }
+            }
+        }
+        // The new inlined calls went in with their final indices.
+        for (int i = 0; i < inlined; i++) {
+            ir->inlined[i].start = newIndex[ir->inlined[i].start];
+            ir->inlined[i].end = newIndex[ir->inlined[i].end];
+        }
+
+        free(ir->code);
+        ir->code = code;
+        ir->count = count;
+        ir->targets = realloc(ir->targets, sizeof(bool) * (count + 1));
+        markTargets(ir);
+        free(newIndex);
+    }
+
+    for (int i = 0; i < spliceCount; i++) {
+        free(splices[i].heights);
+        freeIr(&splices[i].body);
+    }
+    free(splices);
+    free(spliceAt);
+    free(heights);
+    return spliceCount > 0;
+}
+
+// Type inference.
+
+// What is known about a value, ordered so that joining two paths keeps the lesser. INT values are numbers
+// without a fraction, or infinities and NaN, which no bounds check lets through as an array index.
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_INT,
+} InferredType;
+
+typedef struct {
+    Ir *ir;
+    int *heights;
+    // The type of every stack slot before each instruction, maxHeight entries per instruction.
+    uint8_t *types;
+    bool *reached;
+    int maxHeight;
+    // Locals a closure shares, whatever it calls may write them at any time.
+    bool *captured;
+} Inference;
+
+static uint8_t constantType(Value value) {
+    if (!IS_NUMBER(value)) {
+        return TYPE_UNKNOWN;
+    }
+    double number = AS_NUMBER(value);
+    return number == trunc(number) || isnan(number) ? TYPE_INT : TYPE_NUMBER;
+}
+
+static uint8_t slotType(Inference *inference, uint8_t *types, int slot) {
+    return inference->captured[slot] ? TYPE_UNKNOWN : types[slot];
+}
+
+static uint8_t operandType(Inference *inference, uint8_t *types, Instruction *instruction, int at) {
+    Value value;
+    if (registerConstant(inference->ir, instruction, at, &value)) {
+        return constantType(value);
+    }
+    return slotType(inference, types, readShortAt(instruction, at));
+}
+
+static bool isNumeric(uint8_t type) {
+    return type != TYPE_UNKNOWN;
+}
+
+// Arithmetic on anything but numbers raises an error, so whatever comes out of it is a number, apart from
+// additions which may concatenate strings.
+static uint8_t arithmeticType(uint8_t op, uint8_t a, uint8_t b) {
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_LOCALS:
+        case OP_ADD_REGISTERS:
+            if (!isNumeric(a) || !isNumeric(b)) {
+                return TYPE_UNKNOWN;
+            }
+            return a == TYPE_INT && b == TYPE_INT ? TYPE_INT : TYPE_NUMBER;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_REGISTERS:
+            return a == TYPE_INT && b == TYPE_INT ? TYPE_INT : TYPE_NUMBER;
+        case OP_MODULO:
+            return TYPE_INT;
+        default:
+            return TYPE_NUMBER;
+    }
+}
+
+// The generic instruction an unchecked one stands for, inlined code brings those along from the callee.
+static uint8_t checkedVariant(uint8_t op) {
+    switch (op) {
+        case OP_ADD_UNCHECKED: return OP_ADD;
+        case OP_SUBTRACT_UNCHECKED: return OP_SUBTRACT;
+        case OP_MULTIPLY_UNCHECKED: return OP_MULTIPLY;
+        case OP_DIVIDE_UNCHECKED: return OP_DIVIDE;
+        case OP_GREATER_UNCHECKED: return OP_GREATER;
+        case OP_LESS_UNCHECKED: return OP_LESS;
+        case OP_GREATER_EQUAL_UNCHECKED: return OP_GREATER_EQUAL;
+        case OP_LESS_EQUAL_UNCHECKED: return OP_LESS_EQUAL;
+        case OP_ADD_LOCALS_UNCHECKED: return OP_ADD_LOCALS;
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED: return OP_JUMP_IF_NOT_LESS;
+        case OP_ARRAY_GET_UNCHECKED: return OP_ARRAY_GET;
+        case OP_ARRAY_SET_UNCHECKED: return OP_ARRAY_SET;
+        case OP_ADD_REGISTERS_UNCHECKED: return OP_ADD_REGISTERS;
+        case OP_SUBTRACT_REGISTERS_UNCHECKED: return OP_SUBTRACT_REGISTERS;
+        case OP_MULTIPLY_REGISTERS_UNCHECKED: return OP_MULTIPLY_REGISTERS;
+        case OP_DIVIDE_REGISTERS_UNCHECKED: return OP_DIVIDE_REGISTERS;
+        default: return op;
+    }
+}
+
+// Works out the types after the instruction at i from those before it.
+static void transferTypes(Inference *inference, int i, uint8_t *out) {
+    Instruction *instruction = &inference->ir->code[i];
+    uint8_t *in = &inference->types[i * inference->maxHeight];
+    uint8_t op = checkedVariant(opcode(instruction));
+    int height = inference->heights[i];
+    int after = height + stackEffect(instruction);
+    memcpy(out, in, height < after ? height : after);
+
+    Value value;
+    switch (op) {
+        case OP_CONSTANT:
+            constantValue(inference->ir, instruction, &value);
+            out[height] = constantType(value);
+            break;
+        case OP_DUPLICATE:
+            out[height] = in[height - 1];
+            break;
+        case OP_GET_LOCAL:
+            out[height] = slotType(inference, in, readShortAt(instruction, 1));
+            break;
+        case OP_SET_LOCAL:
+            out[readShortAt(instruction, 1)] = in[height - 1];
+            break;
+        case OP_ADD_LOCALS:
+            out[height] = arithmeticType(op, operandType(inference, in, instruction, 1),
+                                         operandType(inference, in, instruction, 3));
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+            out[after - 1] = arithmeticType(op, in[height - 2], in[height - 1]);
+            break;
+        case OP_NEGATE:
+            out[after - 1] = in[height - 1] == TYPE_INT ? TYPE_INT : TYPE_NUMBER;
+            break;
+        case OP_MOVE:
+            out[readShortAt(instruction, 1)] = operandType(inference, in, instruction, 3);
+            break;
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+            out[readShortAt(instruction, 1)] = arithmeticType(op, operandType(inference, in, instruction, 3),
+                                                              operandType(inference, in, instruction, 5));
+            break;
+        // Jumps and instructions that only pop or peek leave the stack they don't pop alone.
+        case OP_POP:
+        case OP_POPN:
+        case OP_CLOSE_UPVALUE:
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_SET_ENCLOSING:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_LOOP:
+        case OP_SWITCH:
+        case OP_RETURN:
+            break;
+        default:
+            if (after > 0) {
+                out[after - 1] = TYPE_UNKNOWN;
+            }
+            break;
+    }
+}
+
+// Joins types into the state before the instruction at i, returns whether that learnt anything.
+static bool joinTypes(Inference *inference, int i, uint8_t *types) {
+    uint8_t *state = &inference->types[i * inference->maxHeight];
+    int height = inference->heights[i];
+    if (!inference->reached[i]) {
+        inference->reached[i] = true;
+        memcpy(state, types, height);
+        return true;
+    }
+    bool changed = false;
+    for (int slot = 0; slot < height; slot++) {
+        if (types[slot] < state[slot]) {
+            state[slot] = types[slot];
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void findCaptured(Inference *inference) {
+    Ir *ir = inference->ir;
+    for (int i = 0; i < ir->count; i++) {
+        Instruction *instruction = &ir->code[i];
+        if (opcode(instruction) != OP_CLOSURE) {
+            continue;
+        }
+        uint8_t *upvalues = ir->source + instruction->source + 4;
+        for (int j = 0; j < (instruction->length - 4) / 2; j++) {
+            uint8_t kind = upvalues[2 * j];
+            if ((kind == 1 || kind == UPVALUE_ENCLOSING) && upvalues[2 * j + 1] < inference->maxHeight) {
+                inference->captured[upvalues[2 * j + 1]] = true;
+            }
+        }
+    }
+}
+
+static void inferTypes(Inference *inference) {
+    Ir *ir = inference->ir;
+    uint8_t *out = malloc(inference->maxHeight);
+    int *worklist = malloc(sizeof(int) * (ir->count + 1));
+    bool *pending = calloc(ir->count + 1, sizeof(bool));
+    int pendingCount = 0;
+
+    memset(out, TYPE_UNKNOWN, inference->maxHeight);
+    joinTypes(inference, 0, out);
+    worklist[pendingCount++] = 0;
+    pending[0] = true;
+
+    while (pendingCount > 0) {
+        int i = worklist[--pendingCount];
+        pending[i] = false;
+        if (i >= ir->count) {
+            continue;
+        }
+        transferTypes(inference, i, out);
+
+        Instruction *instruction = &ir->code[i];
+        uint8_t op = opcode(instruction);
+        int pair[2];
+        int *successors = pair;
+        int successorCount = 0;
+        if (op == OP_SWITCH) {
+            successors = switchTargets(ir, instruction, &successorCount);
+        } else if (isJump(op)) {
+            successors[successorCount++] = instruction->target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN && op != OP_SWITCH) {
+            successors[successorCount++] = i + 1;
+        }
+        for (int j = 0; j < successorCount; j++) {
+            int successor = successors[j];
+            if (successor != -1 && successor < ir->count && joinTypes(inference, successor, out) &&
+                !pending[successor]) {
+                worklist[pendingCount++] = successor;
+                pending[successor] = true;
+            }
+        }
+    }
+
+    free(out);
+    free(worklist);
+    free(pending);
+}
+
+static uint8_t uncheckedVariant(uint8_t op) {
+    switch (op) {
+        case OP_ADD: return OP_ADD_UNCHECKED;
+        case OP_SUBTRACT: return OP_SUBTRACT_UNCHECKED;
+        case OP_MULTIPLY: return OP_MULTIPLY_UNCHECKED;
+        case OP_DIVIDE: return OP_DIVIDE_UNCHECKED;
+        case OP_GREATER: return OP_GREATER_UNCHECKED;
+        case OP_LESS: return OP_LESS_UNCHECKED;
+        case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_UNCHECKED;
+        case OP_LESS_EQUAL: return OP_LESS_EQUAL_UNCHECKED;
+        case OP_ADD_LOCALS: return OP_ADD_LOCALS_UNCHECKED;
+        case OP_JUMP_IF_NOT_LESS: return OP_JUMP_IF_NOT_LESS_UNCHECKED;
+        case OP_ARRAY_GET: return OP_ARRAY_GET_UNCHECKED;
+        case OP_ARRAY_SET: return OP_ARRAY_SET_UNCHECKED;
+        case OP_ADD_REGISTERS: return OP_ADD_REGISTERS_UNCHECKED;
+        case OP_SUBTRACT_REGISTERS: return OP_SUBTRACT_REGISTERS_UNCHECKED;
+        case OP_MULTIPLY_REGISTERS: return OP_MULTIPLY_REGISTERS_UNCHECKED;
+        case OP_DIVIDE_REGISTERS: return OP_DIVIDE_REGISTERS_UNCHECKED;
+        default: return op;
+    }
+}
+
+// Whether the operands of the instruction at i are known to be what its checks test for.
+static bool operandsProven(Inference *inference, int i) {
+    Instruction *instruction = &inference->ir->code[i];
+    uint8_t *types = &inference->types[i * inference->maxHeight];
+    int height = inference->heights[i];
+    switch (opcode(instruction)) {
+        case OP_ADD_LOCALS:
+            return isNumeric(operandType(inference, types, instruction, 1)) &&
+                   isNumeric(operandType(inference, types, instruction, 3));
+        case OP_ADD_REGISTERS:
+        case OP_SUBTRACT_REGISTERS:
+        case OP_MULTIPLY_REGISTERS:
+        case OP_DIVIDE_REGISTERS:
+            return isNumeric(operandType(inference, types, instruction, 3)) &&
+                   isNumeric(operandType(inference, types, instruction, 5));
+        case OP_ARRAY_GET:
+            return types[height - 1] == TYPE_INT;
+        case OP_ARRAY_SET:
+            return types[height - 2] == TYPE_INT;
+        default:
+            return isNumeric(types[height - 2]) && isNumeric(types[height - 1]);
+    }
+}
+
+// Finds the locals that only ever hold numbers and switches the arithmetic, comparisons and array indexing
+// on them to the unchecked instructions. Runs once the other passes are done, as it only rewrites opcodes.
+static bool elideTypeChecks(Ir *ir) {
+    int *heights = stackHeights(ir);
+    if (heights == NULL) {
+        return false;
+    }
+
+    Inference inference = {.ir = ir, .heights = heights, .maxHeight = 1};
+    for (int i = 0; i < ir->count; i++) {
+        int after = heights[i] + stackEffect(&ir->code[i]);
+        if (heights[i] + 1 > inference.maxHeight) {
+            inference.maxHeight = heights[i] + 1;
+        }
+        if (after > inference.maxHeight) {
+            inference.maxHeight = after;
+        }
+    }
+    if ((size_t) inference.maxHeight * (ir->count + 1) > INFERENCE_BUDGET) {
+        free(heights);
+        return false;
+    }
+    inference.types = malloc((size_t) inference.maxHeight * (ir->count + 1));
+    inference.reached = calloc(ir->count + 1, sizeof(bool));
+    inference.captured = calloc(inference.maxHeight, sizeof(bool));
+    findCaptured(&inference);
+    inferTypes(&inference);
+
+    bool changed = false;
+    int checks = 0;
+    int elided = 0;
+    for (int i = 0; i < ir->count; i++) {
+        uint8_t op = opcode(&ir->code[i]);
+        if (!inference.reached[i] || uncheckedVariant(op) == op) {
+            continue;
+        }
+        checks++;
+        if (operandsProven(&inference, i)) {
+            ir->code[i].bytes[0] = uncheckedVariant(op);
+            elided++;
+            changed = true;
+        }
+    }
+#ifdef DEBUG_LOG_TYPE_CHECKS
+    ObjString *name = ir->function->name;
+    if (name == NULL) {
+        printf("-- type checks in <script>: %d of %d elided\n", elided, checks);
+    } else {
+        printf("-- type checks in %.*s: %d of %d elided\n", name->length, name->chars, elided, checks);
+    }
+#else
+    (void) checks;
+    (void) elided;
+#endif
+
+    free(inference.types);
+    free(inference.reached);
+    free(inference.captured);
+    free(heights);
+    return changed;
+}
+
+static Pass passes[] = {
+        {"copy-propagation", OPTIMIZE_FULL, propagateCopies},
+        {"constant-folding", OPTIMIZE_BASIC, foldConstants},
+        {"jump-threading", OPTIMIZE_BASIC, threadJumps},
+        {"dead-code-elimination", OPTIMIZE_BASIC, eliminateDeadCode},
+};
+
+void optimizeFunction(ObjFunction *function, int level, CallSite *calls, int callCount, FarJump *farJumps,
+                      int farJumpCount) {
+    if ((level <= OPTIMIZE_NONE && farJumpCount == 0) || function->chunk.count == 0) {
+        return;
+    }
+
+    Ir ir;
+    lift(&ir, function, farJumps, farJumpCount);
+
+    // Far jumps only get their encoding from lowering, even when nothing else is to be done.
+    bool optimized = farJumpCount > 0;
+    if (level >= OPTIMIZE_FULL && callCount > 0 && inlineCalls(&ir, calls, callCount)) {
+        optimized = true;
+    }
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool changed = false;
+        for (int i = 0; i < (int) (sizeof(passes) / sizeof(passes[0])); i++) {
+            if (level >= passes[i].level && passes[i].run(&ir)) {
+                compact(&ir);
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+        optimized = true;
+    }
+
+    if (level >= OPTIMIZE_FULL && elideTypeChecks(&ir)) {
+        optimized = true;
+    }
+
+    if (optimized) {
+        lower(&ir, &function->chunk);
+    }
+    freeIr(&ir);
+}
@@ -0,0 +1,39 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "common.h"
+#include "object.h"
+
+// -O0 leaves the bytecode as the compiler emitted it, -O1 folds constants, threads jumps and drops dead
+// code, -O2 also propagates copies between locals (which needs a stack height analysis of the function),
+// inlines calls to small global functions and leaves out the type checks of values inferred to be numbers.
+#define OPTIMIZE_NONE 0
+#define OPTIMIZE_BASIC 1
+#define OPTIMIZE_FULL 2
+
+// Evaluates a binary instruction (stack or register form) on constant operands, false when that has to be
+// left to the VM: operands it would reject, and modulo, which truncates to ints the way only the VM should.
+// Both operands have to be reachable by the GC, a concatenated string isn't until the caller stores it.
+bool foldOperation(uint8_t op, Value a, Value b, Value *result);
+
+// A call the compiler knows always reaches callee, a function in the global variable global that nothing
+// reassigns, at offset (its OP_CALL or OP_TAIL_CALL). -O2 may inline those calls.
+typedef struct {
+    int offset;
+    int global;
+    ObjFunction *callee;
+} CallSite;
+
+// A jump the compiler emitted, whose distance didn't fit its operand. offset is where the jump instruction
+// starts, target the offset it jumps to. Lowering gives it the long encoding.
+typedef struct {
+    int offset;
+    int target;
+} FarJump;
+
+// Rewrites the bytecode of a freshly compiled function through the passes enabled at level. Functions with far
+// jumps always go through lowering, -O0 included.
+void optimizeFunction(ObjFunction *function, int level, CallSite *calls, int callCount, FarJump *farJumps,
+                      int farJumpCount);
+
+#endif //CLOX_OPTIMIZER_H
@@ -3,18 +3,21 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
 void initScanner(const char *source) {
     scanner.start = source;
     scanner.current = source;
     scanner.line = 1;
+    scanner.lineStart = source;
+}
+
+Scanner saveScanner() {
+    return scanner;
+}
+
+void restoreScanner(Scanner state) {
+    scanner = state;
 }
 
 static bool isAlpha(char c) {
@@ -50,12 +53,19 @@ static bool match(char expected) {
     return true;
 }
 
+// Called right after the scanner went past a newline.
+static void newLine() {
+    scanner.line++;
+    scanner.lineStart = scanner.current;
+}
+
 static Token makeToken(TokenType type) {
     Token token;
     token.type = type;
     token.start = scanner.start;
     token.length = (int) (scanner.current - scanner.start);
     token.line = scanner.line;
+    token.column = (int) (scanner.start - scanner.lineStart) + 1;
     return token;
 }
 
@@ -76,8 +86,8 @@ static bool skipWhitespace() {
                 advance();
                 break;
             case '\n':
-                scanner.line++;
                 advance();
+                newLine();
                 break;
             case '/':
                 if (peekNext() == '/') {
@@ -90,7 +100,7 @@ static bool skipWhitespace() {
                     while (indents > 0 && !isAtEnd()) {
                         switch (advance()) {
                             case '\n':
-                                scanner.line++;
+                                newLine();
                                 break;
                             case '*':
                                 if (match('/')) {
@@ -225,8 +235,7 @@ static Token number() {
 
 static Token string() {
     while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+        if (advance() == '\n') newLine();
     }
 
     if (isAtEnd()) return errorToken("Unterminated string.");
@@ -30,10 +30,24 @@ typedef struct {
     const char *start;
     int length;
     int line;
+    // Counted in bytes from 1, where the token starts.
+    int column;
 } Token;
 
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+    const char *lineStart;
+} Scanner;
+
 void initScanner(const char *source);
 
 Token scanToken();
 
+// Where the scanner is, for the compiler to look ahead and come back to.
+Scanner saveScanner();
+
+void restoreScanner(Scanner state);
+
 #endif //CLOX_SCANNER_H
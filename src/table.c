@@ -72,6 +72,15 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
     return true;
 }
 
+Entry *tableGetEntry(Table *table, ObjString *key) {
+    if (table->count == 0) return NULL;
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return NULL;
+
+    return entry;
+}
+
 bool tableSet(Table *table, ObjString *key, Value value) {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
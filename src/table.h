@@ -21,6 +21,8 @@ void freeTable(Table *table);
 
 bool tableGet(Table *table, ObjString *key, Value *value);
 
+Entry *tableGetEntry(Table *table, ObjString *key);
+
 bool tableSet(Table *table, ObjString *key, Value value);
 
 bool tableDelete(Table *table, ObjString *key);
@@ -0,0 +1,435 @@
+#include "trace.h"
+
+#ifdef JIT
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "buffer.h"
+
+// Hot loops get traced: once a loop took enough back-edges, the next iteration runs through a small
+// recording interpreter that notes every instruction along with the types it saw. The recorded path
+// is compiled into a native loop specialized on those types (see jitCompileTrace), with guards that
+// hand execution back to the interpreter whenever the path or a type stops matching.
+
+typedef struct {
+    TraceStep *steps;
+    int count;
+    int capacity;
+} Recording;
+
+static void recordStep(Recording *recording, int offset, uint8_t type) {
+    if (recording->capacity < recording->count + 1) {
+        recording->capacity = recording->capacity < 64 ? 64 : recording->capacity * 2;
+        recording->steps = realloc(recording->steps, sizeof(TraceStep) * recording->capacity);
+    }
+    recording->steps[recording->count].offset = offset;
+    recording->steps[recording->count].type = type;
+    recording->count++;
+}
+
+uint8_t traceType(Value value) {
+    if (IS_NUMBER(value)) return TYPE_NUMBER;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    if (IS_NIL(value)) return TYPE_NIL;
+    if (IS_ARRAY(value)) return TYPE_ARRAY;
+    return TYPE_OBJECT;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static int readShort(Chunk *chunk, int offset) {
+    return chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+}
+
+static Value registerValue(Chunk *chunk, Value *slots, int position) {
+    int operand = chunk->code[position] | (chunk->code[position + 1] << 8);
+    if (operand & REGISTER_CONSTANT) {
+        return chunk->constants.values[operand & ~REGISTER_CONSTANT];
+    }
+    return slots[operand];
+}
+
+static bool validIndex(Value array, Value index) {
+    if (!IS_ARRAY(array) || !IS_NUMBER(index)) {
+        return false;
+    }
+    double i = AS_NUMBER(index);
+    return i == trunc(i) && i >= 0 && i < AS_ARRAY(array)->count;
+}
+
+// Runs one iteration of the loop starting at its header the way the interpreter would, recording it.
+// Instructions a trace can't contain (calls, allocations, anything that would raise an error) end the
+// recording before they run, the interpreter then picks up from state->offset. Returns whether the
+// iteration made it back to the header.
+static bool record(ObjFunction *function, JitState *state, TraceLoop *loop, Recording *recording) {
+    Chunk *chunk = &function->chunk;
+    Value *globals = buffer.globalVars.values;
+    Value *slots = state->slots;
+    Value *sp = state->sp;
+    int offset = loop->header;
+    bool complete = false;
+
+#define STACK_ROOM(n) if (sp + (n) > state->stackLimit) goto done
+#define NUMBERS() if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) goto done
+#define ARITHMETIC(op) \
+    do { \
+        NUMBERS(); \
+        sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \
+        sp--; \
+    } while (false)
+#define REGISTER_ARITHMETIC(op) \
+    do { \
+        Value a = registerValue(chunk, slots, offset + 3); \
+        Value b = registerValue(chunk, slots, offset + 5); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) goto done; \
+        slots[readShort(chunk, offset)] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define COMPARISON(op) \
+    do { \
+        NUMBERS(); \
+        sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \
+        sp--; \
+    } while (false)
+// ">=" and "<=" as the VM runs them, true for NaN operands.
+#define NEGATED_COMPARISON(op) \
+    do { \
+        NUMBERS(); \
+        sp[-2] = BOOL_VAL(!(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]))); \
+        sp--; \
+    } while (false)
+
+    // Back-edges other than the one closing the trace, a for loop jumps back once more from its increment
+    // to the condition. Taking one of them twice means spinning in an inner loop.
+    int backEdges[TRACE_MAX_BACK_EDGES];
+    int backEdgeCount = 0;
+
+    while (recording->count < TRACE_MAX_LENGTH) {
+        int next = offset + instructionLength(chunk, offset);
+        uint8_t type = 0;
+
+        switch (chunk->code[offset]) {
+            case OP_CONSTANT: {
+                STACK_ROOM(1);
+                int constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+                *sp++ = chunk->constants.values[constant];
+                break;
+            }
+            case OP_NIL:
+                STACK_ROOM(1);
+                *sp++ = NIL_VAL;
+                break;
+            case OP_TRUE:
+                STACK_ROOM(1);
+                *sp++ = TRUE_VAL;
+                break;
+            case OP_FALSE:
+                STACK_ROOM(1);
+                *sp++ = FALSE_VAL;
+                break;
+            case OP_DUPLICATE:
+                STACK_ROOM(1);
+                sp[0] = sp[-1];
+                sp++;
+                break;
+            case OP_POP:
+                sp--;
+                break;
+            case OP_POPN:
+                sp -= readShort(chunk, offset);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_DEFINED: {
+                Value value = globals[readShort(chunk, offset)];
+                STACK_ROOM(1);
+                if (IS_UNDEFINED(value)) goto done;
+                *sp++ = value;
+                type = traceType(value);
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                Value *global = &globals[readShort(chunk, offset)];
+                if (IS_UNDEFINED(*global)) goto done;
+                *global = sp[-1];
+                break;
+            }
+            case OP_GET_LOCAL:
+                STACK_ROOM(1);
+                *sp = slots[readShort(chunk, offset)];
+                type = traceType(*sp++);
+                break;
+            case OP_SET_LOCAL:
+                slots[readShort(chunk, offset)] = sp[-1];
+                break;
+            case OP_GET_UPVALUE:
+                STACK_ROOM(1);
+                *sp = *state->upvalues[readShort(chunk, offset)]->location;
+                type = traceType(*sp++);
+                break;
+            case OP_SET_UPVALUE:
+                *state->upvalues[readShort(chunk, offset)]->location = sp[-1];
+                break;
+            case OP_GET_ENCLOSING:
+                STACK_ROOM(1);
+                *sp = state->enclosing[readShort(chunk, offset)];
+                type = traceType(*sp++);
+                break;
+            case OP_SET_ENCLOSING:
+                state->enclosing[readShort(chunk, offset)] = sp[-1];
+                break;
+            case OP_GET_CAPTURED:
+                STACK_ROOM(1);
+                *sp = ((Value *) (state->upvalues + function->upvalueCount))[readShort(chunk, offset)];
+                type = traceType(*sp++);
+                break;
+            case OP_EQUAL:
+                sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));
+                sp--;
+                break;
+            case OP_NOT_EQUAL:
+                sp[-2] = BOOL_VAL(!valuesEqual(sp[-2], sp[-1]));
+                sp--;
+                break;
+            case OP_GREATER:
+            case OP_GREATER_UNCHECKED:
+            case OP_GREATER_NUM:
+                COMPARISON(>);
+                break;
+            case OP_GREATER_EQUAL:
+            case OP_GREATER_EQUAL_UNCHECKED:
+            case OP_GREATER_EQUAL_NUM:
+                NEGATED_COMPARISON(<);
+                break;
+            case OP_LESS:
+            case OP_LESS_UNCHECKED:
+            case OP_LESS_NUM:
+                COMPARISON(<);
+                break;
+            case OP_LESS_EQUAL:
+            case OP_LESS_EQUAL_UNCHECKED:
+            case OP_LESS_EQUAL_NUM:
+                NEGATED_COMPARISON(>);
+                break;
+            case OP_ADD:
+            case OP_ADD_UNCHECKED:
+            case OP_ADD_NUM:
+                ARITHMETIC(+);
+                break;
+            case OP_SUBTRACT:
+            case OP_SUBTRACT_UNCHECKED:
+            case OP_SUBTRACT_NUM:
+                ARITHMETIC(-);
+                break;
+            case OP_MULTIPLY:
+            case OP_MULTIPLY_UNCHECKED:
+            case OP_MULTIPLY_NUM:
+                ARITHMETIC(*);
+                break;
+            case OP_DIVIDE:
+            case OP_DIVIDE_UNCHECKED:
+            case OP_DIVIDE_NUM:
+                ARITHMETIC(/);
+                break;
+            case OP_ADD_LOCALS_UNCHECKED:
+            case OP_ADD_LOCALS: {
+                Value a = slots[readShort(chunk, offset)];
+                Value b = slots[chunk->code[offset + 3] | (chunk->code[offset + 4] << 8)];
+                STACK_ROOM(1);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) goto done;
+                *sp++ = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                break;
+            }
+            case OP_NOT:
+                sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+                break;
+            case OP_NEGATE:
+                if (!IS_NUMBER(sp[-1])) goto done;
+                sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+                break;
+            case OP_JUMP:
+                next += readShort(chunk, offset);
+                break;
+            case OP_JUMP_IF_FALSE:
+                type = isFalsey(sp[-1]);
+                if (type) next += readShort(chunk, offset);
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+                NUMBERS();
+                type = !(AS_NUMBER(sp[-2]) < AS_NUMBER(sp[-1]));
+                sp -= 2;
+                if (type) next += readShort(chunk, offset);
+                break;
+            case OP_LOOP:
+                next -= readShort(chunk, offset);
+                if (next == loop->header) {
+                    recordStep(recording, offset, type);
+                    offset = next;
+                    complete = true;
+                    goto done;
+                }
+                // Inner loops get traces of their own.
+                for (int i = 0; i < backEdgeCount; i++) {
+                    if (backEdges[i] == offset) goto done;
+                }
+                if (backEdgeCount == TRACE_MAX_BACK_EDGES) goto done;
+                backEdges[backEdgeCount++] = offset;
+                break;
+            case OP_ARRAY_GET:
+            case OP_ARRAY_GET_UNCHECKED:
+            case OP_ARRAY_GET_NUM:
+                if (!validIndex(sp[-2], sp[-1])) goto done;
+                sp[-2] = AS_ARRAY(sp[-2])->values[(int) AS_NUMBER(sp[-1])];
+                type = traceType(sp[-2]);
+                sp--;
+                break;
+            case OP_ARRAY_SET:
+            case OP_ARRAY_SET_UNCHECKED:
+            case OP_ARRAY_SET_NUM:
+                if (!validIndex(sp[-3], sp[-2])) goto done;
+                AS_ARRAY(sp[-3])->values[(int) AS_NUMBER(sp[-2])] = sp[-1];
+                sp[-3] = sp[-1];
+                sp -= 2;
+                break;
+            case OP_MOVE: {
+                Value value = registerValue(chunk, slots, offset + 3);
+                slots[readShort(chunk, offset)] = value;
+                type = traceType(value);
+                break;
+            }
+            case OP_ADD_REGISTERS:
+            case OP_ADD_REGISTERS_UNCHECKED:
+                REGISTER_ARITHMETIC(+);
+                break;
+            case OP_SUBTRACT_REGISTERS:
+            case OP_SUBTRACT_REGISTERS_UNCHECKED:
+                REGISTER_ARITHMETIC(-);
+                break;
+            case OP_MULTIPLY_REGISTERS:
+            case OP_MULTIPLY_REGISTERS_UNCHECKED:
+                REGISTER_ARITHMETIC(*);
+                break;
+            case OP_DIVIDE_REGISTERS:
+            case OP_DIVIDE_REGISTERS_UNCHECKED:
+                REGISTER_ARITHMETIC(/);
+                break;
+            default:
+                goto done;
+        }
+
+        recordStep(recording, offset, type);
+        offset = next;
+    }
+
+#undef STACK_ROOM
+#undef NUMBERS
+#undef ARITHMETIC
+#undef REGISTER_ARITHMETIC
+#undef COMPARISON
+#undef NEGATED_COMPARISON
+
+    done:
+    state->sp = sp;
+    state->offset = offset;
+    return complete;
+}
+
+static void freeTrace(Trace *trace) {
+    munmap(trace->code, trace->size);
+    free(trace);
+}
+
+// Leaves the loop to the interpreter (and the baseline JIT) from now on.
+static void giveUp(TraceLoop *loop) {
+    loop->aborts = TRACE_MAX_ABORTS;
+    loop->countdown = INT_MAX;
+}
+
+static bool runTrace(TraceLoop *loop, JitState *state) {
+    Trace *trace = loop->trace;
+    ((void (*)(JitState *)) trace->code)(state);
+    if (state->offset != -1) {
+        return true;
+    }
+
+    // Turned down at the door, the types the trace was specialized on don't show up anymore.
+    if (++trace->misses == TRACE_MAX_MISSES) {
+        freeTrace(trace);
+        loop->trace = NULL;
+        giveUp(loop);
+    }
+    return false;
+}
+
+TraceLoop *traceLoopAt(ObjFunction *function, int header) {
+    for (TraceLoop *loop = function->loops; loop != NULL; loop = loop->next) {
+        if (loop->header == header) {
+            return loop;
+        }
+    }
+
+    TraceLoop *loop = malloc(sizeof(TraceLoop));
+    loop->header = header;
+    loop->countdown = TRACE_THRESHOLD;
+    loop->aborts = 0;
+    loop->trace = NULL;
+    loop->next = function->loops;
+    function->loops = loop;
+    return loop;
+}
+
+bool traceLoop(ObjFunction *function, JitState *state, int header) {
+    TraceLoop *loop = traceLoopAt(function, header);
+    if (loop->trace != NULL) {
+        loop->countdown = 0;
+        return runTrace(loop, state);
+    }
+
+    if (loop->aborts >= TRACE_MAX_ABORTS) {
+        loop->countdown = INT_MAX;
+        return false;
+    }
+    if (--loop->countdown > 0) {
+        return false;
+    }
+
+    Recording recording = {0};
+    int height = (int) (state->sp - state->slots);
+    if (record(function, state, loop, &recording)) {
+        loop->trace = jitCompileTrace(function, header, height, recording.steps, recording.count);
+    }
+    free(recording.steps);
+
+    if (loop->trace == NULL) {
+        loop->countdown = TRACE_THRESHOLD;
+        if (++loop->aborts == TRACE_MAX_ABORTS) {
+            giveUp(loop);
+        }
+        return true;
+    }
+
+    loop->countdown = 0;
+    if (!runTrace(loop, state)) {
+        state->offset = header;
+    }
+    return true;
+}
+
+void traceFree(ObjFunction *function) {
+    TraceLoop *loop = function->loops;
+    while (loop != NULL) {
+        TraceLoop *next = loop->next;
+        if (loop->trace != NULL) {
+            freeTrace(loop->trace);
+        }
+        free(loop);
+        loop = next;
+    }
+    function->loops = NULL;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "common.h"
+#include "object.h"
+#include "jit.h"
+
+#ifdef JIT
+
+// Back-edges a loop has to take before one iteration of it gets recorded.
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 50
+#endif
+
+// Instructions a single recorded iteration may run through.
+#define TRACE_MAX_LENGTH 512
+// Back-edges of the loop itself, or of inner loops running once, a recording may take on the way.
+#define TRACE_MAX_BACK_EDGES 8
+// Recordings of a loop that may fail before it is left to the interpreter and the baseline JIT for good.
+#define TRACE_MAX_ABORTS 3
+// Times a trace may be turned down by its entry guards before it is thrown away.
+#define TRACE_MAX_MISSES 100
+
+// Types a trace specializes values on, taken from the values seen while recording.
+typedef enum {
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_ARRAY,
+    TYPE_OBJECT,
+} TraceType;
+
+uint8_t traceType(Value value);
+
+// One recorded instruction. type is the type of the value a load produced, or whether a conditional
+// jump got taken.
+typedef struct {
+    int offset;
+    uint8_t type;
+} TraceStep;
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    int misses;
+} Trace;
+
+// A loop of a function, identified by the offset of its first instruction (where OP_LOOP jumps back to).
+struct TraceLoop {
+    int header;
+    // Counts back-edges down to recording, stays at zero once the loop got compiled so the
+    // baseline JIT keeps handing its back-edges to the interpreter.
+    int countdown;
+    int aborts;
+    Trace *trace;
+    struct TraceLoop *next;
+};
+
+TraceLoop *traceLoopAt(ObjFunction *function, int header);
+
+// Called on every back-edge the interpreter takes, returns whether the loop ran (or got recorded) and
+// the interpreter has to carry on from state->sp and state->offset.
+bool traceLoop(ObjFunction *function, JitState *state, int header);
+
+void traceFree(ObjFunction *function);
+
+// Compiles a recorded iteration of the loop at header, entered with height values in the frame's slots.
+// Lives in jit.c next to the baseline compiler it shares the assembler with.
+Trace *jitCompileTrace(ObjFunction *function, int header, int height, TraceStep *steps, int count);
+
+#endif
+
+#endif //CLOX_TRACE_H
@@ -91,3 +91,43 @@ bool valuesEqual(Value a, Value b) {
     }
 #endif
 }
+
+bool valuesIdentical(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type == VAL_NUMBER && b.type == VAL_NUMBER) {
+        return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+#endif
+}
+
+static uint32_t hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+uint32_t hashValue(Value value) {
+#ifdef NAN_BOXING
+    return hashBits(value);
+#else
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL:
+            bits = AS_BOOL(value);
+            break;
+        case VAL_NUMBER:
+            memcpy(&bits, &value.as.number, sizeof(double));
+            break;
+        case VAL_OBJ:
+            bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+            break;
+        default:
+            break;
+    }
+    return hashBits(bits) ^ (uint32_t) value.type;
+#endif
+}
@@ -97,6 +97,12 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 
+// Whether two values have the same representation, unlike valuesEqual this tells 0 from -0 and finds NaN
+// equal to itself. Constants are shared on this.
+bool valuesIdentical(Value a, Value b);
+
+uint32_t hashValue(Value value);
+
 void initValueArray(ValueArray *array);
 
 void preAllocateValueArray(ValueArray *array, Value *source, int initialCapacity);
@@ -1,15 +1,25 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include "buffer.h"
+#include "bytecode.h"
 #include "common.h"
 #include "debug.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "object.h"
+#include "optimizer.h"
+
+// Labels as values are a GNU extension, other compilers fall back to the switch.
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#undef THREADED_DISPATCH
+#endif
 
 Buffer buffer;
 VM vm;
@@ -83,7 +93,7 @@ static Value getFieldNative(int argCount, Value *args) {
     ObjString *name = AS_STRING(args[1]);
     Value value;
 
-    if (!tableGet(&instance->fields, name, &value)) {
+    if (!getInstanceField(instance, name, &value)) {
         runtimeError("Undefined field '%.*s'.", name->length, name->chars);
         return UNDEFINED_VAL;
     }
@@ -103,7 +113,7 @@ static Value setFieldNative(int argCount, Value *args) {
     }
 
     ObjInstance *instance = AS_INSTANCE(args[0]);
-    tableSet(&instance->fields, AS_STRING(args[1]), args[2]);
+    setInstanceField(instance, AS_STRING(args[1]), args[2]);
 
     return NIL_VAL;
 }
@@ -120,7 +130,7 @@ static Value deleteFieldNative(int argCount, Value *args) {
     }
 
     ObjInstance *instance = AS_INSTANCE(args[0]);
-    tableDelete(&instance->fields, AS_STRING(args[1]));
+    deleteInstanceField(instance, AS_STRING(args[1]));
 
     return NIL_VAL;
 }
@@ -142,7 +152,7 @@ static Value append(int argCount, Value *args) {
 }
 
 static void resetStack() {
-    vm.stackTop = &vm.stack[0];
+    vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
 }
@@ -159,6 +169,22 @@ static void runtimeError(const char *format, ...) {
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         uint32_t line = getLine(&function->chunk.lines, instruction);
+        // Calls the optimizer inlined get a line of their own, as if they still had their frame.
+        bool replaced = false;
+        for (int j = 0; j < function->chunk.inlinedCount; j++) {
+            InlinedCall *call = &function->chunk.inlined[j];
+            if ((int) instruction >= call->start && (int) instruction < call->end) {
+                ObjString *name = ((ObjFunction *) call->function)->name;
+                if (!replaced) {
+                    fprintf(stderr, "[line %u] in %.*s()\n", line, name->length, name->chars);
+                }
+                line = call->line;
+                replaced = call->tailCall;
+            }
+        }
+        if (replaced) {
+            continue;
+        }
         fprintf(stderr, "[line %u] in ", line);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
@@ -170,13 +196,13 @@ static void runtimeError(const char *format, ...) {
 }
 
 static void defineNative(const char *name, NativeFn function, int arity) {
-    if (buffer.globalVars.count + 1 > UINT16_MAX) {
+    if (buffer.globalVars.count + 1 > UINT24_MAX) {
         fprintf(stderr, "Too many native functions.\n");
         exit(127);
     }
 
     push(OBJ_VAL(makeString(name, (int) strlen(name), false)));
-    push(OBJ_VAL(newNative(function, arity)));
+    push(OBJ_VAL(newNative(AS_STRING(vm.stack[0]), function, arity)));
 
     writeValueArray(&buffer.globalVars, vm.stack[0]);
     writeValueArray(&buffer.globalVars, vm.stack[1]);
@@ -186,12 +212,30 @@ static void defineNative(const char *name, NativeFn function, int arity) {
 }
 
 void initVM() {
+    vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.stackLimit = vm.stack + STACK_INITIAL - STACK_RESERVE;
+    vm.frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
     resetStack();
     vm.objects = NULL;
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
 
+    vm.jit = true;
+    vm.registers = true;
+    vm.inlining = true;
+    vm.lazyCompilation = false;
+    vm.optimizationLevel = OPTIMIZE_FULL;
+
+    vm.cacheHits = 0;
+    vm.cacheMisses = 0;
+    vm.dispatches = 0;
+    vm.constantsAdded = 0;
+    vm.constantsShared = 0;
+    vm.constantIndexBytes = 0;
+
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
@@ -213,16 +257,107 @@ void initVM() {
 }
 
 void freeVM() {
+#ifdef DEBUG_LOG_INLINE_CACHE
+    size_t lookups = vm.cacheHits + vm.cacheMisses;
+    printf("-- inline caches\n");
+    printf("\t%zu hits, %zu misses (%.1f%% hit rate)\n", vm.cacheHits, vm.cacheMisses,
+           lookups == 0 ? 0.0 : 100.0 * (double) vm.cacheHits / (double) lookups);
+#endif
+#ifdef DEBUG_LOG_DISPATCH
+    printf("-- dispatch\n");
+    printf("\t%zu instructions\n", vm.dispatches);
+#endif
+#ifdef DEBUG_LOG_CONSTANTS
+    size_t stored = vm.constantsAdded - vm.constantsShared;
+    printf("-- constant pools\n");
+    printf("\t%zu constants, %zu stored (%zu bytes), %zu shared (%zu bytes saved)\n", vm.constantsAdded, stored,
+           stored * sizeof(Value), vm.constantsShared, vm.constantsShared * sizeof(Value));
+    printf("\t%zu bytes of lookup tables while compiling\n", vm.constantIndexBytes);
+#endif
+
     freeTable(&vm.strings);
     freeBuffer(&buffer);
     vm.initString = NULL;
     freeObjects();
+
+    free(vm.stack);
+    free(vm.frames);
+    vm.stack = NULL;
+    vm.frames = NULL;
+}
+
+void useJit(bool enabled) {
+    vm.jit = enabled;
+}
+
+void useRegisters(bool enabled) {
+    vm.registers = enabled;
+}
+
+void useInlining(bool enabled) {
+    vm.inlining = enabled;
+}
+
+void useLazyCompilation(bool enabled) {
+    vm.lazyCompilation = enabled;
+}
+
+void setOptimizationLevel(int level) {
+    vm.optimizationLevel = level;
+}
+
+static void stackOverflow() {
+    fprintf(stderr, "Stack overflow.");
+    exit(127);
+}
+
+// Moves the stack into an array twice the size, fixing up every pointer into it: the frames' slots,
+// open upvalues and the top. run() has to reload what it caches.
+static bool growStack() {
+    if (vm.stackCapacity == STACK_MAX) {
+        return false;
+    }
+
+    int capacity = vm.stackCapacity * 2 > STACK_MAX ? STACK_MAX : vm.stackCapacity * 2;
+    Value *stack = malloc(sizeof(Value) * capacity);
+    if (stack == NULL) {
+        return false;
+    }
+    memcpy(stack, vm.stack, sizeof(Value) * vm.stackCapacity);
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    vm.stackLimit = stack + capacity - STACK_RESERVE;
+    return true;
+}
+
+static bool growFrames() {
+    if (vm.frameCapacity == FRAMES_MAX) {
+        return false;
+    }
+
+    int capacity = vm.frameCapacity * 2 > FRAMES_MAX ? FRAMES_MAX : vm.frameCapacity * 2;
+    CallFrame *frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+        return false;
+    }
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+    return true;
 }
 
 void push(Value value) {
-    if (vm.stackTop == &vm.stack[STACK_MAX - 1]) {
-        fprintf(stderr, "Stack overflow.");
-        exit(127);
+    if (vm.stackTop == vm.stack + vm.stackCapacity) {
+        stackOverflow();
     }
     *vm.stackTop = value;
     vm.stackTop++;
@@ -237,15 +372,28 @@ static Value peek(int distance) {
     return *(vm.stackTop - 1 - distance);
 }
 
+// Compiles the body of a function --lazy left for its first call, a compile error in it ends the program the
+// way a runtime error would.
+static bool compileBody(ObjFunction *function) {
+    if (function->body == NULL || compileFunction(function)) {
+        return true;
+    }
+    runtimeError("Could not compile %.*s().", function->name->length, function->name->chars);
+    return false;
+}
+
 static bool call(ObjClosure *closure, int argCount) {
     ObjFunction *function = closure->function;
+    if (!compileBody(function)) {
+        return false;
+    }
     if (argCount != function->arity) {
         runtimeError("Expected %d arguments but got %d.",
                      function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.frameCapacity && !growFrames()) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -305,16 +453,109 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, uint8_t arcCount) {
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), arcCount);
+    return call(AS_CLOSURE(method), argCount);
+}
+
+#ifdef DEBUG_LOG_INLINE_CACHE
+#define CACHE_HIT() (vm.cacheHits++)
+#define CACHE_MISS() (vm.cacheMisses++)
+#else
+#define CACHE_HIT() do {} while(false)
+#define CACHE_MISS() do {} while(false)
+#endif
+
+static void updateCache(InlineCache *cache, Obj *key, int index, Value value) {
+    // Once every entry is taken the site is megamorphic and keeps what it has.
+    if (cache->count == INLINE_CACHE_ENTRIES) {
+        return;
+    }
+
+    InlineCacheEntry *entry = &cache->entries[cache->count++];
+    entry->key = key;
+    entry->index = index;
+    entry->value = value;
+}
+
+// Resolves a property the way the language does, fields shadow methods. The shape says both where a field
+// is and that there is no field of that name, so a hit needs no hash lookup at all. Instances in
+// dictionary mode still probe their fields table and only cache the method, keyed on the class.
+static inline bool findProperty(InlineCache *cache, ObjInstance *instance, ObjString *name,
+                                Value *value, bool *isMethod) {
+    Obj *key = (Obj *) instance->shape;
+    if (key == NULL) {
+        if (tableGet(&instance->fields, name, value)) {
+            *isMethod = false;
+            return true;
+        }
+        key = (Obj *) instance->klass;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->key == key) {
+            CACHE_HIT();
+            *isMethod = entry->index == -1;
+            *value = *isMethod ? entry->value : instance->slots[entry->index];
+            return true;
+        }
+    }
+
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            CACHE_MISS();
+            updateCache(cache, key, slot, NIL_VAL);
+            *isMethod = false;
+            *value = instance->slots[slot];
+            return true;
+        }
+    }
+
+    if (!tableGet(&instance->klass->methods, name, value)) {
+        return false;
+    }
+
+    CACHE_MISS();
+    updateCache(cache, key, -1, *value);
+    *isMethod = true;
+    return true;
+}
+
+// The instance and the value are expected on the stack.
+static inline void storeProperty(InlineCache *cache, ObjInstance *instance, ObjString *name, Value value) {
+    ObjShape *shape = instance->shape;
+    if (shape != NULL) {
+        for (int i = 0; i < cache->count; i++) {
+            InlineCacheEntry *entry = &cache->entries[i];
+            if (entry->key != (Obj *) shape) continue;
+
+            CACHE_HIT();
+            if (!IS_NIL(entry->value)) {
+                ObjShape *next = AS_SHAPE(entry->value);
+                reserveInstanceSlots(instance, next->slotCount);
+                instance->shape = next;
+            }
+            instance->slots[entry->index] = value;
+            return;
+        }
+    }
+
+    setInstanceField(instance, name, value);
+
+    if (instance->shape != NULL) {
+        CACHE_MISS();
+        updateCache(cache, (Obj *) shape, shapeSlot(instance->shape, name),
+                    instance->shape == shape ? NIL_VAL : OBJ_VAL(instance->shape));
+    }
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -322,15 +563,19 @@ static bool invoke(ObjString *name, int argCount) {
         return false;
     }
 
-    ObjInstance *instance = AS_INSTANCE(receiver);
-
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    bool isMethod;
+    if (!findProperty(cache, AS_INSTANCE(receiver), name, &value, &isMethod)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (isMethod) {
+        return call(AS_CLOSURE(value), argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
 }
 
 static bool bindMethod(ObjClass *klass, ObjString *name) {
@@ -379,6 +624,78 @@ static void closeUpvalues(Value *last) {
     }
 }
 
+// Calls a closure in place of the function running: its upvalues get closed, then the callee and the
+// arguments slide down over its slots and the CallFrame is reused, so tail recursion runs in constant
+// frame and stack space. Functions reading the frame they would replace are called the usual way.
+static bool replaceFrame(ObjClosure *closure, int argCount) {
+    if (closure->function->readsEnclosingFrame) {
+        return call(closure, argCount);
+    }
+    if (!compileBody(closure->function)) {
+        return false;
+    }
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.",
+                     closure->function->arity, argCount);
+        return false;
+    }
+
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+// Anything that isn't a closure or a bound method is called the usual way, the OP_RETURN following the call
+// returns what it pushes.
+static bool tailCall(Value callee, int argCount) {
+    if (IS_CLOSURE(callee)) {
+        return replaceFrame(AS_CLOSURE(callee), argCount);
+    }
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm.stackTop[-argCount - 1] = bound->receiver;
+        return replaceFrame(bound->method, argCount);
+    }
+    return callValue(callee, argCount);
+}
+
+// invoke() and invokeFromClass() for "return a.m(...);", the method replaces the running function.
+static bool tailInvoke(ObjString *name, int argCount, InlineCache *cache) {
+    Value receiver = peek(argCount);
+
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError("Only instances have methods.");
+        return false;
+    }
+
+    Value value;
+    bool isMethod;
+    if (!findProperty(cache, AS_INSTANCE(receiver), name, &value, &isMethod)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (isMethod) {
+        return replaceFrame(AS_CLOSURE(value), argCount);
+    }
+
+    vm.stackTop[-argCount - 1] = value;
+    return tailCall(value, argCount);
+}
+
+static bool tailInvokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    return replaceFrame(AS_CLOSURE(method), argCount);
+}
+
 static bool defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
@@ -432,6 +749,10 @@ static void concatenate() {
 static InterpretResult run() {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
     register uint8_t *ip = frame->ip;
+    register Value *sp = vm.stackTop;
+    Value *slots = frame->slots;
+    Value *constants = frame->closure->function->chunk.constants.values;
+    InlineCache *caches = frame->closure->function->chunk.caches;
 
 #define READ_BYTE() (*ip++)
 #define READ_SHORT() ({ \
@@ -445,359 +766,1003 @@ static InterpretResult run() {
     uint8_t byte3 = READ_BYTE(); \
     (byte1 | (byte2 << 8) | (byte3 << 16)); \
 })
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_LONG()])
-#define BINARY_OP(valueType, op, type) \
+#define READ_CONSTANT() (constants[READ_LONG()])
+#define PUSH(value) \
+    do {            \
+        Value pushed__ = (value); \
+        if (sp >= vm.stackLimit) { \
+            STORE_FRAME(); \
+            if (!growStack()) { \
+                RUNTIME_ERROR("Stack overflow."); \
+            }       \
+            LOAD_STACK(); \
+            slots = frame->slots; \
+        }           \
+        *sp++ = pushed__; \
+    } while(false)
+#define POP() (*--sp)
+#define POPN(count) (sp -= (count))
+#define PEEK(distance) (sp[-1 - (distance)])
+// sp, slots and constants live in locals, vm.stackTop and frame->ip are only written back when something
+// outside of run() is about to look at them: calls, returns, allocations (GC) and runtime errors.
+#define STORE_STACK() (vm.stackTop = sp)
+#define LOAD_STACK() (sp = vm.stackTop)
+#define STORE_FRAME() \
+    do {              \
+        frame->ip = ip; \
+        STORE_STACK(); \
+    } while(false)
+#define LOAD_FRAME() \
+    do {             \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches; \
+    } while(false)
+#define RUNTIME_ERROR(...) \
+    do {                   \
+        STORE_FRAME();     \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while(false)
+// Quickening rewrites the opcode of the instruction that just ran, length is its size in bytes. De-quickening
+// puts the generic opcode back and runs the instruction again from its start, so it has to be the last
+// thing a handler does (in switch mode DISPATCH() breaks out of the switch).
+#define QUICKEN(length, opcode) (ip[-(length)] = (opcode))
+#define DEQUICKEN(length, opcode) \
+    ip -= (length);               \
+    *ip = (opcode);               \
+    DISPATCH()
+// ">=" and "<=" stand for "< !" and "> !", so they are false only where the comparison they negate is true,
+// which keeps NaN operands giving true.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+#define BINARY_OP(valueType, op, type, quickened) \
     do {                               \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            frame->ip = ip;            \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
         }                              \
-        type b = AS_NUMBER(pop(1));    \
-        type a = AS_NUMBER(pop(1));    \
-        push(valueType(a op b));       \
+        QUICKEN(1, quickened);         \
+        type b = AS_NUMBER(POP());     \
+        type a = AS_NUMBER(POP());     \
+        PUSH(valueType(a op b));       \
+    } while(false)
+#define READ_REGISTER() ({ \
+        uint16_t operand__ = READ_SHORT(); \
+        (operand__ & REGISTER_CONSTANT) ? constants[operand__ & ~REGISTER_CONSTANT] : slots[operand__]; \
+    })
+#define REGISTER_OP(op) \
+    do {                \
+        uint16_t destination = READ_SHORT(); \
+        Value a = READ_REGISTER(); \
+        Value b = READ_REGISTER(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        }               \
+        slots[destination] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while(false)
+#define NUMBER_OP(valueType, op, type, generic) \
+    {                                  \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            DEQUICKEN(1, generic);     \
+        }                              \
+        type b = AS_NUMBER(POP());     \
+        PEEK(0) = valueType((type) AS_NUMBER(PEEK(0)) op b); \
+    }
+#define UNCHECKED_OP(valueType, op) \
+    {                                  \
+        double b = AS_NUMBER(POP());   \
+        PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b); \
+    }
+#define UNCHECKED_REGISTER_OP(op) \
+    do {                \
+        uint16_t destination = READ_SHORT(); \
+        Value a = READ_REGISTER(); \
+        Value b = READ_REGISTER(); \
+        slots[destination] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
     } while(false)
 #define VALIDATE_ARRAY_INDEX(rawIndex__, objArray) \
     do {                                          \
         Value rawIdx = rawIndex__;                 \
         if (!IS_NUMBER(rawIdx)) {                 \
-            frame->ip = ip;                       \
-            runtimeError("array index should be a number."); \
-            return INTERPRET_RUNTIME_ERROR;       \
+            RUNTIME_ERROR("array index should be a number."); \
         }                                         \
         double index__ = AS_NUMBER(rawIdx);        \
         if (index__ != trunc(index__)) {             \
-            frame->ip = ip;                       \
-            runtimeError("array index should be an integer."); \
-            return INTERPRET_RUNTIME_ERROR;       \
+            RUNTIME_ERROR("array index should be an integer."); \
         }                                         \
         if (index__ < 0) {                         \
-            frame->ip = ip;                       \
-            runtimeError("array index should be positive."); \
-            return INTERPRET_RUNTIME_ERROR;       \
+            RUNTIME_ERROR("array index should be positive."); \
         }                                         \
         if (index__ >= (objArray)->count) {           \
-            frame->ip = ip;                       \
-            runtimeError("array index is out of bounds.");   \
-            return INTERPRET_RUNTIME_ERROR;       \
+            RUNTIME_ERROR("array index is out of bounds."); \
         }                                         \
     } while(false)                                \
 
-    for (;;) {
+#ifdef JIT
+#define ENCLOSING_SLOTS() (frame->closure->function->readsEnclosingFrame ? frame[-1].slots : NULL)
+
+// Calls, returns and loop back-edges count towards the function getting compiled, once it is compiled
+// execution continues in native code from ip for as long as the native code can handle it.
+#define JIT_ENTER() \
+    do {            \
+        ObjFunction *function__ = frame->closure->function; \
+        if (function__->jit == NULL && vm.jit && ++function__->hotness == JIT_THRESHOLD) { \
+            jitCompile(function__); \
+        }           \
+        if (function__->jit != NULL) { \
+            JitState state__ = {sp, slots, frame->closure->upvalues, ENCLOSING_SLOTS(), vm.stackLimit, 0}; \
+            if (jitRun(function__, &state__, (int) (ip - function__->chunk.code))) { \
+                sp = state__.sp; \
+                ip = function__->chunk.code + state__.offset; \
+            }       \
+        }           \
+    } while(false)
+
+// Loop back-edges go to the trace of the loop once there is one, or count towards recording it.
+#define TRACE_ENTER() \
+    do {                      \
+        if (vm.jit) {         \
+            ObjFunction *function__ = frame->closure->function; \
+            JitState state__ = {sp, slots, frame->closure->upvalues, ENCLOSING_SLOTS(), vm.stackLimit, 0}; \
+            if (traceLoop(function__, &state__, (int) (ip - function__->chunk.code))) { \
+                sp = state__.sp; \
+                ip = function__->chunk.code + state__.offset; \
+            }                 \
+        }                     \
+    } while(false)
+#else
+#define JIT_ENTER() do {} while(false)
+#define TRACE_ENTER() do {} while(false)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("\t\t");
-        for (Value *slot = vm.stack; slot != vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int) (ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do {                    \
+        printf("\t\t");     \
+        for (Value *slot = vm.stack; slot != sp; slot++) { \
+            printf("[ ");   \
+            printValue(*slot); \
+            printf(" ]");   \
+        }                   \
+        printf("\n");       \
+        disassembleInstruction(&frame->closure->function->chunk, (int) (ip - frame->closure->function->chunk.code)); \
+    } while(false)
+#else
+#define TRACE_INSTRUCTION() do {} while(false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                push(READ_CONSTANT());
-                break;
+
+#ifdef DEBUG_LOG_DISPATCH
+#define COUNT_INSTRUCTION() (vm.dispatches++)
+#else
+#define COUNT_INSTRUCTION() do {} while(false)
+#endif
+
+#ifdef THREADED_DISPATCH
+    static void *dispatchTable[] = {
+            [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+            [OP_NIL] = &&TARGET_OP_NIL,
+            [OP_TRUE] = &&TARGET_OP_TRUE,
+            [OP_FALSE] = &&TARGET_OP_FALSE,
+            [OP_DUPLICATE] = &&TARGET_OP_DUPLICATE,
+            [OP_POP] = &&TARGET_OP_POP,
+            [OP_POPN] = &&TARGET_OP_POPN,
+            [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+            [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+            [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+            [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+            [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+            [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+            [OP_GET_ENCLOSING] = &&TARGET_OP_GET_ENCLOSING,
+            [OP_SET_ENCLOSING] = &&TARGET_OP_SET_ENCLOSING,
+            [OP_GET_CAPTURED] = &&TARGET_OP_GET_CAPTURED,
+            [OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+            [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+            [OP_INVOKE_SUPER] = &&TARGET_OP_INVOKE_SUPER,
+            [OP_TAIL_INVOKE_SUPER] = &&TARGET_OP_TAIL_INVOKE_SUPER,
+            [OP_EQUAL] = &&TARGET_OP_EQUAL,
+            [OP_GREATER] = &&TARGET_OP_GREATER,
+            [OP_LESS] = &&TARGET_OP_LESS,
+            [OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+            [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+            [OP_LESS_EQUAL] = &&TARGET_OP_LESS_EQUAL,
+            [OP_ADD] = &&TARGET_OP_ADD,
+            [OP_ADD_LOCALS] = &&TARGET_OP_ADD_LOCALS,
+            [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+            [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+            [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+            [OP_MODULO] = &&TARGET_OP_MODULO,
+            [OP_NOT] = &&TARGET_OP_NOT,
+            [OP_NEGATE] = &&TARGET_OP_NEGATE,
+            [OP_PRINT] = &&TARGET_OP_PRINT,
+            [OP_JUMP] = &&TARGET_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+            [OP_JUMP_IF_NOT_LESS] = &&TARGET_OP_JUMP_IF_NOT_LESS,
+            [OP_LOOP] = &&TARGET_OP_LOOP,
+            [OP_SWITCH] = &&TARGET_OP_SWITCH,
+            [OP_CALL] = &&TARGET_OP_CALL,
+            [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+            [OP_INVOKE] = &&TARGET_OP_INVOKE,
+            [OP_TAIL_INVOKE] = &&TARGET_OP_TAIL_INVOKE,
+            [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+            [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+            [OP_RETURN] = &&TARGET_OP_RETURN,
+            [OP_CLASS] = &&TARGET_OP_CLASS,
+            [OP_INHERIT] = &&TARGET_OP_INHERIT,
+            [OP_METHOD] = &&TARGET_OP_METHOD,
+            [OP_ARRAY] = &&TARGET_OP_ARRAY,
+            [OP_ARRAY_GET] = &&TARGET_OP_ARRAY_GET,
+            [OP_ARRAY_SET] = &&TARGET_OP_ARRAY_SET,
+            [OP_MOVE] = &&TARGET_OP_MOVE,
+            [OP_ADD_REGISTERS] = &&TARGET_OP_ADD_REGISTERS,
+            [OP_SUBTRACT_REGISTERS] = &&TARGET_OP_SUBTRACT_REGISTERS,
+            [OP_MULTIPLY_REGISTERS] = &&TARGET_OP_MULTIPLY_REGISTERS,
+            [OP_DIVIDE_REGISTERS] = &&TARGET_OP_DIVIDE_REGISTERS,
+            [OP_GET_GLOBAL_DEFINED] = &&TARGET_OP_GET_GLOBAL_DEFINED,
+            [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+            [OP_SUBTRACT_NUM] = &&TARGET_OP_SUBTRACT_NUM,
+            [OP_MULTIPLY_NUM] = &&TARGET_OP_MULTIPLY_NUM,
+            [OP_DIVIDE_NUM] = &&TARGET_OP_DIVIDE_NUM,
+            [OP_MODULO_NUM] = &&TARGET_OP_MODULO_NUM,
+            [OP_GREATER_NUM] = &&TARGET_OP_GREATER_NUM,
+            [OP_LESS_NUM] = &&TARGET_OP_LESS_NUM,
+            [OP_GREATER_EQUAL_NUM] = &&TARGET_OP_GREATER_EQUAL_NUM,
+            [OP_LESS_EQUAL_NUM] = &&TARGET_OP_LESS_EQUAL_NUM,
+            [OP_ARRAY_GET_NUM] = &&TARGET_OP_ARRAY_GET_NUM,
+            [OP_ARRAY_SET_NUM] = &&TARGET_OP_ARRAY_SET_NUM,
+            [OP_ADD_UNCHECKED] = &&TARGET_OP_ADD_UNCHECKED,
+            [OP_SUBTRACT_UNCHECKED] = &&TARGET_OP_SUBTRACT_UNCHECKED,
+            [OP_MULTIPLY_UNCHECKED] = &&TARGET_OP_MULTIPLY_UNCHECKED,
+            [OP_DIVIDE_UNCHECKED] = &&TARGET_OP_DIVIDE_UNCHECKED,
+            [OP_GREATER_UNCHECKED] = &&TARGET_OP_GREATER_UNCHECKED,
+            [OP_LESS_UNCHECKED] = &&TARGET_OP_LESS_UNCHECKED,
+            [OP_GREATER_EQUAL_UNCHECKED] = &&TARGET_OP_GREATER_EQUAL_UNCHECKED,
+            [OP_LESS_EQUAL_UNCHECKED] = &&TARGET_OP_LESS_EQUAL_UNCHECKED,
+            [OP_ADD_LOCALS_UNCHECKED] = &&TARGET_OP_ADD_LOCALS_UNCHECKED,
+            [OP_JUMP_IF_NOT_LESS_UNCHECKED] = &&TARGET_OP_JUMP_IF_NOT_LESS_UNCHECKED,
+            [OP_ARRAY_GET_UNCHECKED] = &&TARGET_OP_ARRAY_GET_UNCHECKED,
+            [OP_ARRAY_SET_UNCHECKED] = &&TARGET_OP_ARRAY_SET_UNCHECKED,
+            [OP_ADD_REGISTERS_UNCHECKED] = &&TARGET_OP_ADD_REGISTERS_UNCHECKED,
+            [OP_SUBTRACT_REGISTERS_UNCHECKED] = &&TARGET_OP_SUBTRACT_REGISTERS_UNCHECKED,
+            [OP_MULTIPLY_REGISTERS_UNCHECKED] = &&TARGET_OP_MULTIPLY_REGISTERS_UNCHECKED,
+            [OP_DIVIDE_REGISTERS_UNCHECKED] = &&TARGET_OP_DIVIDE_REGISTERS_UNCHECKED,
+            [OP_GET_GLOBAL_LONG] = &&TARGET_OP_GET_GLOBAL_LONG,
+            [OP_SET_GLOBAL_LONG] = &&TARGET_OP_SET_GLOBAL_LONG,
+            [OP_DEFINE_GLOBAL_LONG] = &&TARGET_OP_DEFINE_GLOBAL_LONG,
+            [OP_JUMP_LONG] = &&TARGET_OP_JUMP_LONG,
+            [OP_LOOP_LONG] = &&TARGET_OP_LOOP_LONG,
+            [OP_ARRAY_LONG] = &&TARGET_OP_ARRAY_LONG,
+            [OP_CALL_LONG] = &&TARGET_OP_CALL_LONG,
+            [OP_TAIL_CALL_LONG] = &&TARGET_OP_TAIL_CALL_LONG,
+            [OP_INVOKE_LONG] = &&TARGET_OP_INVOKE_LONG,
+            [OP_TAIL_INVOKE_LONG] = &&TARGET_OP_TAIL_INVOKE_LONG,
+            [OP_INVOKE_SUPER_LONG] = &&TARGET_OP_INVOKE_SUPER_LONG,
+            [OP_TAIL_INVOKE_SUPER_LONG] = &&TARGET_OP_TAIL_INVOKE_SUPER_LONG,
+    };
+
+// Every handler jumps straight to the next one, so each opcode gets its own indirect branch to predict.
+#define CASE(opcode) case opcode: TARGET_##opcode
+#define DISPATCH() \
+    do {           \
+        TRACE_INSTRUCTION(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while(false)
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() break
+#endif
+
+    for (;;) {
+        TRACE_INSTRUCTION();
+        COUNT_INSTRUCTION();
+        switch (READ_BYTE()) {
+            CASE(OP_CONSTANT): {
+                PUSH(READ_CONSTANT());
+                DISPATCH();
             }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_DUPLICATE:
-                push(peek(0));
-                break;
-            case OP_POP:
-                pop(1);
-                break;
-            case OP_POPN:
-                pop(READ_SHORT());
-                break;
-            case OP_GET_GLOBAL: {
+            CASE(OP_NIL):
+                PUSH(NIL_VAL);
+                DISPATCH();
+            CASE(OP_TRUE):
+                PUSH(BOOL_VAL(true));
+                DISPATCH();
+            CASE(OP_FALSE):
+                PUSH(BOOL_VAL(false));
+                DISPATCH();
+            CASE(OP_DUPLICATE):
+                PUSH(PEEK(0));
+                DISPATCH();
+            CASE(OP_POP):
+                POPN(1);
+                DISPATCH();
+            CASE(OP_POPN):
+                POPN(READ_SHORT());
+                DISPATCH();
+            CASE(OP_GET_GLOBAL): {
                 uint16_t variableIndex = READ_SHORT();
                 Value *globals = buffer.globalVars.values;
                 if (IS_UNDEFINED(globals[variableIndex])) {
-                    frame->ip = ip;
                     ObjString *varName = AS_STRING(globals[variableIndex - 1]);
-                    runtimeError("Undefined variable '%.*s'.", varName->length, varName->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", varName->length, varName->chars);
                 }
 
+                // Globals can't be undefined again once defined, so the quickened variant doesn't check at all.
+                QUICKEN(3, OP_GET_GLOBAL_DEFINED);
                 Value value = globals[variableIndex];
-                push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             }
-            case OP_SET_GLOBAL: {
+            CASE(OP_GET_GLOBAL_DEFINED):
+                PUSH(buffer.globalVars.values[READ_SHORT()]);
+                DISPATCH();
+            CASE(OP_SET_GLOBAL): {
                 uint16_t variableIndex = READ_SHORT();
                 Value *globals = buffer.globalVars.values;
 
                 if (IS_UNDEFINED(globals[variableIndex])) {
-                    frame->ip = ip;
                     ObjString *varName = AS_STRING(globals[variableIndex - 1]);
-                    runtimeError("Undefined variable '%.*s'.", varName->length, varName->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", varName->length, varName->chars);
                 }
 
-                globals[variableIndex] = peek(0);
-                break;
+                globals[variableIndex] = PEEK(0);
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
+            CASE(OP_DEFINE_GLOBAL): {
                 uint16_t variableIndex = READ_SHORT();
-                buffer.globalVars.values[variableIndex] = peek(0);
-                pop(1);
-                break;
+                buffer.globalVars.values[variableIndex] = POP();
+                DISPATCH();
             }
-            case OP_GET_LOCAL: {
+            CASE(OP_GET_LOCAL): {
                 uint16_t slot = READ_SHORT();
-                push(frame->slots[slot]);
-                break;
+                PUSH(slots[slot]);
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL): {
                 uint16_t slot = READ_SHORT();
-                frame->slots[slot] = peek(0);
-                break;
+                slots[slot] = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE): {
                 uint16_t slot = READ_SHORT();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE): {
                 uint16_t slot = READ_SHORT();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                *frame->closure->upvalues[slot]->location = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_ENCLOSING): {
+                uint16_t slot = READ_SHORT();
+                PUSH(frame[-1].slots[slot]);
+                DISPATCH();
+            }
+            CASE(OP_SET_ENCLOSING): {
+                uint16_t slot = READ_SHORT();
+                frame[-1].slots[slot] = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_GET_CAPTURED): {
+                uint16_t slot = READ_SHORT();
+                PUSH(frame->closure->values[slot]);
+                DISPATCH();
+            }
+            CASE(OP_GET_PROPERTY): {
+                if (!IS_INSTANCE(PEEK(0))) {
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
-                ObjInstance *instance = AS_INSTANCE(peek(0));
+                ObjInstance *instance = AS_INSTANCE(PEEK(0));
                 ObjString *name = AS_STRING(READ_CONSTANT());
+                InlineCache *cache = &caches[READ_SHORT()];
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(1);
-                    push(value);
-                    break;
+                bool isMethod;
+                if (!findProperty(cache, instance, name, &value, &isMethod)) {
+                    RUNTIME_ERROR("Undefined property '%.*s'.", name->length, name->chars);
                 }
 
-                if (!bindMethod(instance->klass, name)) {
-                    frame->ip = ip;
-                    runtimeError("Undefined property '%.*s'.", name->length, name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if (isMethod) {
+                    STORE_STACK();
+                    value = OBJ_VAL(newBoundMethod(PEEK(0), AS_CLOSURE(value)));
                 }
-                break;
+                PEEK(0) = value;
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    frame->ip = ip;
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_PROPERTY): {
+                if (!IS_INSTANCE(PEEK(1))) {
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, AS_STRING(READ_CONSTANT()), peek(0));
-                Value value = pop(1);
-                pop(1);
-                push(value);
-                break;
+                ObjInstance *instance = AS_INSTANCE(PEEK(1));
+                ObjString *name = AS_STRING(READ_CONSTANT());
+                InlineCache *cache = &caches[READ_SHORT()];
+                STORE_STACK();
+                storeProperty(cache, instance, name, PEEK(0));
+                Value value = POP();
+                PEEK(0) = value;
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
+            CASE(OP_GET_SUPER): {
                 ObjString *name = AS_STRING(READ_CONSTANT());
-                ObjClass *superclass = AS_CLASS(pop(1));
+                ObjClass *superclass = AS_CLASS(POP());
 
+                STORE_STACK();
                 if (!bindMethod(superclass, name)) {
-                    frame->ip = ip;
-                    runtimeError("Undefined super property '%.*s'.", name->length, name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined super property '%.*s'.", name->length, name->chars);
                 }
-                break;
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop(1);
-                Value a = pop(1);
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            CASE(OP_EQUAL): {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                DISPATCH();
             }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >, double);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <, double);
-                break;
-            case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+            CASE(OP_GREATER):
+                BINARY_OP(BOOL_VAL, >, double, OP_GREATER_NUM);
+                DISPATCH();
+            CASE(OP_GREATER_NUM):
+                NUMBER_OP(BOOL_VAL, >, double, OP_GREATER);
+                DISPATCH();
+            CASE(OP_LESS):
+                BINARY_OP(BOOL_VAL, <, double, OP_LESS_NUM);
+                DISPATCH();
+            CASE(OP_LESS_NUM):
+                NUMBER_OP(BOOL_VAL, <, double, OP_LESS);
+                DISPATCH();
+            CASE(OP_NOT_EQUAL): {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(!valuesEqual(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_GREATER_EQUAL):
+                BINARY_OP(NOT_BOOL_VAL, <, double, OP_GREATER_EQUAL_NUM);
+                DISPATCH();
+            CASE(OP_GREATER_EQUAL_NUM):
+                NUMBER_OP(NOT_BOOL_VAL, <, double, OP_GREATER_EQUAL);
+                DISPATCH();
+            CASE(OP_LESS_EQUAL):
+                BINARY_OP(NOT_BOOL_VAL, >, double, OP_LESS_EQUAL_NUM);
+                DISPATCH();
+            CASE(OP_LESS_EQUAL_NUM):
+                NUMBER_OP(NOT_BOOL_VAL, >, double, OP_LESS_EQUAL);
+                DISPATCH();
+            CASE(OP_ADD_LOCALS): {
+                Value a = slots[READ_SHORT()];
+                Value b = slots[READ_SHORT()];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    PUSH(a);
+                    PUSH(b);
+                    STORE_STACK();
                     concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop(1));
-                    double a = AS_NUMBER(pop(1));
-                    push(NUMBER_VAL(a + b));
+                    LOAD_STACK();
                 } else {
-                    frame->ip = ip;
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -, double);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *, double);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /, double);
-                break;
-            case OP_MODULO:
-                BINARY_OP(NUMBER_VAL, %, int);
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop(1))));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                DISPATCH();
+            }
+            CASE(OP_ADD):
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                    STORE_STACK();
+                    concatenate();
+                    LOAD_STACK();
+                } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    QUICKEN(1, OP_ADD_NUM);
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop(1))));
-                break;
-            case OP_PRINT:
-                printValue(pop(1));
+                DISPATCH();
+            CASE(OP_ADD_NUM):
+                NUMBER_OP(NUMBER_VAL, +, double, OP_ADD);
+                DISPATCH();
+            CASE(OP_SUBTRACT):
+                BINARY_OP(NUMBER_VAL, -, double, OP_SUBTRACT_NUM);
+                DISPATCH();
+            CASE(OP_SUBTRACT_NUM):
+                NUMBER_OP(NUMBER_VAL, -, double, OP_SUBTRACT);
+                DISPATCH();
+            CASE(OP_MULTIPLY):
+                BINARY_OP(NUMBER_VAL, *, double, OP_MULTIPLY_NUM);
+                DISPATCH();
+            CASE(OP_MULTIPLY_NUM):
+                NUMBER_OP(NUMBER_VAL, *, double, OP_MULTIPLY);
+                DISPATCH();
+            CASE(OP_DIVIDE):
+                BINARY_OP(NUMBER_VAL, /, double, OP_DIVIDE_NUM);
+                DISPATCH();
+            CASE(OP_DIVIDE_NUM):
+                NUMBER_OP(NUMBER_VAL, /, double, OP_DIVIDE);
+                DISPATCH();
+            CASE(OP_MODULO):
+                BINARY_OP(NUMBER_VAL, %, int, OP_MODULO_NUM);
+                DISPATCH();
+            CASE(OP_MODULO_NUM):
+                NUMBER_OP(NUMBER_VAL, %, int, OP_MODULO);
+                DISPATCH();
+            CASE(OP_NOT):
+                PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+                DISPATCH();
+            CASE(OP_NEGATE):
+                if (!IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+                DISPATCH();
+            CASE(OP_PRINT):
+                printValue(POP());
                 printf("\n");
-                break;
-            case OP_JUMP: {
+                DISPATCH();
+            CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
                 ip += offset;
-                break;
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                ip += isFalsey(peek(0)) * offset;
-                break;
+                ip += isFalsey(PEEK(0)) * offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_JUMP_IF_NOT_LESS): {
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                ip += !(a < b) * offset;
+                DISPATCH();
+            }
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_SHORT();
                 ip -= offset;
-                break;
+                TRACE_ENTER();
+                JIT_ENTER();
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(OP_SWITCH): {
+                // Native code leaves the lookup to the interpreter and carries on at the case.
+                Chunk *chunk = &frame->closure->function->chunk;
+                ip = chunk->code + switchTarget(&chunk->switches[READ_SHORT()], PEEK(0));
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_CALL): {
                 uint8_t argCount = READ_BYTE();
-                frame->ip = ip;
-                if (!callValue(peek(argCount), argCount)) {
+                STORE_FRAME();
+                if (!callValue(PEEK(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_CALL): {
+                uint8_t argCount = READ_BYTE();
+                STORE_FRAME();
+                if (!tailCall(PEEK(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
             }
-            case OP_INVOKE: {
+            CASE(OP_INVOKE): {
                 ObjString *method = AS_STRING(READ_CONSTANT());
                 int argCount = READ_BYTE();
-                frame->ip = ip;
-                if (!invoke(method, argCount)) {
+                InlineCache *cache = &caches[READ_SHORT()];
+                STORE_FRAME();
+                if (!invoke(method, argCount, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_INVOKE): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_BYTE();
+                InlineCache *cache = &caches[READ_SHORT()];
+                STORE_FRAME();
+                if (!tailInvoke(method, argCount, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
             }
-            case OP_INVOKE_SUPER: {
+            CASE(OP_INVOKE_SUPER): {
                 ObjString *method = AS_STRING(READ_CONSTANT());
                 int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop(1));
-                frame->ip = ip;
+                ObjClass *superclass = AS_CLASS(POP());
+                STORE_FRAME();
                 if (!invokeFromClass(superclass, method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
             }
-            case OP_CLOSURE: {
+            CASE(OP_TAIL_INVOKE_SUPER): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_BYTE();
+                ObjClass *superclass = AS_CLASS(POP());
+                STORE_FRAME();
+                if (!tailInvokeFromClass(superclass, method, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_CLOSURE): {
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+                STORE_STACK();
                 ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                PUSH(OBJ_VAL(closure));
+                STORE_STACK();
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
-                    closure->upvalues[i] = isLocal ? captureUpvalue(frame->slots + index)
-                                                   : frame->closure->upvalues[index];
+                    switch (isLocal) {
+                        case 0:
+                            closure->upvalues[i] = frame->closure->upvalues[index];
+                            break;
+                        case 1:
+                            closure->upvalues[i] = captureUpvalue(slots + index);
+                            break;
+                        case UPVALUE_COPY_LOCAL:
+                            closure->values[i] = slots[index];
+                            break;
+                        case UPVALUE_COPY_VALUE:
+                            closure->values[i] = frame->closure->values[index];
+                            break;
+                        default:
+                            break;
+                    }
                 }
-                break;
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop(1);
-                break;
-            case OP_RETURN: {
-                Value result = pop(1);
-                closeUpvalues(frame->slots);
+            CASE(OP_CLOSE_UPVALUE):
+                closeUpvalues(sp - 1);
+                POPN(1);
+                DISPATCH();
+            CASE(OP_RETURN): {
+                Value result = POP();
+                closeUpvalues(slots);
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
-                    pop(1); // pop script function at the bottom of the stack
+                    POPN(1); // pop script function at the bottom of the stack
+                    STORE_STACK();
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                sp = slots;
+                PUSH(result);
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
+            CASE(OP_INHERIT): {
+                Value superclass = PEEK(1);
 
                 if (!IS_CLASS(superclass)) {
-                    frame->ip = ip;
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
 
-                ObjClass *subclass = AS_CLASS(peek(0));
+                ObjClass *subclass = AS_CLASS(PEEK(0));
+                STORE_STACK();
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(1);
-                break;
+                POPN(1);
+                DISPATCH();
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(AS_STRING(READ_CONSTANT()))));
-                break;
+            CASE(OP_CLASS): {
+                STORE_STACK();
+                ObjClass *klass = newClass(AS_STRING(READ_CONSTANT()));
+                PUSH(OBJ_VAL(klass));
+                DISPATCH();
             }
-            case OP_METHOD:
+            CASE(OP_METHOD):
+                STORE_STACK();
                 if (!defineMethod(AS_STRING(READ_CONSTANT()))) {
-                    frame->ip = ip;
-                    runtimeError("class initializer redeclared.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("class initializer redeclared.");
                 }
-                break;
-            case OP_ARRAY: {
+                LOAD_STACK();
+                DISPATCH();
+            CASE(OP_ARRAY): {
                 uint16_t elements = READ_SHORT();
-                Value array = OBJ_VAL(newArray(vm.stackTop - elements, elements));
-                pop(elements);
-                push(array);
-                break;
+                STORE_STACK();
+                Value array = OBJ_VAL(newArray(sp - elements, elements));
+                POPN(elements);
+                PUSH(array);
+                DISPATCH();
             }
-            case OP_ARRAY_GET: {
-                Value index = pop(1);
-                ObjArray *objArray = AS_ARRAY(pop(1));
+            CASE(OP_ARRAY_GET): {
+                Value index = POP();
+                Value array = POP();
+                ObjArray *objArray = AS_ARRAY(array);
                 VALIDATE_ARRAY_INDEX(index, objArray);
-                push(objArray->values[(int) AS_NUMBER(index)]);
-                break;
+                if (IS_ARRAY(array)) {
+                    QUICKEN(1, OP_ARRAY_GET_NUM);
+                }
+                PUSH(objArray->values[(int) AS_NUMBER(index)]);
+                DISPATCH();
             }
-            case OP_ARRAY_SET: {
-                Value value = pop(1);
-                Value index = pop(1);
-                ObjArray *objArray = AS_ARRAY(pop(1));
+            CASE(OP_ARRAY_GET_NUM): {
+                if (!IS_ARRAY(PEEK(1)) || !IS_NUMBER(PEEK(0))) {
+                    DEQUICKEN(1, OP_ARRAY_GET);
+                }
+                ObjArray *objArray = AS_ARRAY(PEEK(1));
+                double index = AS_NUMBER(PEEK(0));
+                // Anything the generic instruction would complain about goes back to it for the error message.
+                if (!(index >= 0 && index < objArray->count) || index != (int) index) {
+                    DEQUICKEN(1, OP_ARRAY_GET);
+                }
+                POPN(1);
+                PEEK(0) = objArray->values[(int) index];
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_SET): {
+                Value value = POP();
+                Value index = POP();
+                Value array = POP();
+                ObjArray *objArray = AS_ARRAY(array);
                 VALIDATE_ARRAY_INDEX(index, objArray);
+                if (IS_ARRAY(array)) {
+                    QUICKEN(1, OP_ARRAY_SET_NUM);
+                }
                 objArray->values[(int) AS_NUMBER(index)] = value;
-                push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_SET_NUM): {
+                if (!IS_ARRAY(PEEK(2)) || !IS_NUMBER(PEEK(1))) {
+                    DEQUICKEN(1, OP_ARRAY_SET);
+                }
+                ObjArray *objArray = AS_ARRAY(PEEK(2));
+                double index = AS_NUMBER(PEEK(1));
+                if (!(index >= 0 && index < objArray->count) || index != (int) index) {
+                    DEQUICKEN(1, OP_ARRAY_SET);
+                }
+                Value value = POP();
+                POPN(1);
+                objArray->values[(int) index] = value;
+                PEEK(0) = value;
+                DISPATCH();
+            }
+            CASE(OP_MOVE): {
+                uint16_t destination = READ_SHORT();
+                slots[destination] = READ_REGISTER();
+                DISPATCH();
+            }
+            CASE(OP_ADD_REGISTERS): {
+                uint16_t destination = READ_SHORT();
+                Value a = READ_REGISTER();
+                Value b = READ_REGISTER();
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    slots[destination] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    PUSH(a);
+                    PUSH(b);
+                    STORE_STACK();
+                    concatenate();
+                    LOAD_STACK();
+                    slots[destination] = POP();
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_REGISTERS):
+                REGISTER_OP(-);
+                DISPATCH();
+            CASE(OP_MULTIPLY_REGISTERS):
+                REGISTER_OP(*);
+                DISPATCH();
+            CASE(OP_DIVIDE_REGISTERS):
+                REGISTER_OP(/);
+                DISPATCH();
+            CASE(OP_ADD_UNCHECKED):
+                UNCHECKED_OP(NUMBER_VAL, +);
+                DISPATCH();
+            CASE(OP_SUBTRACT_UNCHECKED):
+                UNCHECKED_OP(NUMBER_VAL, -);
+                DISPATCH();
+            CASE(OP_MULTIPLY_UNCHECKED):
+                UNCHECKED_OP(NUMBER_VAL, *);
+                DISPATCH();
+            CASE(OP_DIVIDE_UNCHECKED):
+                UNCHECKED_OP(NUMBER_VAL, /);
+                DISPATCH();
+            CASE(OP_GREATER_UNCHECKED):
+                UNCHECKED_OP(BOOL_VAL, >);
+                DISPATCH();
+            CASE(OP_LESS_UNCHECKED):
+                UNCHECKED_OP(BOOL_VAL, <);
+                DISPATCH();
+            CASE(OP_GREATER_EQUAL_UNCHECKED):
+                UNCHECKED_OP(NOT_BOOL_VAL, <);
+                DISPATCH();
+            CASE(OP_LESS_EQUAL_UNCHECKED):
+                UNCHECKED_OP(NOT_BOOL_VAL, >);
+                DISPATCH();
+            CASE(OP_ADD_LOCALS_UNCHECKED): {
+                double a = AS_NUMBER(slots[READ_SHORT()]);
+                double b = AS_NUMBER(slots[READ_SHORT()]);
+                PUSH(NUMBER_VAL(a + b));
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_LESS_UNCHECKED): {
+                uint16_t offset = READ_SHORT();
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                ip += !(a < b) * offset;
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_GET_UNCHECKED): {
+                double index = AS_NUMBER(PEEK(0));
+                if (!IS_ARRAY(PEEK(1)) || !(index >= 0 && index < AS_ARRAY(PEEK(1))->count)) {
+                    DEQUICKEN(1, OP_ARRAY_GET);
+                }
+                POPN(1);
+                PEEK(0) = AS_ARRAY(PEEK(0))->values[(int) index];
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_SET_UNCHECKED): {
+                double index = AS_NUMBER(PEEK(1));
+                if (!IS_ARRAY(PEEK(2)) || !(index >= 0 && index < AS_ARRAY(PEEK(2))->count)) {
+                    DEQUICKEN(1, OP_ARRAY_SET);
+                }
+                Value value = POP();
+                POPN(1);
+                AS_ARRAY(PEEK(0))->values[(int) index] = value;
+                PEEK(0) = value;
+                DISPATCH();
+            }
+            CASE(OP_ADD_REGISTERS_UNCHECKED):
+                UNCHECKED_REGISTER_OP(+);
+                DISPATCH();
+            CASE(OP_SUBTRACT_REGISTERS_UNCHECKED):
+                UNCHECKED_REGISTER_OP(-);
+                DISPATCH();
+            CASE(OP_MULTIPLY_REGISTERS_UNCHECKED):
+                UNCHECKED_REGISTER_OP(*);
+                DISPATCH();
+            CASE(OP_DIVIDE_REGISTERS_UNCHECKED):
+                UNCHECKED_REGISTER_OP(/);
+                DISPATCH();
+            CASE(OP_GET_GLOBAL_LONG): {
+                uint32_t variableIndex = READ_LONG();
+                Value *globals = buffer.globalVars.values;
+                if (IS_UNDEFINED(globals[variableIndex])) {
+                    ObjString *varName = AS_STRING(globals[variableIndex - 1]);
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", varName->length, varName->chars);
+                }
+                PUSH(globals[variableIndex]);
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL_LONG): {
+                uint32_t variableIndex = READ_LONG();
+                Value *globals = buffer.globalVars.values;
+                if (IS_UNDEFINED(globals[variableIndex])) {
+                    ObjString *varName = AS_STRING(globals[variableIndex - 1]);
+                    RUNTIME_ERROR("Undefined variable '%.*s'.", varName->length, varName->chars);
+                }
+                globals[variableIndex] = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_DEFINE_GLOBAL_LONG): {
+                uint32_t variableIndex = READ_LONG();
+                buffer.globalVars.values[variableIndex] = POP();
+                DISPATCH();
+            }
+            CASE(OP_JUMP_LONG): {
+                uint32_t offset = READ_LONG();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_LOOP_LONG): {
+                uint32_t offset = READ_LONG();
+                ip -= offset;
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_LONG): {
+                uint32_t elements = READ_LONG();
+                STORE_STACK();
+                Value array = OBJ_VAL(newArray(sp - elements, elements));
+                POPN(elements);
+                PUSH(array);
+                DISPATCH();
+            }
+            CASE(OP_CALL_LONG): {
+                uint16_t argCount = READ_SHORT();
+                STORE_FRAME();
+                if (!callValue(PEEK(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_CALL_LONG): {
+                uint16_t argCount = READ_SHORT();
+                STORE_FRAME();
+                if (!tailCall(PEEK(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_INVOKE_LONG): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_SHORT();
+                InlineCache *cache = &caches[READ_SHORT()];
+                STORE_FRAME();
+                if (!invoke(method, argCount, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_INVOKE_LONG): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_SHORT();
+                InlineCache *cache = &caches[READ_SHORT()];
+                STORE_FRAME();
+                if (!tailInvoke(method, argCount, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_INVOKE_SUPER_LONG): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_SHORT();
+                ObjClass *superclass = AS_CLASS(POP());
+                STORE_FRAME();
+                if (!invokeFromClass(superclass, method, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_INVOKE_SUPER_LONG): {
+                ObjString *method = AS_STRING(READ_CONSTANT());
+                int argCount = READ_SHORT();
+                ObjClass *superclass = AS_CLASS(POP());
+                STORE_FRAME();
+                if (!tailInvokeFromClass(superclass, method, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_STACK();
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
             }
         }
     }
@@ -806,13 +1771,34 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_LONG
 #undef READ_CONSTANT
+#undef PUSH
+#undef POP
+#undef POPN
+#undef PEEK
+#undef STORE_STACK
+#undef LOAD_STACK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEQUICKEN
+#undef NOT_BOOL_VAL
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef READ_REGISTER
+#undef REGISTER_OP
+#undef UNCHECKED_OP
+#undef UNCHECKED_REGISTER_OP
+#undef VALIDATE_ARRAY_INDEX
+#undef JIT_ENTER
+#undef TRACE_ENTER
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+static InterpretResult runScript(ObjFunction *function) {
     push(OBJ_VAL(function));
     ObjClosure *closure = newClosure(function);
     pop(1);
@@ -820,4 +1806,16 @@ InterpretResult interpret(const char *source) {
     call(closure, 0);
 
     return run();
+}
+
+InterpretResult interpret(const char *source) {
+    ObjFunction *function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
+}
+
+InterpretResult interpretBytecode(const uint8_t *data, size_t size) {
+    ObjFunction *function = readBytecode(data, size);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
 }
\ No newline at end of file
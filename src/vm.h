@@ -2,8 +2,20 @@
 #define CLOX_VM_H
 
 
-#define FRAMES_MAX 64
+// Both stacks start small and double whenever they fill up, until they reach these limits.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 4096
+#endif
+#ifndef STACK_MAX
 #define STACK_MAX (FRAMES_MAX * (UINT8_MAX + 1))
+#endif
+
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+
+// Slots kept free above the part of the stack run() pushes into, so the temporaries C code pushes to keep
+// objects from the GC never make the stack move under the pointers run() caches.
+#define STACK_RESERVE 16
 
 #include "chunk.h"
 #include "value.h"
@@ -17,16 +29,44 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
+    // Where run() grows the stack, STACK_RESERVE slots short of its end.
+    Value *stackLimit;
+    int stackCapacity;
     Table strings;
     ObjString *initString;
     Obj *objects;
     ObjUpvalue *openUpvalues;
 
+    // Cleared by --no-jit, only used when built with the JIT.
+    bool jit;
+    // Cleared by --no-registers, the compiler then leaves every statement on the stack.
+    bool registers;
+    // Cleared by --no-inline and by the REPL, where a later line could reassign a function an earlier one
+    // got inlined into.
+    bool inlining;
+    // Set by --lazy: functions declared at the top level of a script get their bodies compiled on their first
+    // call, so a library pays only for what a program uses. Errors in a body only show up then. Nothing gets
+    // inlined, callees aren't compiled yet when their callers are.
+    bool lazyCompilation;
+    // Passes the compiler runs over every function, set with -O0, -O1 or -O2 (see optimizer.h).
+    int optimizationLevel;
+
+    size_t cacheHits;
+    size_t cacheMisses;
+    // Instructions run, counted with DEBUG_LOG_DISPATCH.
+    size_t dispatches;
+    // Constants the compiler and the optimizer asked for, those that reused an identical one already in the
+    // chunk, and the bytes taken by the lookup tables doing that, counted with DEBUG_LOG_CONSTANTS.
+    size_t constantsAdded;
+    size_t constantsShared;
+    size_t constantIndexBytes;
+
     size_t bytesAllocated;
     size_t nextGC;
 
@@ -49,6 +89,19 @@ void freeVM();
 
 InterpretResult interpret(const char *source);
 
+// Runs the script of a .loxc file (see bytecode.h) mapped at data.
+InterpretResult interpretBytecode(const uint8_t *data, size_t size);
+
+void useJit(bool enabled);
+
+void useRegisters(bool enabled);
+
+void useInlining(bool enabled);
+
+void useLazyCompilation(bool enabled);
+
+void setOptimizationLevel(int level);
+
 void push(Value value);
 
 Value pop(uint16_t count);
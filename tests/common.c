@@ -2,9 +2,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "common.h"
+#include "../src/bytecode.h"
 #include "../src/compiler.h"
 #include "unity.h"
 
+static void (*configureVM)() = NULL;
+static InterpretResult (*interpretProgram)(const char *source) = interpret;
+static uint8_t *bytecode = NULL;
+static const char *snapshotPrelude = NULL;
+static void (*corruptScript)(ObjFunction *script) = NULL;
+
+// Reads the file at path into bytecode, which strings loaded from it point into until the VM is freed.
+static size_t readBack(char *path) {
+    FILE *file = fopen(path, "rb");
+    fseek(file, 0L, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+    bytecode = malloc(size);
+    fread(bytecode, 1, size, file);
+    fclose(file);
+    remove(path);
+    return size;
+}
+
+// Compiles source to a .loxc file, then runs that in a VM of its own.
+static InterpretResult interpretThroughBytecode(const char *source) {
+    ObjFunction *script = compile(source);
+    if (script == NULL) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+    if (corruptScript != NULL) {
+        corruptScript(script);
+    }
+    char path[] = "/tmp/clox_testXXXXXX";
+    close(mkstemp(path));
+    writeBytecode(script, path);
+    freeVM();
+    initVM();
+
+    size_t size = readBack(path);
+    return interpretBytecode(bytecode, size);
+}
+
+// Runs the prelude, snapshots the globals it left and runs source in a VM restored from that. The prelude
+// gets compiled the way clox --snapshot does it.
+static InterpretResult interpretThroughSnapshot(const char *source) {
+    useInlining(false);
+    InterpretResult result = interpret(snapshotPrelude);
+    if (result != INTERPRET_OK) {
+        return result;
+    }
+    char path[] = "/tmp/clox_testXXXXXX";
+    close(mkstemp(path));
+    writeSnapshot(path);
+    freeVM();
+    initVM();
+
+    size_t size = readBack(path);
+    if (!readSnapshot(bytecode, size)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return interpret(source);
+}
+
 static bool interpretTest(const char *source, char *buffer, int buffLen) {
     fflush(stdout);
     fflush(stderr);
@@ -24,8 +84,13 @@ static bool interpretTest(const char *source, char *buffer, int buffLen) {
     close(errPipedes[1]);
 
     initVM();
-    InterpretResult result = interpret(source);
+    if (configureVM != NULL) {
+        configureVM();
+    }
+    InterpretResult result = interpretProgram(source);
     freeVM();
+    free(bytecode);
+    bytecode = NULL;
 
     fflush(stdout);
     fflush(stderr);
@@ -56,6 +121,32 @@ void testExpressions(const char *cases[][2], int length) {
     }
 }
 
+void testProgramsWith(void (*configure)(), const char *cases[][2], int length) {
+    configureVM = configure;
+    testPrograms(cases, length);
+    configureVM = NULL;
+}
+
+void testBytecodePrograms(const char *cases[][2], int length) {
+    interpretProgram = interpretThroughBytecode;
+    testPrograms(cases, length);
+    interpretProgram = interpret;
+}
+
+void testCorruptedBytecodePrograms(void (*corrupt)(ObjFunction *script), const char *cases[][2], int length) {
+    corruptScript = corrupt;
+    testBytecodePrograms(cases, length);
+    corruptScript = NULL;
+}
+
+void testSnapshotPrograms(const char *prelude, const char *cases[][2], int length) {
+    interpretProgram = interpretThroughSnapshot;
+    snapshotPrelude = prelude;
+    testPrograms(cases, length);
+    interpretProgram = interpret;
+    snapshotPrelude = NULL;
+}
+
 void testPrograms(const char *cases[][2], int length) {
     for (int i = 0; i < length; i++) {
         char buffer[2048] = {0}, testError[256] = {0};
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include "../src/object.h"
+
 #define TEST_EXPRESSIONS(cases) \
     do {                        \
         testExpressions(cases, sizeof(cases) / sizeof(cases[0])); \
@@ -13,9 +15,41 @@
         testPrograms(cases, sizeof(cases) / sizeof(cases[0])); \
     } while(false)           \
 
+// Runs the programs from the .loxc files they compile to.
+#define TEST_BYTECODE_PROGRAMS(cases) \
+    do {                     \
+        testBytecodePrograms(cases, sizeof(cases) / sizeof(cases[0])); \
+    } while(false)           \
+
+// Runs the programs from .loxc files written after corrupt changed their compiled scripts.
+#define TEST_CORRUPTED_BYTECODE_PROGRAMS(corrupt, cases) \
+    do {                     \
+        testCorruptedBytecodePrograms(corrupt, cases, sizeof(cases) / sizeof(cases[0])); \
+    } while(false)           \
+
+// Runs the programs in VMs restored from a snapshot of the globals prelude left.
+#define TEST_SNAPSHOT_PROGRAMS(prelude, cases) \
+    do {                     \
+        testSnapshotPrograms(prelude, cases, sizeof(cases) / sizeof(cases[0])); \
+    } while(false)           \
+
+// Runs the programs with the VM set up by configure first.
+#define TEST_PROGRAMS_WITH(configure, cases) \
+    do {                     \
+        testProgramsWith(configure, cases, sizeof(cases) / sizeof(cases[0])); \
+    } while(false)           \
+
 
 void testExpressions(const char *cases[][2], int length);
 
 void testPrograms(const char *cases[][2], int length);
 
+void testProgramsWith(void (*configure)(), const char *cases[][2], int length);
+
+void testBytecodePrograms(const char *cases[][2], int length);
+
+void testCorruptedBytecodePrograms(void (*corrupt)(ObjFunction *script), const char *cases[][2], int length);
+
+void testSnapshotPrograms(const char *prelude, const char *cases[][2], int length);
+
 #endif //COMMON_H
\ No newline at end of file
@@ -214,6 +214,87 @@ void testClassInheritance() {
     TEST_PROGRAMS(cases);
 }
 
+void testClassPropertySites() {
+    const char *program1 = "class A { name() { return \"A\"; } }"
+                           "class B { name() { return \"B\"; } }"
+                           "class C { name() { return \"C\"; } }"
+                           "class D { name() { return \"D\"; } }"
+                           "class E { name() { return \"E\"; } }"
+                           "fun describe(object) {"
+                           "    print object.name() + str(object.size);"
+                           "}"
+                           "var objects = [A(), B(), C(), D(), E(), A(), E()];"
+                           "for (var i = 0; i < 7; i = i + 1) {"
+                           "    objects[i].size = i;"
+                           "    describe(objects[i]);"
+                           "}";
+
+    const char *program2 = "class Box {"
+                           "    name() { return \"method\"; }"
+                           "}"
+                           "fun get(box) { return box.name; }"
+                           "var box = Box();"
+                           "box.value = 1;"
+                           "print get(box);"
+                           "box.name = \"field\";"
+                           "print get(box);"
+                           "print box.name;"
+                           "deleteField(box, \"name\");"
+                           "print box.name();"
+                           "box.a = 1; box.b = 2; box.c = 3; box.d = 4; box.e = 5; box.name = \"again\";"
+                           "print get(box);";
+
+    const char *cases[][2] = {
+            {program1, "A0\nB1\nC2\nD3\nE4\nA5\nE6\n"},
+            {program2, "<fn name>\nfield\nfield\nmethod\nagain\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testClassShapes() {
+    const char *program1 = "class Point {}"
+                           "var a = Point();"
+                           "a.x = 1; a.y = 2;"
+                           "var b = Point();"
+                           "b.y = 3; b.x = 4;"
+                           "print a.x + a.y;"
+                           "print b.x - b.y;"
+                           "a.x = 10;"
+                           "print a.x + b.x;";
+
+    const char *program2 = "class Bag {}"
+                           "var bag = Bag();"
+                           "bag.a = 1; bag.b = 2; bag.c = 3;"
+                           "deleteField(bag, \"b\");"
+                           "print getField(bag, \"a\") + bag.c;"
+                           "bag.b = 20;"
+                           "print bag.a + bag.b + bag.c;"
+                           "var other = Bag();"
+                           "other.a = 5; other.b = 6; other.c = 7;"
+                           "print other.a + other.b + other.c;"
+                           "deleteField(other, \"missing\");"
+                           "print other.b;";
+
+    const char *program3 = "class Wide {}"
+                           "var wide = Wide();"
+                           "for (var i = 0; i < 100; i = i + 1) {"
+                           "    setField(wide, \"f\" + str(i), i);"
+                           "}"
+                           "var sum = 0;"
+                           "for (var i = 0; i < 100; i = i + 1) {"
+                           "    sum = sum + getField(wide, \"f\" + str(i));"
+                           "}"
+                           "print sum;"
+                           "print wide.f99;";
+
+    const char *cases[][2] = {
+            {program1, "3\n1\n14\n"},
+            {program2, "4\n24\n18\n6\n"},
+            {program3, "4950\n99\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
 void setUp() {
 
 }
@@ -229,5 +310,7 @@ int main() {
     RUN_TEST(testClassThis);
     RUN_TEST(testClassMethod);
     RUN_TEST(testClassInheritance);
+    RUN_TEST(testClassPropertySites);
+    RUN_TEST(testClassShapes);
     return UNITY_END();
 }
\ No newline at end of file
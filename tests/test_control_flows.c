@@ -26,9 +26,31 @@ void testIfStatement() {
                            "    print 3;"
                            "}";
 
+    const char *program3 = "fun check(a, b) {"
+                           "    if (a < b) {"
+                           "        print \"less\";"
+                           "    } else {"
+                           "        print \"not less\";"
+                           "    }"
+                           "    if (a > 0 and a < b) {"
+                           "        print \"both\";"
+                           "    } else {"
+                           "        print \"neither\";"
+                           "    }"
+                           "    print a + b;"
+                           "}"
+                           "check(1, 2);"
+                           "check(3, 2);"
+                           "check(-1, 2);"
+                           "fun join(a, b) {"
+                           "    return a + b;"
+                           "}"
+                           "print join(\"cl\", \"ox\");";
+
     const char *cases[][2] = {
             {program1, "2\n5\n"},
             {program2, "3\n"},
+            {program3, "less\nboth\n3\nnot less\nneither\n5\nless\nneither\n1\nclox\n"},
     };
     TEST_PROGRAMS(cases);
 }
@@ -193,6 +215,43 @@ void testForStatement() {
     TEST_PROGRAMS(cases);
 }
 
+void testLoopVariableCopies() {
+    const char *program1 = "var fs = [];"
+                           "for (var i = 0; i < 3; i = i + 1) {"
+                           "    fun f() { return i; }"
+                           "    append(fs, f);"
+                           "}"
+                           "for (var i = 0; i < 3; i = i + 1) {"
+                           "    print fs[i]();"
+                           "}";
+
+    const char *program2 = "fun h() {"
+                           "    var a = \"a\";"
+                           "    for (var i = 0; i < 10; i = i + 1) {"
+                           "        fun g() { return i; }"
+                           "        if (i == 2) { i = 6; continue; }"
+                           "        if (i == 8) break;"
+                           "        print g();"
+                           "    }"
+                           "    var b = \"b\";"
+                           "    print a + b;"
+                           "    for (var j = 0; j < 5; j = j + 1) {"
+                           "        var k = j * 2;"
+                           "        if (j == 3) break;"
+                           "        print k;"
+                           "    }"
+                           "    var c = \"c\";"
+                           "    print b + c;"
+                           "}"
+                           "h();";
+
+    const char *cases[][2] = {
+            {program1, "0\n1\n2\n"},
+            {program2, "0\n1\n7\nab\n0\n2\n4\nbc\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
 void testSwitchStatement() {
     const char *program1 = "var a = 1;"
                            "switch(a) {"
@@ -295,6 +354,250 @@ void testSwitchStatement() {
     TEST_PROGRAMS(cases);
 }
 
+void testSwitchTables() {
+    const char *program1 = "fun name(n) {"
+                           "    switch (n) {"
+                           "        case 1: return \"one\";"
+                           "        case 2: return \"two\";"
+                           "        case 3:"
+                           "        case 4: return \"three or four\";"
+                           "        case 1: return \"shadowed\";"
+                           "        default: return \"many\";"
+                           "    }"
+                           "}"
+                           "for (var i = 0; i < 6; i = i + 1) {"
+                           "    print name(i);"
+                           "}"
+                           "print name(1.5);"
+                           "print name(\"1\");";
+
+    const char *program2 = "fun kind(s) {"
+                           "    var r = \"\";"
+                           "    switch (s) {"
+                           "        case \"a\": r = r + \"A\";"
+                           "        case \"b\": r = r + \"B\"; break;"
+                           "        case 1000: r = r + \"K\";"
+                           "        case \"c\": r = r + \"C\";"
+                           "    }"
+                           "    return r;"
+                           "}"
+                           "print kind(\"a\");"
+                           "print kind(\"b\");"
+                           "print kind(1000);"
+                           "print kind(\"d\") == \"\";";
+
+    const char *program3 = "var x = 10;"
+                           "fun mixed(v) {"
+                           "    switch (v) {"
+                           "        case 1: print \"one\";"
+                           "        case x: print \"x\"; break;"
+                           "        case 20: print \"twenty\";"
+                           "        default: print \"default\";"
+                           "    }"
+                           "}"
+                           "mixed(1);"
+                           "mixed(10);"
+                           "mixed(20);"
+                           "mixed(5);"
+                           "fun late(v) {"
+                           "    switch (v) {"
+                           "        case 1: print 1; break;"
+                           "        default: print \"default\";"
+                           "        case 2: print 2;"
+                           "    }"
+                           "}"
+                           "late(1);"
+                           "late(2);";
+
+    const char *cases[][2] = {
+            {program1, "many\none\ntwo\nthree or four\nthree or four\nmany\nmany\nmany\n"},
+            {program2, "AB\nB\nKC\ntrue\n"},
+            {program3, "one\nx\nx\ntwenty\ndefault\ndefault\n1\ndefault\n2\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testHotLoops() {
+    // Long enough to get traced in builds with the JIT, then taking paths and types the trace hasn't seen.
+    const char *program1 = "fun run(n) {"
+                           "    var small = 0;"
+                           "    var big = 0;"
+                           "    var last = nil;"
+                           "    for (var i = 0; i < n; i = i + 1) {"
+                           "        if (i < 150) {"
+                           "            small = small + i;"
+                           "        } else {"
+                           "            big = big + i * 2;"
+                           "        }"
+                           "        last = i >= 190 and i;"
+                           "    }"
+                           "    print small;"
+                           "    print big;"
+                           "    print last;"
+                           "}"
+                           "run(200);"
+                           "run(10);";
+
+    const char *program2 = "var values = [];"
+                           "for (var i = 0; i < 200; i = i + 1) {"
+                           "    append(values, i);"
+                           "}"
+                           "values[180] = \"x\";"
+                           "var sum = 0;"
+                           "var strings = 0;"
+                           "var i = 0;"
+                           "while (i < 200) {"
+                           "    if (values[i] == \"x\") {"
+                           "        strings = strings + 1;"
+                           "    } else {"
+                           "        sum = sum + values[i];"
+                           "    }"
+                           "    i = i + 1;"
+                           "}"
+                           "print sum;"
+                           "print strings;";
+
+    const char *program3 = "var total = 0;"
+                           "for (var i = 0; i < 300; i = i + 1) {"
+                           "    total = total + i;"
+                           "    if (i == 250) {"
+                           "        total = \"total\";"
+                           "    }"
+                           "}";
+
+    const char *cases[][2] = {
+            {program1, "11175\n17450\n199\n45\n0\nfalse\n"},
+            {program2, "19720\n1\n"},
+            {program3, "Operands must be two numbers or two strings.\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testOptimizations() {
+    const char *program1 = "print 1 + 2 * 3 - 4 / 2;"
+                           "print -(2 + 3);"
+                           "print !(1 < 2);"
+                           "print \"a\" == \"a\";"
+                           "print nil == false;"
+                           "if (false) print \"never\"; else print \"else\";"
+                           "while (false) print \"never\";";
+
+    const char *program2 = "var a = false;"
+                           "var b = true;"
+                           "if (a and b and a) print \"and\"; else print \"not and\";"
+                           "if (a or b or a) print \"or\";"
+                           "var n = 0;"
+                           "while (true) {"
+                           "    n = n + 1;"
+                           "    if (n == 5) break;"
+                           "}"
+                           "print n;"
+                           "fun f() {"
+                           "    return 1;"
+                           "    print \"unreachable\";"
+                           "}"
+                           "print f();";
+
+    // Copies between locals must not outlive writes to either side or the scope of the source.
+    const char *program3 = "fun h() {"
+                           "    var a = 1;"
+                           "    var b = 2;"
+                           "    a = b;"
+                           "    b = 5;"
+                           "    print a + b;"
+                           "    var c = 0;"
+                           "    c = a;"
+                           "    a = 3;"
+                           "    print c;"
+                           "    {"
+                           "        var y = 8;"
+                           "        a = y;"
+                           "    }"
+                           "    {"
+                           "        var z = 9;"
+                           "        print a;"
+                           "        print z;"
+                           "    }"
+                           "}"
+                           "h();";
+
+    const char *program4 = "print 1 - \"a\";";
+
+    const char *cases[][2] = {
+            {program1, "5\n-5\nfalse\ntrue\nfalse\nelse\n"},
+            {program2, "not and\nor\n5\n1\n"},
+            {program3, "7\n2\n8\n9\n"},
+            {program4, "Operands must be numbers.\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testTypeInference() {
+    const char *program1 = "fun f() {"
+                           "    var total = 0;"
+                           "    var half = 0;"
+                           "    for (var i = 0; i < 5; i = i + 1) {"
+                           "        total = total + i * i;"
+                           "        half = half + i / 2;"
+                           "    }"
+                           "    var squares = [0, 0, 0];"
+                           "    for (var j = 0; j < 3; j = j + 1) {"
+                           "        squares[j] = j * j;"
+                           "    }"
+                           "    print total;"
+                           "    print half;"
+                           "    print squares[2] > squares[1];"
+                           "}"
+                           "f();";
+
+    // Locals that can hold anything else on some path, or that a closure can write, stay checked.
+    const char *program2 = "fun f(flag) {"
+                           "    var x = 1;"
+                           "    if (flag) x = \"s\";"
+                           "    print x + x;"
+                           "    var k = 1;"
+                           "    fun set() { k = \"k\"; }"
+                           "    set();"
+                           "    print k + k;"
+                           "}"
+                           "f(true);";
+
+    const char *program3 = "fun f() {"
+                           "    var a = [1, 2];"
+                           "    var i = 0;"
+                           "    var sum = 0;"
+                           "    while (i < 3) {"
+                           "        sum = sum + a[i];"
+                           "        i = i + 1;"
+                           "    }"
+                           "}"
+                           "f();";
+
+    const char *program4 = "fun f() {"
+                           "    var a = [1, 2];"
+                           "    var i = 0;"
+                           "    i = i - 1;"
+                           "    a[i] = 3;"
+                           "}"
+                           "f();";
+
+    const char *program5 = "fun f() {"
+                           "    var a = [1, 2];"
+                           "    var i = 0.5;"
+                           "    print a[i];"
+                           "}"
+                           "f();";
+
+    const char *cases[][2] = {
+            {program1, "30\n5\ntrue\n"},
+            {program2, "ss\nkk\n"},
+            {program3, "array index is out of bounds.\n[line 1] in f()\n[line 1] in script\n"},
+            {program4, "array index should be positive.\n[line 1] in f()\n[line 1] in script\n"},
+            {program5, "array index should be an integer.\n[line 1] in f()\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
 void setUp() {
 
 }
@@ -308,6 +611,11 @@ int main() {
     RUN_TEST(testIfStatement);
     RUN_TEST(testWhileStatement);
     RUN_TEST(testForStatement);
+    RUN_TEST(testLoopVariableCopies);
     RUN_TEST(testSwitchStatement);
+    RUN_TEST(testSwitchTables);
+    RUN_TEST(testHotLoops);
+    RUN_TEST(testOptimizations);
+    RUN_TEST(testTypeInference);
     return UNITY_END();
 }
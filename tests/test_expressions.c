@@ -39,6 +39,10 @@ void testBooleanExpressions() {
             {"23 and nil and 29",                        "nil"},
             {"true ? 1 : 0",                             "1"},
             {"29 > 31 ? false : 31 > 29 ? true : false", "true"},
+            {"(0 / 0) <= 1",                             "true"},
+            {"(0 / 0) >= 1",                             "true"},
+            {"1 <= 0 / 0",                               "true"},
+            {"(0 / 0) < 1 or (0 / 0) > 1",               "false"},
     };
     TEST_EXPRESSIONS(cases);
 }
@@ -56,6 +60,188 @@ void testStringExpressions() {
     TEST_EXPRESSIONS(cases);
 }
 
+void testChangingOperandTypes() {
+    const char *program1 = "fun add(a, b) { return a + b; }"
+                           "fun less(a, b) { return a < b; }"
+                           "print add(1, 2);"
+                           "print add(\"a\", \"b\");"
+                           "print add(3, 4);"
+                           "print less(1, 2);"
+                           "print less(2, 1);";
+
+    const char *program2 = "fun at(array, i) { return array[i]; }"
+                           "fun put(array, i, v) { return array[i] = v; }"
+                           "var xs = [1, 2, 3];"
+                           "print at(xs, 2);"
+                           "print put(xs, 0, 9);"
+                           "print at([4], 0) + xs[0];"
+                           "print xs;";
+
+    const char *program3 = "fun less(a, b) { return a < b; }"
+                           "print less(1, 2);"
+                           "print less(\"a\", 2);";
+
+    const char *program4 = "fun put(array, i, v) { return array[i] = v; }"
+                           "var xs = [1, 2, 3];"
+                           "put(xs, 0, 9);"
+                           "put(xs, 1.5, 0);";
+
+    const char *cases[][2] = {
+            {program1, "3\nab\n7\ntrue\nfalse\n"},
+            {program2, "3\n9\n13\n[9, 2, 3]\n"},
+            {program3, "Operands must be numbers.\n[line 1] in less()\n[line 1] in script\n"},
+            {program4, "array index should be an integer.\n[line 1] in put()\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+// "a <= b" is "!(a > b)" and "a >= b" is "!(a < b)", so both are true for NaN, in every variant of the
+// instructions: generic, quickened, unchecked and compiled.
+void testNaNComparisons() {
+    const char *program1 = "fun le(a, b) { return a <= b; }"
+                           "fun ge(a, b) { return a >= b; }"
+                           "var nan = 0 / 0;"
+                           "print le(nan, 1);"
+                           "print ge(nan, 1);"
+                           "print le(1, nan);"
+                           "print ge(1, nan);"
+                           "var n = 0;"
+                           "for (var i = 0; i < 300; i = i + 1) {"
+                           "    if (le(nan, i) and ge(i, nan)) n = n + 1;"
+                           "}"
+                           "print n;";
+
+    const char *program2 = "fun loop() {"
+                           "    var x = 0 / 0;"
+                           "    var k = 0;"
+                           "    while (k <= x) {"
+                           "        k = k + 1;"
+                           "        if (k > 2) return k;"
+                           "    }"
+                           "    return k;"
+                           "}"
+                           "fun hot() {"
+                           "    var x = 0 / 0;"
+                           "    var c = 0;"
+                           "    for (var i = 0; i < 1000; i = i + 1) {"
+                           "        if (i >= x) c = c + 1;"
+                           "        if (x <= i) c = c + 1;"
+                           "    }"
+                           "    return c;"
+                           "}"
+                           "print loop();"
+                           "print hot();";
+
+    const char *cases[][2] = {
+            {program1, "true\ntrue\ntrue\ntrue\n300\n"},
+            {program2, "3\n2000\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testLocalAssignments() {
+    const char *program1 = "fun f() {"
+                           "    var a = 1;"
+                           "    var b = 2;"
+                           "    var s = \"x\";"
+                           "    a = b;"
+                           "    print a;"
+                           "    a = a + b;"
+                           "    print a;"
+                           "    b = 10 - a;"
+                           "    print b;"
+                           "    a = b * 3;"
+                           "    print a;"
+                           "    a = a / 4;"
+                           "    print a;"
+                           "    s = s + \"y\";"
+                           "    print s;"
+                           "    s = \"z\";"
+                           "    print s;"
+                           "}"
+                           "f();";
+
+    const char *program2 = "fun f() {"
+                           "    var a = 1;"
+                           "    var s = \"x\";"
+                           "    a = s - 1;"
+                           "}"
+                           "f();";
+
+    const char *program3 = "fun f() {"
+                           "    var a = 1;"
+                           "    var s = \"x\";"
+                           "    a = s + a;"
+                           "}"
+                           "f();";
+
+    const char *cases[][2] = {
+            {program1, "2\n4\n6\n18\n4.5\nxy\nz\n"},
+            {program2, "Operands must be numbers.\n[line 1] in f()\n[line 1] in script\n"},
+            {program3, "Operands must be two numbers or two strings.\n[line 1] in f()\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testConstants() {
+    const char *program1 = "const DAY = 60 * 60 * 24;"
+                           "const NAME = \"a\" + \"b\";"
+                           "print DAY;"
+                           "print NAME + \"c\";"
+                           "print DAY > 1000 ? \"long\" : \"short\";"
+                           "print nil ? 1 : -(2 * 3);"
+                           "print !nil == true;";
+
+    const char *program2 = "const LIMIT = 10;"
+                           "fun f() {"
+                           "    const HALF = LIMIT / 2;"
+                           "    fun g() { return HALF + LIMIT; }"
+                           "    return g();"
+                           "}"
+                           "print f();"
+                           "{"
+                           "    var LIMIT = 1;"
+                           "    print LIMIT;"
+                           "}";
+
+    const char *program3 = "const a = 1;"
+                           "var a = 2;";
+
+    const char *program4 = "print 1 + \"a\";";
+
+    const char *cases[][2] = {
+            {program1, "86400\nabc\nlong\n-6\ntrue\n"},
+            {program2, "15\n1\n"},
+            {program3, "[line 1] Error at 'a': Cannot redeclare a constant variable.\n"},
+            {program4, "Operands must be two numbers or two strings.\n[line 1] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testSharedConstants() {
+    const char *program1 = "var a = \"x\";"
+                           "var b = \"x\";"
+                           "print a == b;"
+                           "print 0;"
+                           "print -0;"
+                           "print 1 / 0;"
+                           "print -1 / 0;";
+
+    const char *program2 = "class P { init(x) { this.x = x; } }"
+                           "var p = P(1);"
+                           "var q = P(2);"
+                           "p.x = p.x + q.x;"
+                           "q.x = p.x + q.x;"
+                           "print p.x;"
+                           "print q.x;";
+
+    const char *cases[][2] = {
+            {program1, "true\n0\n-0\ninf\n-inf\n"},
+            {program2, "3\n5\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
 void setUp() {
 
 }
@@ -69,5 +255,10 @@ int main() {
     RUN_TEST(testArithmeticExpressions);
     RUN_TEST(testBooleanExpressions);
     RUN_TEST(testStringExpressions);
+    RUN_TEST(testChangingOperandTypes);
+    RUN_TEST(testNaNComparisons);
+    RUN_TEST(testLocalAssignments);
+    RUN_TEST(testConstants);
+    RUN_TEST(testSharedConstants);
     return UNITY_END();
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "unity.h"
+#include "../src/vm.h"
 
 void testFunctions() {
     const char *program1 = "fun sum(a, b) {"
@@ -103,6 +104,378 @@ void testNativeStrFunction() {
     TEST_PROGRAMS(cases);
 }
 
+void testTailCalls() {
+    const char *program1 = "fun count(n, acc) {"
+                           "    if (n == 0) return acc;"
+                           "    return count(n - 1, acc + 1);"
+                           "}"
+                           "print count(100000, 0);"
+                           "fun isEven(n) {"
+                           "    if (n == 0) return true;"
+                           "    return isOdd(n - 1);"
+                           "}"
+                           "fun isOdd(n) {"
+                           "    if (n == 0) return false;"
+                           "    return isEven(n - 1);"
+                           "}"
+                           "print isEven(10001);";
+
+    const char *program2 = "var saved;"
+                           "fun keep(n) {"
+                           "    var local = n * 10;"
+                           "    fun get() {"
+                           "        return local;"
+                           "    }"
+                           "    if (n == 3) saved = get;"
+                           "    if (n == 0) return str(saved());"
+                           "    return keep(n - 1);"
+                           "}"
+                           "print keep(5);"
+                           "class Walker {"
+                           "    init(steps) {"
+                           "        this.steps = steps;"
+                           "    }"
+                           "    walk(n) {"
+                           "        if (n == this.steps) return n;"
+                           "        var next = this.walk;"
+                           "        return next(n + 1);"
+                           "    }"
+                           "}"
+                           "print Walker(1000).walk(0);"
+                           "fun make(steps) {"
+                           "    return Walker(steps);"
+                           "}"
+                           "print make(3).steps;"
+                           "fun either(flag) {"
+                           "    return flag and str(flag);"
+                           "}"
+                           "print either(false);"
+                           "print either(true);";
+
+    const char *program3 = "fun f(a) {"
+                           "    return f(a, a);"
+                           "}"
+                           "f(1);";
+
+    const char *program4 = "class Counter {"
+                           "    count(n) {"
+                           "        if (n == 0) return \"done\";"
+                           "        return this.count(n - 1);"
+                           "    }"
+                           "}"
+                           "print Counter().count(100000);"
+                           "class Parity {"
+                           "    even(n, other) {"
+                           "        if (n == 0) return true;"
+                           "        return other.odd(n - 1, this);"
+                           "    }"
+                           "    odd(n, other) {"
+                           "        if (n == 0) return false;"
+                           "        return other.even(n - 1, this);"
+                           "    }"
+                           "}"
+                           "print Parity().even(100001, Parity());"
+                           "class Down < Counter {"
+                           "    count(n) {"
+                           "        return super.count(n);"
+                           "    }"
+                           "    skip(n) {"
+                           "        if (n == 0) return \"skipped\";"
+                           "        return super.count(n);"
+                           "    }"
+                           "}"
+                           "print Down().count(100000);"
+                           "print Down().skip(100000);";
+
+    const char *cases[][2] = {
+            {program1, "100000\nfalse\n"},
+            {program2, "30\n1000\n3\nfalse\ntrue\n"},
+            {program3, "Expected 1 arguments but got 2.\n[line 1] in f()\n[line 1] in script\n"},
+            {program4, "done\nfalse\ndone\ndone\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testDeepRecursion() {
+    const char *program1 = "fun depth(n) {"
+                           "    if (n == 0) return 0;"
+                           "    return 1 + depth(n - 1);"
+                           "}"
+                           "print depth(3000);";
+
+    // Upvalues still open while the stack grows have to follow it.
+    const char *program2 = "var getters = [];"
+                           "fun nest(n) {"
+                           "    var local = n;"
+                           "    fun get() {"
+                           "        return local;"
+                           "    }"
+                           "    append(getters, get);"
+                           "    if (n == 0) {"
+                           "        var sum = 0;"
+                           "        for (var i = 0; i < 1000; i = i + 1) {"
+                           "            sum = sum + getters[i]();"
+                           "        }"
+                           "        return sum;"
+                           "    }"
+                           "    var result = nest(n - 1);"
+                           "    local = -1;"
+                           "    return result;"
+                           "}"
+                           "print nest(999);"
+                           "print getters[0]() + getters[999]();";
+
+    const char *cases[][2] = {
+            {program1, "3000\n"},
+            {program2, "499500\n-1\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+// Local functions that are only ever called read their caller's variables from its frame.
+void testStackClosures() {
+    const char *program1 = "fun sum(n) {"
+                           "    var total = 0;"
+                           "    fun add(x) { total = total + x; }"
+                           "    for (var i = 0; i < n; i = i + 1) add(i);"
+                           "    return total;"
+                           "}"
+                           "print sum(10);"
+                           "fun tail(n) {"
+                           "    var base = n;"
+                           "    fun inc(x) { return base + x; }"
+                           "    return inc(1);"
+                           "}"
+                           "print tail(41);"
+                           "{"
+                           "    var x = \"block\";"
+                           "    fun show() { print x; }"
+                           "    show();"
+                           "    x = \"changed\";"
+                           "    show();"
+                           "}";
+
+    // Stored, recursive or sharing their upvalues with nested functions, closures keep their upvalues.
+    const char *program2 = "fun outer() {"
+                           "    var a = 1;"
+                           "    fun get() { return a; }"
+                           "    fun keep() { return a * 10; }"
+                           "    var k = keep;"
+                           "    a = 5;"
+                           "    print get();"
+                           "    return k;"
+                           "}"
+                           "print outer()();"
+                           "fun countdown() {"
+                           "    var n = 3;"
+                           "    fun down() { if (n > 0) { n = n - 1; down(); } }"
+                           "    down();"
+                           "    return n;"
+                           "}"
+                           "print countdown();"
+                           "fun nest() {"
+                           "    var a = \"a\";"
+                           "    fun mid() {"
+                           "        var b = \"b\";"
+                           "        fun inner() { return a + b; }"
+                           "        return inner();"
+                           "    }"
+                           "    return mid();"
+                           "}"
+                           "print nest();";
+
+    // The stack growing under a stack closure moves the frame it reads from.
+    const char *program3 = "fun depth(n) {"
+                           "    if (n == 0) return 0;"
+                           "    return 1 + depth(n - 1);"
+                           "}"
+                           "fun grow() {"
+                           "    var label = \"depth \";"
+                           "    fun deep() { return label + str(depth(3000)); }"
+                           "    return deep();"
+                           "}"
+                           "print grow();";
+
+    const char *cases[][2] = {
+            {program1, "45\n42\nblock\nchanged\n"},
+            {program2, "5\n50\n0\nab\n"},
+            {program3, "depth 3000\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+// Closures copy the variables nothing assigns, and share the others.
+void testCapturedValues() {
+    const char *program1 = "fun adder(n) {"
+                           "    fun add(x) { return x + n; }"
+                           "    return add;"
+                           "}"
+                           "print adder(5)(10);"
+                           "fun chain(a) {"
+                           "    var b = a * 2;"
+                           "    fun mid() {"
+                           "        var c = b + 1;"
+                           "        fun inner() { return a + b + c; }"
+                           "        return inner;"
+                           "    }"
+                           "    return mid;"
+                           "}"
+                           "print chain(1)()();"
+                           "fun selfRef() {"
+                           "    fun fact(n) { if (n < 2) return 1; return n * fact(n - 1); }"
+                           "    return fact;"
+                           "}"
+                           "print selfRef()(5);"
+                           "{"
+                           "    class Local { name() { return Local; } }"
+                           "    print Local().name();"
+                           "}";
+
+    const char *program2 = "fun late() {"
+                           "    var x = 1;"
+                           "    fun get() { return x; }"
+                           "    x = 2;"
+                           "    return get;"
+                           "}"
+                           "print late()();"
+                           "fun loop() {"
+                           "    var x = 0;"
+                           "    var gs = [];"
+                           "    while (x < 3) {"
+                           "        fun g() { return x; }"
+                           "        append(gs, g);"
+                           "        x = x + 1;"
+                           "    }"
+                           "    return gs[0]() + gs[1]() + gs[2]();"
+                           "}"
+                           "print loop();"
+                           "fun counter() {"
+                           "    var n = 0;"
+                           "    fun outer() {"
+                           "        fun inc() { n = n + 1; return n; }"
+                           "        return inc;"
+                           "    }"
+                           "    return outer();"
+                           "}"
+                           "var inc = counter();"
+                           "inc();"
+                           "print inc();";
+
+    const char *cases[][2] = {
+            {program1, "15\n6\n120\nLocal\n"},
+            {program2, "2\n9\n2\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+void testInlining() {
+    const char *program1 = "fun sq(x) { return x * x; }\n"
+                           "fun abs(x) {\n"
+                           "    if (x < 0) return -x;\n"
+                           "    return x;\n"
+                           "}\n"
+                           "fun hyp(a, b) { return sq(a) + sq(b); }\n"
+                           "fun f() {\n"
+                           "    var t = 0;\n"
+                           "    for (var i = -3; i < 3; i = i + 1) {\n"
+                           "        t = t + sq(i) + abs(i) + hyp(i, 1);\n"
+                           "    }\n"
+                           "    return t;\n"
+                           "}\n"
+                           "print f() + sq(3);";
+
+    const char *program2 = "fun sq(x) { return x * x; }\n"
+                           "fun hyp(a) {\n"
+                           "    return sq(a) + 1;\n"
+                           "}\n"
+                           "fun k() { return 1 + hyp(\"s\"); }\n"
+                           "print k();";
+
+    const char *program3 = "fun sq(x) { return x * x; }\n"
+                           "var before = sq(2);\n"
+                           "sq = str;\n"
+                           "fun f() { return sq(3); }\n"
+                           "print str(before) + f();";
+
+    const char *program4 = "fun f() { return g(); }\n"
+                           "print f();\n"
+                           "fun g() { return 1; }";
+
+    const char *cases[][2] = {
+            {program1, "62\n"},
+            {program2, "Operands must be numbers.\n[line 1] in sq()\n[line 3] in hyp()\n[line 5] in k()\n[line 6] in script\n"},
+            {program3, "43\n"},
+            {program4, "Undefined variable 'g'.\n[line 1] in f()\n[line 2] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+}
+
+static void lazyCompilation() {
+    useLazyCompilation(true);
+}
+
+void testLazyCompilation() {
+    const char *program1 = "fun add(a, b) {\n"
+                           "    var sum = a + b;\n"
+                           "    fun plus(x) { return x + sum; }\n"
+                           "    return plus(1);\n"
+                           "}\n"
+                           "fun unused(x) { return x +; }\n"
+                           "fun count(n, acc) {\n"
+                           "    if (n == 0) return acc;\n"
+                           "    return count(n - 1, acc + 1);\n"
+                           "}\n"
+                           "print add(2, 3) + count(1000, 0);";
+
+    const char *program2 = "fun f(a) {\n"
+                           "    return a * 2;\n"
+                           "}\n"
+                           "print f();";
+
+    const char *program3 = "fun f() {\n"
+                           "    var = 1;\n"
+                           "}\n"
+                           "f();";
+
+    const char *program4 = "fun f() {\n"
+                           "    return 1;\n";
+
+    const char *program5 = "fun f(x) {\n"
+                           "    return x * \"s\";\n"
+                           "}\n"
+                           "print f(2);";
+
+    const char *cases[][2] = {
+            {program1, "1006\n"},
+            {program2, "Expected 1 arguments but got 0.\n[line 4] in script\n"},
+            {program3, "[line 2] Error at '=': Expected variable name.\nCould not compile f().\n[line 4] in script\n"},
+            {program4, "[line 3] Error at end: Expected '}' after a block.\n"},
+            {program5, "Operands must be numbers.\n[line 2] in f()\n[line 4] in script\n"},
+    };
+    TEST_PROGRAMS_WITH(lazyCompilation, cases);
+
+    // A body compiled on its first call only folds the consts declared before it, like it would eagerly.
+    const char *program6 = "fun f() { return K; }\n"
+                           "print f();\n"
+                           "const K = 1;";
+
+    const char *program7 = "fun f() { K = 2; }\n"
+                           "const K = 1;\n"
+                           "print K;";
+
+    const char *program8 = "const K = 1;\n"
+                           "fun f() { return K + 1; }\n"
+                           "print f();";
+
+    const char *constCases[][2] = {
+            {program6, "Undefined variable 'K'.\n[line 1] in f()\n[line 2] in script\n"},
+            {program7, "1\n"},
+            {program8, "2\n"},
+    };
+    TEST_PROGRAMS(constCases);
+    TEST_PROGRAMS_WITH(lazyCompilation, constCases);
+}
+
 void setUp() {
 
 }
@@ -115,5 +488,11 @@ int main() {
     UNITY_BEGIN();
     RUN_TEST(testFunctions);
     RUN_TEST(testNativeStrFunction);
+    RUN_TEST(testTailCalls);
+    RUN_TEST(testDeepRecursion);
+    RUN_TEST(testStackClosures);
+    RUN_TEST(testCapturedValues);
+    RUN_TEST(testInlining);
+    RUN_TEST(testLazyCompilation);
     return UNITY_END();
 }
\ No newline at end of file
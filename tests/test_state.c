@@ -1,3 +1,7 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "common.h"
 #include "unity.h"
 #include "../src/compiler.h"
@@ -97,6 +101,268 @@ void testScope() {
     testPrograms(cases, sizeof(cases) / sizeof(cases[0]));
 }
 
+void testBytecodeFiles() {
+    const char *program1 = "var greeting = \"hello\";\n"
+                           "const answer = 42;\n"
+                           "fun sq(x) { return x * x; }\n"
+                           "fun adder(n) {\n"
+                           "    fun add(x) { return x + n; }\n"
+                           "    return add;\n"
+                           "}\n"
+                           "class Point {\n"
+                           "    init(x, y) { this.x = x; this.y = y; }\n"
+                           "    norm() { return sq(this.x) + sq(this.y); }\n"
+                           "}\n"
+                           "fun name(n) {\n"
+                           "    switch (n) {\n"
+                           "        case 1: return \"one\";\n"
+                           "        case 2: return \"two\";\n"
+                           "        case \"x\": return \"ex\";\n"
+                           "        default: return nil;\n"
+                           "    }\n"
+                           "}\n"
+                           "print greeting + \" \" + str(answer);\n"
+                           "print adder(2)(3) + Point(3, 4).norm();\n"
+                           "print name(2) + name(\"x\");\n"
+                           "print [true, false, nil, 1.5];";
+
+    const char *program2 = "fun sq(x) {\n"
+                           "    return x * x;\n"
+                           "}\n"
+                           "fun f() { return 1 + sq(\"s\"); }\n"
+                           "print f();";
+
+    const char *cases[][2] = {
+            {program1, "hello 42\n30\ntwoex\n[true, false, nil, 1.5]\n"},
+            {program2, "Operands must be numbers.\n[line 2] in sq()\n[line 4] in f()\n[line 5] in script\n"},
+    };
+    TEST_BYTECODE_PROGRAMS(cases);
+}
+
+static uint8_t *findInstruction(ObjFunction *script, OpCode op) {
+    Chunk *chunk = &script->chunk;
+    int offset = 0;
+    while (chunk->code[offset] != op) {
+        offset += instructionLength(chunk, offset);
+    }
+    return &chunk->code[offset];
+}
+
+static void unknownOpcode(ObjFunction *script) {
+    script->chunk.code[0] = UINT8_MAX;
+}
+
+static void missingConstant(ObjFunction *script) {
+    findInstruction(script, OP_CONSTANT)[3] = UINT8_MAX;
+}
+
+static void missingGlobal(ObjFunction *script) {
+    findInstruction(script, OP_DEFINE_GLOBAL)[2] = UINT8_MAX;
+}
+
+static void jumpIntoInstruction(ObjFunction *script) {
+    findInstruction(script, OP_JUMP_IF_NOT_LESS)[1]++;
+}
+
+static void loopOutOfCode(ObjFunction *script) {
+    uint8_t *loop = findInstruction(script, OP_LOOP);
+    loop[1] = UINT8_MAX;
+    loop[2] = UINT8_MAX;
+}
+
+// Loading checks the code, so a damaged file gets refused instead of run.
+void testCorruptedBytecodeFiles() {
+    const char *cases[][2] = {
+            {"var n = 0;\n"
+             "while (n < 3) n = n + 1;\n"
+             "print n;", "Broken bytecode file or snapshot.\n"},
+    };
+    TEST_CORRUPTED_BYTECODE_PROGRAMS(unknownOpcode, cases);
+    TEST_CORRUPTED_BYTECODE_PROGRAMS(missingConstant, cases);
+    TEST_CORRUPTED_BYTECODE_PROGRAMS(missingGlobal, cases);
+    TEST_CORRUPTED_BYTECODE_PROGRAMS(jumpIntoInstruction, cases);
+    TEST_CORRUPTED_BYTECODE_PROGRAMS(loopOutOfCode, cases);
+}
+
+// Runs a prelude, snapshots the globals it leaves and runs programs in VMs restored from that.
+void testSnapshots() {
+    const char *prelude = "const limit = 3;\n"
+                          "var greeting = \"hello\";\n"
+                          "var numbers = [1, 2, [3]];\n"
+                          "class Point {\n"
+                          "    init(x, y) { this.x = x; this.y = y; }\n"
+                          "    sum() { return this.x + this.y; }\n"
+                          "}\n"
+                          "var point = Point(4, 5);\n"
+                          "var sum = point.sum;\n"
+                          "fun counter() {\n"
+                          "    var n = 0;\n"
+                          "    fun next() { n = n + 1; return n; }\n"
+                          "    return next;\n"
+                          "}\n"
+                          "var next = counter();\n"
+                          "next();\n"
+                          "var root = sqrt;\n"
+                          "var fields = Point(1, 2);\n"
+                          "deleteField(fields, \"x\");\n"
+                          "fun fail(x) { return 2 * x; }\n"
+                          "fun sq(x) { return x * x; }\n"
+                          "fun useSq(x) { return sq(x) + 1; }";
+
+    const char *cases[][2] = {
+            {"print limit + numbers[2][0];", "6\n"},
+            {"print greeting + \" \" + str(point.x);", "hello 4\n"},
+            {"print sum() + Point(1, 1).sum();", "11\n"},
+            {"print next(); print next();", "2\n3\n"},
+            {"print root(16) + getField(fields, \"y\");", "6\n"},
+            {"var limit = 1;", "[line 1] Error at 'limit': Cannot redeclare a constant variable.\n"},
+            {"fail(\"s\");", "Operands must be numbers.\n[line 20] in fail()\n[line 1] in script\n"},
+            {"print useSq(3); fun sq2(x) { return 0; } sq = sq2; print useSq(3);", "10\n1\n"},
+    };
+    TEST_SNAPSHOT_PROGRAMS(prelude, cases);
+}
+
+// before, then part printed with the numbers 0 to count - 1, then after.
+static char *generate(const char *before, const char *part, int count, const char *after) {
+    size_t partLength = strlen(part) + 16;
+    char *source = malloc(strlen(before) + partLength * count + strlen(after) + 1);
+    char *end = source + sprintf(source, "%s", before);
+    for (int i = 0; i < count; i++) {
+        end += sprintf(end, part, i);
+    }
+    strcpy(end, after);
+    return source;
+}
+
+// Programs past the limits of the short instructions: bodies too long for 16-bit jumps, more globals than 16
+// bits index, more arguments than a byte counts and more array elements than 16 bits count.
+void testLongOperands() {
+    char *jumps = generate("var x = 0;\n"
+                           "var n = 0;\n"
+                           "while (n < 2) {\n"
+                           "    if (n < 5) {\n",
+                           "        x = x + 1;\n", 12000,
+                           "    } else {\n"
+                           "        print n;\n"
+                           "    }\n"
+                           "    n = n + 1;\n"
+                           "}\n"
+                           "print x;");
+    char *globals = generate("", "var g%d = 1;\n", 33000, "g32999 = 2;\nprint g0 + g32999;");
+
+    char *params = generate("p", ", p%d", 300, "");
+    char *args = generate("0", ", %d", 300, "");
+    const char *calls = "fun sum(%s) { return p + p299; }\n"
+                        "fun tail(%s) { return sum(%s); }\n"
+                        "class A { m(%s) { return p299; } }\n"
+                        "class B < A { m(%s) { return super.m(%s) + 1; } }\n"
+                        "print sum(%s);\n"
+                        "print tail(%s);\n"
+                        "print B().m(%s);";
+    char *arguments = malloc(strlen(calls) + 6 * strlen(params) + 3 * strlen(args));
+    sprintf(arguments, calls, params, params, params, params, params, params, args, args, args);
+
+    char *array = generate("var a = [0", ", %d", 70000, "];\nprint a[70000] + a[1];");
+
+    // Slot 0 holds the function and slot 1 p, so p253 is the last parameter a closure can capture.
+    const char *captures = "fun low(%s) { fun get() { return p253; } return get(); }\n"
+                           "print low(%s);";
+    char *captured = malloc(strlen(captures) + strlen(params) + strlen(args));
+    sprintf(captured, captures, params, args);
+    const char *tooFar = "fun high(%s) { fun get() { return p254; } return get(); }";
+    char *uncaptured = malloc(strlen(tooFar) + strlen(params));
+    sprintf(uncaptured, tooFar, params);
+
+    const char *cases[][2] = {
+            {jumps, "24000\n"},
+            {arguments, "299\n299\n300\n"},
+            {array, "69999\n"},
+    };
+    TEST_PROGRAMS(cases);
+    TEST_BYTECODE_PROGRAMS(cases);
+
+    const char *captureCases[][2] = {
+            {captured, "253\n"},
+            {uncaptured, "[line 1] Error at 'p254': Can't capture a local variable past the first 256 slots of a "
+                         "function.\n"},
+    };
+    TEST_PROGRAMS(captureCases);
+
+    // Every global allocates its name, which makes this one slow with DEBUG_STRESS_GC, so it only runs once.
+    const char *globalCases[][2] = {
+            {globals, "3\n"},
+    };
+    TEST_PROGRAMS(globalCases);
+
+    free(jumps);
+    free(globals);
+    free(params);
+    free(args);
+    free(arguments);
+    free(array);
+    free(captured);
+    free(uncaptured);
+}
+
+// Runtime errors name the line of the failing instruction, which the line table finds by binary searching
+// the ends of its runs: past thousands of lines, on a line thousands of runs long, in the first run and in the
+// first byte of a run (the subtraction is compiled from the ')').
+void testLineNumbers() {
+    char *lines = generate("var x = 0;\n", "x = x - %d;\n", 3000, "x = x - nil;");
+    char *longLine = generate("var x = 0;\n", "x = x - %d; ", 3000, "\nx = -x;\nx = -nil;\nprint x;");
+    char *first = generate("nil - 1;\n", "print %d;\n", 1000, "");
+    char *function = generate("fun f(n) {\n", "    n = n - %d;\n", 2000, "    return n - nil;\n}\nprint f(1);");
+    char *group = generate("var x = 0;\n", "print %d;\n", 1000, "x = 1 - (nil\n);");
+
+    const char *cases[][2] = {
+            {lines, "Operands must be numbers.\n[line 3002] in script\n"},
+            {longLine, "Operand must be a number.\n[line 4] in script\n"},
+            {first, "Operands must be numbers.\n[line 1] in script\n"},
+            {function, "Operands must be numbers.\n[line 2002] in f()\n[line 2004] in script\n"},
+            {group, "Operands must be numbers.\n[line 1003] in script\n"},
+    };
+    TEST_PROGRAMS(cases);
+    TEST_BYTECODE_PROGRAMS(cases);
+
+    free(lines);
+    free(longLine);
+    free(first);
+    free(function);
+    free(group);
+}
+
+// Every instruction records the column of the token it was compiled from, a variable read the column where
+// its name starts. The reads sit in thousands of runs on one line, then one on the next.
+void testColumns() {
+    char *source = generate("var a = 1;\nprint a", " + a", 2000, ";\n  print  a;");
+
+    // Read i of line 2 starts at column 7 + 4 * i.
+    size_t size = 2002 * 16;
+    char *expected = malloc(size);
+    char *end = expected;
+    for (int i = 0; i <= 2000; i++) {
+        end += sprintf(end, "2:%d ", 7 + 4 * i);
+    }
+    strcpy(end, "3:10 ");
+
+    initVM();
+    ObjFunction *script = compile(source);
+    char *actual = calloc(size, 1);
+    end = actual;
+    Chunk *chunk = script == NULL ? NULL : &script->chunk;
+    for (int offset = 0; chunk != NULL && offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_GET_GLOBAL && end - actual < (long) size - 16) {
+            end += sprintf(end, "%u:%u ", getLine(&chunk->lines, offset), getColumn(&chunk->lines, offset));
+        }
+    }
+    freeVM();
+    UNITY_TEST_ASSERT_EQUAL_STRING(expected, actual, __LINE__, "Columns");
+
+    free(source);
+    free(expected);
+    free(actual);
+}
+
 void setUp() {
 
 }
@@ -110,5 +376,11 @@ int main() {
     RUN_TEST(testGlobalVariables);
     RUN_TEST(testAssignment);
     RUN_TEST(testScope);
+    RUN_TEST(testBytecodeFiles);
+    RUN_TEST(testCorruptedBytecodeFiles);
+    RUN_TEST(testSnapshots);
+    RUN_TEST(testLongOperands);
+    RUN_TEST(testLineNumbers);
+    RUN_TEST(testColumns);
     return UNITY_END();
 }